@@ -0,0 +1,51 @@
+# -*- coding: utf-8 -*-
+#
+# Heap allocations (malloc, calloc and realloc calls, Ruby's own included)
+# and the bytes they request per public_encrypt and private_decrypt.  Linux/glibc only: the script
+# builds bench/malloc_count.c and re-runs itself with it preloaded.
+#
+#   $ rake bench BENCH=alloc
+#   $ CURVES=prime256v1 ruby -Ilib bench/bench_alloc.rb
+#
+require 'rbconfig'
+require 'tmpdir'
+
+unless ENV['LD_PRELOAD'].to_s.include?('malloc_count')
+  shim = File.join(Dir.tmpdir, "malloc_count_#{Process.pid}.so")
+  source = File.expand_path('../malloc_count.c', __FILE__)
+  system(RbConfig::CONFIG['CC'], '-shared', '-fPIC', '-O2', '-o', shim, source) or abort 'cannot build malloc_count.c'
+  env = { 'LD_PRELOAD' => [shim, ENV['LD_PRELOAD']].compact.join(' ') }
+  status = system(env, RbConfig.ruby, *$LOAD_PATH.map { |dir| "-I#{dir}" }, __FILE__)
+  File.unlink(shim)
+  exit status
+end
+
+require 'fiddle'
+require 'openssl/pkey/ec/ies'
+
+malloc_count = Fiddle::Function.new(Fiddle::Handle::DEFAULT['malloc_count'], [], Fiddle::TYPE_LONG)
+malloc_bytes = Fiddle::Function.new(Fiddle::Handle::DEFAULT['malloc_bytes'], [], Fiddle::TYPE_LONG)
+curves = (ENV['CURVES'] || 'prime192v1,prime256v1,secp384r1').split(',')
+iterations = (ENV['ITERATIONS'] || 200).to_i
+payload = 'a' * (ENV['PAYLOAD'] || 128).to_i
+
+def per_op(counter, iterations)
+  GC.disable
+  before = counter.call
+  iterations.times { yield }
+  (counter.call - before).to_f / iterations
+ensure
+  GC.enable
+end
+
+curves.each do |curve|
+  ies = OpenSSL::PKey::EC::IES.new(OpenSSL::PKey::EC.new(curve).generate_key.to_pem, 'placeholder')
+  cryptogram = ies.public_encrypt(payload)
+  ies.private_decrypt(cryptogram)
+  encrypt = per_op(malloc_count, iterations) { ies.public_encrypt(payload) }
+  decrypt = per_op(malloc_count, iterations) { ies.private_decrypt(cryptogram) }
+  encrypt_bytes = per_op(malloc_bytes, iterations) { ies.public_encrypt(payload) }
+  decrypt_bytes = per_op(malloc_bytes, iterations) { ies.private_decrypt(cryptogram) }
+  printf("%-12s public_encrypt %7.1f allocs/op %10.0f B/op  private_decrypt %7.1f allocs/op %10.0f B/op\n",
+         curve, encrypt, encrypt_bytes, decrypt, decrypt_bytes)
+end
@@ -0,0 +1,33 @@
+# -*- coding: utf-8 -*-
+#
+# Per-message cost of encrypting and decrypting many small records one call
+# at a time versus in one public_encrypt_batch / private_decrypt_batch call.
+#
+#   $ rake bench BENCH=batch
+#   $ COUNT=10000 SIZE=200 ruby -Ilib bench/bench_batch.rb
+#   $ SUITE=ECIES-P384-AES256CBC-SHA384 ruby -Ilib bench/bench_batch.rb
+#
+require 'benchmark'
+require 'openssl/pkey/ec/ies'
+
+count = (ENV['COUNT'] || 10_000).to_i
+size = (ENV['SIZE'] || 200).to_i
+suite = OpenSSL::PKey::EC::IES::Suite[ENV['SUITE'] || 'ECIES-P256-AES128CBC-SHA256']
+pem = OpenSSL::PKey::EC.new(suite.curve).generate_key.to_pem
+ies = OpenSSL::PKey::EC::IES.new(pem, suite)
+records = Array.new(count) { |i| format('%08d', i) + 'r' * (size - 8) }
+cryptograms = ies.public_encrypt_batch(records)
+
+def usec_per_item(count)
+  best = 3.times.map { Benchmark.realtime { yield } }.min
+  best / count * 1e6
+end
+
+puts "#{suite}: #{count} records of #{size} bytes, microseconds per record"
+puts format('%-10s %10s %10s', '', 'loop', 'batch')
+puts format('%-10s %10.2f %10.2f', 'encrypt',
+            usec_per_item(count) { records.each { |r| ies.public_encrypt(r) } },
+            usec_per_item(count) { ies.public_encrypt_batch(records) })
+puts format('%-10s %10.2f %10.2f', 'decrypt',
+            usec_per_item(count) { cryptograms.each { |c| ies.private_decrypt(c) } },
+            usec_per_item(count) { ies.private_decrypt_batch(cryptograms) })
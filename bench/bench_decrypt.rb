@@ -0,0 +1,20 @@
+# -*- coding: utf-8 -*-
+#
+# private_decrypt operations per second per curve.
+#
+#   $ rake bench BENCH=decrypt
+#   $ CURVES=prime256v1 PAYLOAD=1024 ruby -Ilib bench/bench_decrypt.rb
+#
+require 'benchmark'
+require 'openssl/pkey/ec/ies'
+
+curves = (ENV['CURVES'] || 'prime192v1,prime256v1,secp384r1,secp521r1,secp256k1').split(',')
+iterations = (ENV['ITERATIONS'] || 500).to_i
+payload = 'a' * (ENV['PAYLOAD'] || 128).to_i
+
+curves.each do |curve|
+  ies = OpenSSL::PKey::EC::IES.new(OpenSSL::PKey::EC.new(curve).generate_key.to_pem, 'placeholder')
+  cryptogram = ies.public_encrypt(payload)
+  ops = iterations / Benchmark.realtime { iterations.times { ies.private_decrypt(cryptogram) } }
+  printf("%-12s %10.1f ops/s\n", curve, ops)
+end
@@ -0,0 +1,33 @@
+# -*- coding: utf-8 -*-
+#
+# The built-in curve code (p256.c, k256.c) against OpenSSL, per operation:
+# public_encrypt makes a key pair and an ECDH, private_decrypt decodes a
+# point and makes an ECDH.
+#
+#   $ rake bench BENCH=engines
+#   $ ITERATIONS=2000 ruby -Ilib bench/bench_engines.rb
+#
+require 'benchmark'
+require 'openssl/pkey/ec/ies'
+
+iterations = (ENV['ITERATIONS'] || 500).to_i
+payload = 'a' * 128
+
+def usec_per_op(iterations)
+  Benchmark.realtime { yield } / iterations * 1e6
+end
+
+{ 'prime256v1' => :p256, 'secp256k1' => :k256 }.each do |curve, option|
+  pem = OpenSSL::PKey::EC.new(curve).generate_key.to_pem
+  cryptograms = iterations.times.map { OpenSSL::PKey::EC::IES.new(pem, 'placeholder').public_encrypt(payload) }
+
+  { 'OpenSSL' => false, "#{option}.c" => true }.each do |name, engine|
+    ies = OpenSSL::PKey::EC::IES.new(pem, 'placeholder', option => engine)
+    encrypt = usec_per_op(iterations) { iterations.times { ies.public_encrypt(payload) } }
+    decrypt = usec_per_op(iterations) { cryptograms.each { |cryptogram| ies.private_decrypt(cryptogram) } }
+    encrypt_batch = usec_per_op(iterations) { ies.public_encrypt_batch([payload] * iterations) }
+    decrypt_batch = usec_per_op(iterations) { ies.private_decrypt_batch(cryptograms) }
+    printf("%-10s %-8s encrypt %8.1f  decrypt %8.1f  encrypt_batch %8.1f  decrypt_batch %8.1f us/op\n",
+           curve, name, encrypt, decrypt, encrypt_batch, decrypt_batch)
+  end
+end
@@ -0,0 +1,32 @@
+# -*- coding: utf-8 -*-
+#
+# private_decrypt with the ECDH of the x-only Montgomery ladder
+# (ladder: true) against OpenSSL's decompression and EC_POINT_mul
+# (ladder: false), per operation, one by one and in batches.
+#
+#   $ rake bench BENCH=ladder
+#   $ ITERATIONS=2000 ruby -Ilib bench/bench_ladder.rb
+#
+require 'benchmark'
+require 'openssl/pkey/ec/ies'
+
+iterations = (ENV['ITERATIONS'] || 500).to_i
+curves = (ENV['CURVES'] || 'prime192v1,secp224r1,secp256k1,prime256v1,secp384r1').split(',')
+payload = 'a' * 128
+
+def usec_per_op(iterations)
+  Benchmark.realtime { yield } / iterations * 1e6
+end
+
+curves.each do |curve|
+  pem = OpenSSL::PKey::EC.new(curve).generate_key.to_pem
+  # k256: false so that secp256k1 is left to OpenSSL or the ladder
+  openssl = OpenSSL::PKey::EC::IES.new(pem, 'placeholder', ladder: false, k256: false)
+  ladder = OpenSSL::PKey::EC::IES.new(pem, 'placeholder', ladder: true, k256: false)
+  cryptograms = openssl.public_encrypt_batch([payload] * iterations)
+  { 'openssl' => openssl, 'ladder' => ladder }.each do |name, ies|
+    decrypt = usec_per_op(iterations) { cryptograms.each { |cryptogram| ies.private_decrypt(cryptogram) } }
+    decrypt_batch = usec_per_op(iterations) { ies.private_decrypt_batch(cryptograms) }
+    printf("%-11s %-8s decrypt %8.1f  decrypt_batch %8.1f us/op\n", curve, name, decrypt, decrypt_batch)
+  end
+end
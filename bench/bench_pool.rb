@@ -0,0 +1,35 @@
+# -*- coding: utf-8 -*-
+#
+# public_encrypt served from the background KEM pool versus computing the
+# KEM inline.  Bursts no larger than the high watermark are separated by
+# pauses that let the producer refill the pool.
+#
+#   $ rake bench BENCH=pool
+#   $ CURVE=secp384r1 BURST=256 BURSTS=10 ruby -Ilib bench/bench_pool.rb
+#
+require 'benchmark'
+require 'openssl/pkey/ec/ies'
+
+curve = ENV['CURVE'] || 'prime192v1'
+burst = (ENV['BURST'] || 200).to_i
+bursts = (ENV['BURSTS'] || 5).to_i
+payload = 'a' * 128
+
+pem = OpenSSL::PKey::EC.new(curve).generate_key.to_pem
+plain = OpenSSL::PKey::EC::IES.new(pem, 'placeholder')
+pooled = OpenSSL::PKey::EC::IES.new(pem, 'placeholder', pool: { low: burst / 4, high: burst })
+
+def burst_ops(ies, payload, burst, bursts)
+  total = 0.0
+  bursts.times do
+    sleep 0.01 until ies.pool_stats.nil? || ies.pool_stats[:depth] >= burst
+    total += Benchmark.realtime { burst.times { ies.public_encrypt(payload) } }
+  end
+  burst * bursts / total
+end
+
+base = burst_ops(plain, payload, burst, bursts)
+ops = burst_ops(pooled, payload, burst, bursts)
+printf("%-12s inline %10.1f ops/s\n", curve, base)
+printf("%-12s pooled %10.1f ops/s  speedup=%.2fx\n", curve, ops, ops / base)
+p pooled.pool_stats
@@ -0,0 +1,29 @@
+# -*- coding: utf-8 -*-
+#
+# public_encrypt with and without the precomputed recipient key table.
+#
+#   $ rake bench BENCH=precompute
+#   $ CURVES=prime256v1 BUDGETS=65536,1048576 ruby -Ilib bench/bench_precompute.rb
+#
+require 'benchmark'
+require 'openssl/pkey/ec/ies'
+
+curves = (ENV['CURVES'] || 'prime192v1,prime256v1,secp384r1,secp521r1,secp256k1').split(',')
+budgets = (ENV['BUDGETS'] || '262144,1048576,4194304').split(',').map(&:to_i)
+iterations = (ENV['ITERATIONS'] || 500).to_i
+payload = 'a' * 128
+
+def ops_per_sec(ies, payload, iterations)
+  iterations / Benchmark.realtime { iterations.times { ies.public_encrypt(payload) } }
+end
+
+curves.each do |curve|
+  pem = OpenSSL::PKey::EC.new(curve).generate_key.to_pem
+  base = ops_per_sec(OpenSSL::PKey::EC::IES.new(pem, 'placeholder'), payload, iterations)
+  printf("%-12s %-16s %10.1f ops/s\n", curve, 'no table', base)
+  budgets.each do |budget|
+    ies = OpenSSL::PKey::EC::IES.new(pem, 'placeholder', precompute: budget)
+    ops = ops_per_sec(ies, payload, iterations)
+    printf("%-12s %-16s %10.1f ops/s  speedup=%.2fx\n", curve, "budget=#{budget}", ops, ops / base)
+  end
+end
@@ -0,0 +1,45 @@
+# -*- coding: utf-8 -*-
+#
+# Encryption and decryption throughput of the CBC + HMAC, GCM and
+# ChaCha20-Poly1305 suites on P-256, per payload size, and the suite
+# Suite.select picks among them on this host.
+#
+#   $ rake bench BENCH=suites
+#   $ SIZES=1024,16777216 ruby -Ilib bench/bench_suites.rb
+#
+# To see a host without AES-NI and PCLMULQDQ, mask them out of OpenSSL's
+# capability vector:
+#
+#   $ OPENSSL_ia32cap='~0x200000200000000' ruby -Ilib bench/bench_suites.rb
+#
+require 'benchmark'
+require 'openssl/pkey/ec/ies'
+
+suites = (ENV['SUITES'] || 'ECIES-P256-AES128CBC-SHA256,ECIES-P256-AES128GCM-SHA256,ECIES-P256-CHACHA20POLY1305-SHA256').split(',')
+suites = suites.select { |name| OpenSSL::PKey::EC::IES::Suite[name] }
+sizes = (ENV['SIZES'] || '1024,65536,16777216').split(',').map(&:to_i)
+pem = OpenSSL::PKey::EC.new('prime256v1').generate_key.to_pem
+
+def mb_per_sec(bytes, seconds)
+  bytes / seconds / (1024 * 1024)
+end
+
+sizes.each do |size|
+  payload = 'a' * size
+  # about 64 MiB of data per measurement, at least 20 messages
+  iterations = [64 * 1024 * 1024 / size, 20].max
+  suites.each do |name|
+    ies = OpenSSL::PKey::EC::IES.new(pem, name)
+    cryptogram = ies.public_encrypt(payload)
+    encrypt = Benchmark.realtime { iterations.times { ies.public_encrypt(payload) } }
+    decrypt = Benchmark.realtime { iterations.times { ies.private_decrypt(cryptogram) } }
+    printf("%-38s %9d B  encrypt %8.1f MB/s  decrypt %8.1f MB/s\n", name, size,
+           mb_per_sec(size * iterations, encrypt), mb_per_sec(size * iterations, decrypt))
+  end
+end
+
+selected = OpenSSL::PKey::EC::IES::Suite.select(suites)
+suites.each do |name|
+  printf("%-38s %8.1f MB/s%s\n", name, OpenSSL::PKey::EC::IES::Suite[name].throughput / (1024 * 1024),
+         name == selected.name ? '  <= Suite.select' : '')
+end
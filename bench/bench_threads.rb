@@ -0,0 +1,34 @@
+# -*- coding: utf-8 -*-
+#
+# Multi-threaded throughput of public_encrypt/private_decrypt.
+#
+#   $ rake bench BENCH=threads
+#   $ THREADS=1,2,4,8 PAYLOAD=65536 ruby -Ilib bench/bench_threads.rb
+#
+require 'benchmark'
+require 'openssl/pkey/ec/ies'
+
+key = File.read(File.expand_path('../../test/test_key.pem', __FILE__))
+ies = OpenSSL::PKey::EC::IES.new(key, 'placeholder')
+
+threads = (ENV['THREADS'] || '1,2,4,8').split(',').map(&:to_i)
+payload = 'a' * (ENV['PAYLOAD'] || 64 * 1024).to_i
+iterations = (ENV['ITERATIONS'] || 200).to_i
+cryptogram = ies.public_encrypt(payload)
+
+def run(n, iterations)
+  Benchmark.realtime do
+    n.times.map { Thread.new { iterations.times { yield } } }.each(&:join)
+  end
+end
+
+puts "payload: #{payload.bytesize} bytes, #{iterations} ops per thread"
+[['public_encrypt', proc { ies.public_encrypt(payload) }],
+ ['private_decrypt', proc { ies.private_decrypt(cryptogram) }]].each do |name, op|
+  base = nil
+  threads.each do |n|
+    ops = n * iterations / run(n, iterations, &op)
+    base ||= ops / n
+    printf("%-16s threads=%-3d %10.1f ops/s  scaling=%.2fx\n", name, n, ops, ops / base)
+  end
+end
@@ -0,0 +1,29 @@
+# -*- coding: utf-8 -*-
+#
+# Scaling of public_encrypt_batch and private_decrypt_batch with the number
+# of worker threads set by IES.configure(threads:).  Every tenth record is
+# large, so that the workers have uneven tasks to balance.
+#
+#   $ rake bench BENCH=workers
+#   $ THREADS=1,2,4,8,16,32 COUNT=20000 ruby -Ilib bench/bench_workers.rb
+#
+require 'benchmark'
+require 'etc'
+require 'openssl/pkey/ec/ies'
+
+threads = (ENV['THREADS'] || '1,2,4,8,16,32').split(',').map(&:to_i)
+count = (ENV['COUNT'] || 20_000).to_i
+suite = OpenSSL::PKey::EC::IES::Suite[ENV['SUITE'] || 'ECIES-P256-AES128GCM-SHA256']
+pem = OpenSSL::PKey::EC.new(suite.curve).generate_key.to_pem
+ies = OpenSSL::PKey::EC::IES.new(pem, suite)
+records = Array.new(count) { |i| 'r' * (i % 10 == 0 ? 64 * 1024 : 200) }
+cryptograms = ies.public_encrypt_batch(records)
+
+puts "#{suite}: #{count} records, #{Etc.nprocessors} processors, records per second"
+puts format('%8s %12s %12s', 'threads', 'encrypt', 'decrypt')
+threads.each do |n|
+  OpenSSL::PKey::EC::IES.configure(threads: n)
+  encrypt = Benchmark.realtime { ies.public_encrypt_batch(records) }
+  decrypt = Benchmark.realtime { ies.private_decrypt_batch(cryptograms) }
+  puts format('%8d %12.0f %12.0f', n, count / encrypt, count / decrypt)
+end
@@ -0,0 +1,37 @@
+# -*- coding: utf-8 -*-
+#
+# OpenSSL::PKey::IES on X25519 against EC::IES on P-256 and on P-192, the
+# curve of the key in the README, per operation.  All three use the legacy
+# suite, so only the KEM differs: public_encrypt makes a key pair and an
+# ECDH, private_decrypt reads a point and makes an ECDH.
+#
+#   $ rake bench BENCH=x25519
+#   $ ITERATIONS=2000 ruby -Ilib bench/bench_x25519.rb
+#
+require 'benchmark'
+require 'openssl/pkey/ec/ies'
+
+abort 'X25519 needs OpenSSL 1.1.1' unless defined?(OpenSSL::PKey::IES)
+
+iterations = (ENV['ITERATIONS'] || 500).to_i
+payload = 'a' * 128
+
+def usec_per_op(iterations)
+  Benchmark.realtime { yield } / iterations * 1e6
+end
+
+recipients = {
+  'X25519' => OpenSSL::PKey::IES.generate('placeholder'),
+  'P-256' => OpenSSL::PKey::EC::IES.new(OpenSSL::PKey::EC.new('prime256v1').generate_key.to_pem, 'placeholder'),
+  'P-192' => OpenSSL::PKey::EC::IES.new(OpenSSL::PKey::EC.new('prime192v1').generate_key.to_pem, 'placeholder'),
+}
+
+recipients.each do |name, ies|
+  cryptograms = iterations.times.map { ies.public_encrypt(payload) }
+  encrypt = usec_per_op(iterations) { iterations.times { ies.public_encrypt(payload) } }
+  decrypt = usec_per_op(iterations) { cryptograms.each { |cryptogram| ies.private_decrypt(cryptogram) } }
+  encrypt_batch = usec_per_op(iterations) { ies.public_encrypt_batch([payload] * iterations) }
+  decrypt_batch = usec_per_op(iterations) { ies.private_decrypt_batch(cryptograms) }
+  printf("%-7s encrypt %8.1f  decrypt %8.1f  encrypt_batch %8.1f  decrypt_batch %8.1f us/op  (%d bytes)\n",
+         name, encrypt, decrypt, encrypt_batch, decrypt_batch, cryptograms.first.bytesize)
+end
@@ -0,0 +1,49 @@
+/**
+ * @file malloc_count.c
+ *
+ * @brief LD_PRELOAD shim counting heap allocations and their bytes, for
+ * bench_alloc.rb.
+ *
+ * glibc only: it forwards to the __libc_* entry points.
+ */
+
+#include <stddef.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static volatile unsigned long allocations;
+static volatile unsigned long allocated_bytes;
+
+unsigned long malloc_count(void)
+{
+    return allocations;
+}
+
+/* Bytes requested so far; what realloc gives back is not subtracted */
+unsigned long malloc_bytes(void)
+{
+    return allocated_bytes;
+}
+
+void *malloc(size_t size)
+{
+    __sync_fetch_and_add(&allocations, 1);
+    __sync_fetch_and_add(&allocated_bytes, size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    __sync_fetch_and_add(&allocations, 1);
+    __sync_fetch_and_add(&allocated_bytes, nmemb * size);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __sync_fetch_and_add(&allocations, 1);
+    __sync_fetch_and_add(&allocated_bytes, size);
+    return __libc_realloc(ptr, size);
+}
@@ -10,11 +10,8 @@
 
 #include "ies.h"
 #include <openssl/ecdh.h>
+#include <openssl/rand.h>
 
-#define SET_ERROR(string) \
-    sprintf(error, "%s %s:%d", (string), __FILE__, __LINE__)
-#define SET_OSSL_ERROR(string) \
-    sprintf(error, "%s {error = %s} %s:%d", (string), ERR_error_string(ERR_get_error(), NULL), __FILE__, __LINE__)
 
 /* Copyright (c) 1998-2011 The OpenSSL Project. All rights reserved.
  * Taken from openssl/crypto/ecdh/ech_kdf.c in github:openssl/openssl
@@ -23,12 +20,13 @@
 /* Key derivation function from X9.62/SECG */
 /* Way more than we will ever need */
 #define ECDH_KDF_MAX (1 << 30)
-int ECDH_KDF_X9_62(unsigned char *out, size_t outlen,
-		   const unsigned char *Z, size_t Zlen,
-		   const unsigned char *sinfo, size_t sinfolen,
-		   const EVP_MD *md)
+/* Unlike the original, the digest context is passed in (see scratch.c), and
+ * the function is static as OpenSSL 1.1 exports one of the same name. */
+static int ecdh_kdf_x9_62(unsigned char *out, size_t outlen,
+			  const unsigned char *Z, size_t Zlen,
+			  const unsigned char *sinfo, size_t sinfolen,
+			  const EVP_MD *md, EVP_MD_CTX *mctx)
 {
-    EVP_MD_CTX mctx;
     int rv = 0;
     unsigned int i;
     size_t mdlen;
@@ -36,24 +34,23 @@ int ECDH_KDF_X9_62(unsigned char *out, size_t outlen,
     if (sinfolen > ECDH_KDF_MAX || outlen > ECDH_KDF_MAX || Zlen > ECDH_KDF_MAX)
 	return 0;
     mdlen = EVP_MD_size(md);
-    EVP_MD_CTX_init(&mctx);
     for (i = 1;;i++)
     {
 	unsigned char mtmp[EVP_MAX_MD_SIZE];
-	EVP_DigestInit_ex(&mctx, md, NULL);
+	EVP_DigestInit_ex(mctx, md, NULL);
 	ctr[3] = i & 0xFF;
 	ctr[2] = (i >> 8) & 0xFF;
 	ctr[1] = (i >> 16) & 0xFF;
 	ctr[0] = (i >> 24) & 0xFF;
-	if (!EVP_DigestUpdate(&mctx, Z, Zlen))
+	if (!EVP_DigestUpdate(mctx, Z, Zlen))
 	    goto err;
-	if (!EVP_DigestUpdate(&mctx, ctr, sizeof(ctr)))
+	if (!EVP_DigestUpdate(mctx, ctr, sizeof(ctr)))
 	    goto err;
-	if (!EVP_DigestUpdate(&mctx, sinfo, sinfolen))
+	if (!EVP_DigestUpdate(mctx, sinfo, sinfolen))
 	    goto err;
 	if (outlen >= mdlen)
 	{
-	    if (!EVP_DigestFinal(&mctx, out, NULL))
+	    if (!EVP_DigestFinal(mctx, out, NULL))
 		goto err;
 	    outlen -= mdlen;
 	    if (outlen == 0)
@@ -62,7 +59,7 @@ int ECDH_KDF_X9_62(unsigned char *out, size_t outlen,
 	}
 	else
 	{
-	    if (!EVP_DigestFinal(&mctx, mtmp, NULL))
+	    if (!EVP_DigestFinal(mctx, mtmp, NULL))
 		goto err;
 	    memcpy(out, mtmp, outlen);
 	    OPENSSL_cleanse(mtmp, mdlen);
@@ -71,485 +68,954 @@ int ECDH_KDF_X9_62(unsigned char *out, size_t outlen,
     }
     rv = 1;
   err:
-    EVP_MD_CTX_cleanup(&mctx);
+    EVP_MD_CTX_reset(mctx);
     return rv;
 }
 
-static size_t envelope_key_len(const ies_ctx_t *ctx)
+/* Writes the x coordinate of point, left padded to length bytes, the way
+ * ECDH_compute_key does. */
+int point_x_octets(const EC_GROUP *group, const EC_POINT *point, unsigned char *out, size_t length, BN_CTX *bn_ctx)
 {
-    return EVP_CIPHER_key_length(ctx->cipher) + EVP_MD_size(ctx->md);
+    BIGNUM *x;
+    size_t x_length;
+    int ok = 0;
+
+    BN_CTX_start(bn_ctx);
+    if (!(x = BN_CTX_get(bn_ctx)))
+	goto end;
+
+    if (EC_METHOD_get_field_type(EC_GROUP_method_of(group)) == NID_X9_62_prime_field)
+	ok = EC_POINT_get_affine_coordinates_GFp(group, point, x, NULL, bn_ctx);
+#ifndef OPENSSL_NO_EC2M
+    else
+	ok = EC_POINT_get_affine_coordinates_GF2m(group, point, x, NULL, bn_ctx);
+#endif
+
+    x_length = BN_num_bytes(x);
+    if (ok == 1 && x_length <= length) {
+	memset(out, 0, length - x_length);
+	BN_bn2bin(x, out + length - x_length);
+    } else {
+	ok = 0;
+    }
+    BN_clear(x);
+
+  end:
+    BN_CTX_end(bn_ctx);
+    return ok;
 }
 
-static EC_KEY * ecies_key_create(const EC_KEY *user, char *error) {
+/* Shared point of ECDH between the ephemeral scalar k and the recipient */
+static int sender_secret_point(const ies_ctx_t *ctx, scratch_t *scratch, const BIGNUM *k, EC_POINT *point)
+{
+    if (ctx->user_pub_table)
+	return fixed_base_mul(ctx->group, ctx->user_pub_table, point, k, scratch->bn_ctx);
+    return EC_POINT_mul(ctx->group, point, NULL, ctx->user_pub, k, scratch->bn_ctx);
+}
 
-    const EC_GROUP *group;
-    EC_KEY *key = NULL;
+/* Shared secret of ECDH between the ephemeral scalar k and the recipient */
+static int compute_sender_secret(const ies_ctx_t *ctx, scratch_t *scratch, const BIGNUM *k, unsigned char *out, char *error)
+{
+    EC_POINT *point = scratch->points[1];
 
-    if (!(key = EC_KEY_new())) {
-	SET_OSSL_ERROR("EC_KEY_new failed");
-	return NULL;
+    if (sender_secret_point(ctx, scratch, k, point) != 1
+	|| point_x_octets(ctx->group, point, out, ctx->ecdh_key_length, scratch->bn_ctx) != 1) {
+	SET_OSSL_ERROR("An error occurred while computing the shared secret");
+	return 0;
     }
 
-    if (!(group = EC_KEY_get0_group(user))) {
-	SET_ERROR("The user key does not have group");
-	EC_KEY_free(key);
-	return NULL;
-    }
+    return 1;
+}
 
-    if (EC_KEY_set_group(key, group) != 1) {
-	SET_OSSL_ERROR("EC_KEY_set_group failed");
-	EC_KEY_free(key);
-	return NULL;
+/* Random ephemeral scalar, 0 < k < n */
+static int ephemeral_scalar(const ies_ctx_t *ctx, BIGNUM *k, char *error)
+{
+    do {
+	if (!BN_rand_range(k, ctx->order)) {
+	    SET_OSSL_ERROR("Failed to generate ephemeral key");
+	    return 0;
+	}
+    } while (BN_is_zero(k));
+
+    return 1;
+}
+
+/* Ephemeral key pair k, R = k * G.  Unlike EC_KEY_generate_key this works on
+ * the shared group, so no group is copied for every message. */
+static int ephemeral_key_create(const ies_ctx_t *ctx, scratch_t *scratch, BIGNUM *k, EC_POINT *point, char *error)
+{
+    if (!ephemeral_scalar(ctx, k, error))
+	return 0;
+
+    if (EC_POINT_mul(ctx->group, point, k, NULL, NULL, scratch->bn_ctx) != 1) {
+	SET_OSSL_ERROR("Failed to compute ephemeral public key");
+	return 0;
     }
 
-    if (EC_KEY_generate_key(key) != 1) {
-	SET_OSSL_ERROR("EC_KEY_generate_key failed");
-	EC_KEY_free(key);
-	return NULL;
+    return 1;
+}
+
+/* k as the big-endian bytes a curve engine takes */
+static int engine_scalar_octets(const BIGNUM *k, unsigned char *out)
+{
+    const int length = BN_num_bytes(k);
+
+    if (length > CURVE_SCALAR_LENGTH)
+	return 0;
+    memset(out, 0, CURVE_SCALAR_LENGTH - length);
+    BN_bn2bin(k, out + CURVE_SCALAR_LENGTH - length);
+    return 1;
+}
+
+/* The sending side of ECDH on ctx->engine: a new ephemeral key k, R = k * G
+ * compressed into key_octets, and the x coordinate of k * Q into secret */
+static int engine_sender_secret(const ies_ctx_t *ctx, BIGNUM *k, unsigned char *key_octets, unsigned char *secret, char *error)
+{
+    unsigned char scalar[CURVE_SCALAR_LENGTH];
+    int ok = 0;
+
+    if (!ephemeral_scalar(ctx, k, error))
+	return 0;
+
+    if (!engine_scalar_octets(k, scalar) || !ctx->engine->public_key(scalar, key_octets)) {
+	SET_ERROR("Failed to compute ephemeral public key");
+	goto end;
     }
+    if (!ctx->engine->shared_secret(&ctx->engine_user_pub, scalar, secret)) {
+	SET_ERROR("An error occurred while computing the shared secret");
+	goto end;
+    }
+    ok = 1;
 
-    return key;
+  end:
+    OPENSSL_cleanse(scalar, sizeof(scalar));
+    return ok;
 }
 
-static unsigned char *prepare_envelope_key(const ies_ctx_t *ctx, cryptogram_t *cryptogram, char *error)
+/* The KEM half of encryption: creates an ephemeral key, stores its public
+ * point in key_octets and derives envelope_key from the shared secret.
+ * None of it depends on the message, see kem_pool.c. */
+int ecies_envelope_key_create(const ies_ctx_t *ctx, unsigned char *key_octets, unsigned char *envelope_key, char *error)
 {
 
-    const size_t key_buf_len = envelope_key_len(ctx);
-    const size_t ecdh_key_len = (EC_GROUP_get_degree(EC_KEY_get0_group(ctx->user_key)) + 7) / 8;
-    unsigned char *envelope_key = NULL, *ktmp = NULL;
-    EC_KEY *ephemeral = NULL;
+    const size_t key_buf_len = ctx->envelope_key_length;
+    const size_t ecdh_key_len = ctx->ecdh_key_length;
+    unsigned char ktmp[IES_MAX_ECDH_KEY_LENGTH];
+    scratch_t *scratch;
+    BIGNUM *k;
+    EC_POINT *ephemeral;
     size_t written_length;
+    int ok = 0;
 
-    /* High-level ECDH via EVP does not allow use of arbitrary KDF function.
-     * We should use low-level API for KDF2
-     * c.f. openssl/crypto/ec/ec_pmeth.c */
-    if ((envelope_key = OPENSSL_malloc(key_buf_len)) == NULL) {
-	SET_ERROR("Failed to allocate memory for envelope_key");
-	goto err;
+    if (!(scratch = scratch_acquire(ctx))) {
+	SET_OSSL_ERROR("Failed to allocate scratch state");
+	return 0;
     }
+    BN_CTX_start(scratch->bn_ctx);
+    ephemeral = scratch->points[0];
+
+    if (!(k = BN_CTX_get(scratch->bn_ctx))) {
+	SET_OSSL_ERROR("Failed to allocate ephemeral key");
+	goto end;
+    }
+
+    if (ctx->x25519_key) {
+	if (!x25519_sender_secret(ctx, scratch, key_octets, ktmp, error))
+	    goto end;
+    } else if (ctx->engine) {
+	if (!engine_sender_secret(ctx, k, key_octets, ktmp, error))
+	    goto end;
+    } else {
+	/* High-level ECDH via EVP does not allow use of arbitrary KDF function.
+	 * We should use low-level API for KDF2
+	 * c.f. openssl/crypto/ec/ec_pmeth.c */
+	if (!ephemeral_key_create(ctx, scratch, k, ephemeral, error)) {
+	    goto end;
+	}
 
-    if (!(ephemeral = ecies_key_create(ctx->user_key, error))) {
-	goto err;
+	/* key agreement and KDF
+	 * reference: openssl/crypto/ec/ec_pmeth.c */
+	if (!compute_sender_secret(ctx, scratch, k, ktmp, error)) {
+	    goto end;
+	}
+
+	/* Store the public key portion of the ephemeral key. */
+	written_length = EC_POINT_point2oct(
+	    ctx->group,
+	    ephemeral,
+	    POINT_CONVERSION_COMPRESSED,
+	    key_octets,
+	    ctx->stored_key_length,
+	    scratch->bn_ctx);
+	if (written_length == 0) {
+	    SET_OSSL_ERROR("Error while recording the public portion of the envelope key");
+	    goto end;
+	}
+	if (written_length != ctx->stored_key_length) {
+	    SET_ERROR("Written envelope key length does not match with expected");
+	    goto end;
+	}
     }
 
-    /* key agreement and KDF
-     * reference: openssl/crypto/ec/ec_pmeth.c */
-    ktmp = OPENSSL_malloc(ecdh_key_len);
-    if (ktmp == NULL) {
-	SET_ERROR("No memory for ECDH temporary key");
-	goto err;
+    /* equals to ISO 18033-2 KDF2 */
+    if (!ecdh_kdf_x9_62(envelope_key, key_buf_len, ktmp, ecdh_key_len, 0, 0, ctx->kdf_md, scratch->md)) {
+	SET_OSSL_ERROR("Failed to stretch with KDF2");
+	goto end;
     }
 
-    if (ECDH_compute_key(ktmp, ecdh_key_len, EC_KEY_get0_public_key(ctx->user_key), ephemeral, NULL)
-	!= (int)ecdh_key_len) {
-	SET_OSSL_ERROR("An error occurred while ECDH_compute_key");
-	goto err;
+    ok = 1;
+
+  end:
+    if (k)
+	BN_clear(k);
+    BN_CTX_end(scratch->bn_ctx);
+    scratch_release(scratch);
+    OPENSSL_cleanse(ktmp, ecdh_key_len);
+    if (!ok)
+	OPENSSL_cleanse(envelope_key, key_buf_len);
+    return ok;
+}
+
+/* ecdh_kdf_x9_62 of count shared secrets of a batch, eight at a time where
+ * multi_sha.c covers the digest */
+static int batch_kdf(const ies_ctx_t *ctx, scratch_t *scratch, size_t count, const unsigned char *const *secrets, unsigned char *const *envelope_keys)
+{
+    size_t i;
+
+    if (count > 1 && multi_sha_kdf(ctx->kdf_md, count, secrets, ctx->ecdh_key_length, envelope_keys, ctx->envelope_key_length))
+	return 1;
+
+    for (i = 0; i < count; i++) {
+	if (!ecdh_kdf_x9_62(envelope_keys[i], ctx->envelope_key_length, secrets[i], ctx->ecdh_key_length, 0, 0, ctx->kdf_md, scratch->md))
+	    return 0;
     }
+    return 1;
+}
 
-    /* equals to ISO 18033-2 KDF2 */
-    if (!ECDH_KDF_X9_62(envelope_key, key_buf_len, ktmp, ecdh_key_len, 0, 0, ctx->kdf_md)) {
-	SET_OSSL_ERROR("Failed to stretch with KDF2");
-	goto err;
+/* Writes x and, if y_out is given, the compressed form of point, which must
+ * be affine.  Unlike EC_POINT_point2oct this reads the coordinates as they
+ * are stored, so it needs no field inversion even where the group method
+ * does not keep track of Z = 1. */
+static int affine_point_octets(const ies_ctx_t *ctx, scratch_t *scratch, const EC_POINT *point, unsigned char *x_out, unsigned char *compressed_out)
+{
+    const size_t length = ctx->ecdh_key_length;
+    BIGNUM *x, *y, *z;
+    int ok = 0;
+
+    BN_CTX_start(scratch->bn_ctx);
+    x = BN_CTX_get(scratch->bn_ctx);
+    y = BN_CTX_get(scratch->bn_ctx);
+    if (!(z = BN_CTX_get(scratch->bn_ctx)))
+	goto end;
+
+    if (EC_POINT_get_Jprojective_coordinates_GFp(ctx->group, point, x, y, z, scratch->bn_ctx) != 1
+	|| !BN_is_one(z) || (size_t)BN_num_bytes(x) > length)
+	goto end;
+
+    if (x_out) {
+	memset(x_out, 0, length - BN_num_bytes(x));
+	BN_bn2bin(x, x_out + length - BN_num_bytes(x));
+    }
+    if (compressed_out) {
+	compressed_out[0] = POINT_CONVERSION_COMPRESSED | BN_is_odd(y);
+	memset(compressed_out + 1, 0, length - BN_num_bytes(x));
+	BN_bn2bin(x, compressed_out + 1 + length - BN_num_bytes(x));
+    }
+    ok = 1;
+
+  end:
+    BN_clear(x);
+    BN_clear(y);
+    BN_CTX_end(scratch->bn_ctx);
+    return ok;
+}
+
+/* R = k * G into key_octets[i] and the x coordinate of k * Q into
+ * secrets[i] for count new ephemeral keys k, through OpenSSL.
+ *
+ * Every ephemeral point R = k * G and shared point k * Q comes out of the
+ * multiplication in Jacobian coordinates, and converting one to affine costs
+ * a field inversion.  Here the 2 * count points are made affine together
+ * with EC_POINTs_make_affine, which shares a single inversion among them
+ * (Montgomery's trick). */
+static int envelope_points_create(const ies_ctx_t *ctx, scratch_t *scratch, BIGNUM *k, size_t count, unsigned char *const *key_octets, unsigned char (*secrets)[IES_MAX_ECDH_KEY_LENGTH], char *error)
+{
+    EC_POINT *points[2 * IES_KEY_BATCH];
+    size_t i, allocated;
+    int ok = 0;
+
+    for (allocated = 0; allocated < 2 * count; allocated++) {
+	if (!(points[allocated] = EC_POINT_new(ctx->group))) {
+	    SET_OSSL_ERROR("Failed to allocate points");
+	    goto end;
+	}
     }
 
-    /* Store the public key portion of the ephemeral key. */
-    written_length = EC_POINT_point2oct(
-	EC_KEY_get0_group(ephemeral),
-	EC_KEY_get0_public_key(ephemeral),
-	POINT_CONVERSION_COMPRESSED,
-	(void *)cryptogram_key_data(cryptogram),
-	ctx->stored_key_length,
-	NULL);
-    if (written_length == 0) {
-	SET_OSSL_ERROR("Error while recording the public portion of the envelope key");
-	goto err;
+    /* points[i] is R of message i, points[count + i] its shared point */
+    for (i = 0; i < count; i++) {
+	if (!ephemeral_key_create(ctx, scratch, k, points[i], error))
+	    goto end;
+	if (sender_secret_point(ctx, scratch, k, points[count + i]) != 1) {
+	    SET_OSSL_ERROR("An error occurred while computing the shared secret");
+	    goto end;
+	}
     }
-    if (written_length != ctx->stored_key_length) {
-	SET_ERROR("Written envelope key length does not match with expected");
-	goto err;
+
+    if (EC_POINTs_make_affine(ctx->group, 2 * count, points, scratch->bn_ctx) != 1) {
+	SET_OSSL_ERROR("EC_POINTs_make_affine failed");
+	goto end;
     }
 
-    EC_KEY_free(ephemeral);
-    OPENSSL_cleanse(ktmp, ecdh_key_len);
-    OPENSSL_free(ktmp);
+    for (i = 0; i < count; i++) {
+	if (affine_point_octets(ctx, scratch, points[count + i], secrets[i], NULL) != 1) {
+	    SET_OSSL_ERROR("An error occurred while computing the shared secret");
+	    goto end;
+	}
+	if (affine_point_octets(ctx, scratch, points[i], NULL, key_octets[i]) != 1) {
+	    SET_OSSL_ERROR("Error while recording the public portion of the envelope key");
+	    goto end;
+	}
+    }
 
-    return envelope_key;
+    ok = 1;
 
-  err:
-    if (ephemeral)
-	EC_KEY_free(ephemeral);
-    if (envelope_key) {
-	OPENSSL_cleanse(envelope_key, key_buf_len);
-	OPENSSL_free(envelope_key);
+  end:
+    for (i = 0; i < allocated; i++)
+	EC_POINT_clear_free(points[i]);
+    return ok;
+}
+
+/* ecies_envelope_key_create for count messages at once, count being at most
+ * IES_KEY_BATCH: key_octets[i] and envelope_keys + i * envelope_key_length
+ * receive the KEM of message i.  The points share one inversion (see
+ * envelope_points_create) and the KDF runs on all the secrets together.
+ * Only prime fields and X25519 are batched, for others this fails and the
+ * caller makes the keys one by one. */
+int ecies_envelope_keys_create(const ies_ctx_t *ctx, size_t count, unsigned char *const *key_octets, unsigned char *envelope_keys, char *error)
+{
+    const size_t key_buf_len = ctx->envelope_key_length;
+    const size_t ecdh_key_len = ctx->ecdh_key_length;
+    unsigned char secrets[IES_KEY_BATCH][IES_MAX_ECDH_KEY_LENGTH];
+    const unsigned char *secret_ptrs[IES_KEY_BATCH];
+    unsigned char *key_ptrs[IES_KEY_BATCH];
+    scratch_t *scratch;
+    BIGNUM *k;
+    size_t i;
+    int ok = 0;
+
+    if (count == 0 || count > IES_KEY_BATCH
+	|| (!ctx->x25519_key
+	    && (EC_METHOD_get_field_type(EC_GROUP_method_of(ctx->group)) != NID_X9_62_prime_field
+		|| ctx->stored_key_length != ecdh_key_len + 1))) {
+	SET_ERROR("Batch of envelope keys not supported");
+	return 0;
+    }
+
+    if (!(scratch = scratch_acquire(ctx))) {
+	SET_OSSL_ERROR("Failed to allocate scratch state");
+	return 0;
+    }
+    BN_CTX_start(scratch->bn_ctx);
+
+    if (!(k = BN_CTX_get(scratch->bn_ctx))) {
+	SET_OSSL_ERROR("Failed to allocate ephemeral key");
+	goto end;
+    }
+
+    if (ctx->x25519_key) {
+	/* only the KDF is shared */
+	for (i = 0; i < count; i++) {
+	    if (!x25519_sender_secret(ctx, scratch, key_octets[i], secrets[i], error))
+		goto end;
+	}
+    } else if (ctx->engine) {
+	/* the engines have no EC_POINTs to share an inversion between */
+	for (i = 0; i < count; i++) {
+	    if (!engine_sender_secret(ctx, k, key_octets[i], secrets[i], error))
+		goto end;
+	}
+    } else if (!envelope_points_create(ctx, scratch, k, count, key_octets, secrets, error)) {
+	goto end;
+    }
+
+    for (i = 0; i < count; i++) {
+	secret_ptrs[i] = secrets[i];
+	key_ptrs[i] = envelope_keys + i * key_buf_len;
     }
-    if (ktmp) {
-	OPENSSL_cleanse(ktmp, ecdh_key_len);
-	OPENSSL_free(ktmp);
+
+    if (!batch_kdf(ctx, scratch, count, secret_ptrs, key_ptrs)) {
+	SET_OSSL_ERROR("Failed to stretch with KDF2");
+	goto end;
     }
-    return NULL;
+
+    ok = 1;
+
+  end:
+    if (k)
+	BN_clear(k);
+    BN_CTX_end(scratch->bn_ctx);
+    scratch_release(scratch);
+    OPENSSL_cleanse(secrets, sizeof(secrets));
+    if (!ok)
+	OPENSSL_cleanse(envelope_keys, count * key_buf_len);
+    return ok;
 }
 
+static int prepare_envelope_key(const ies_ctx_t *ctx, cryptogram_t *cryptogram, unsigned char *envelope_key, char *error)
+{
+    /* Use a tuple made in advance by the background thread if there is one */
+    if (ctx->kem_pool && kem_pool_take(ctx->kem_pool, cryptogram_key_data(cryptogram), envelope_key)) {
+	return 1;
+    }
+
+    return ecies_envelope_key_create(ctx, cryptogram_key_data(cryptogram), envelope_key, error);
+}
+
+/* Encrypts data into the body of cryptogram and stores the tag.
+ *
+ * The HMAC of the CBC suites covers the cipher text, so it used to take a
+ * second pass over the body, which for a large message comes back from
+ * memory rather than cache.  Each chunk is now authenticated right after it
+ * is encrypted, while it is still in cache.  (OpenSSL's stitched
+ * AES-CBC-HMAC ciphers are no use here: they implement TLS, which MACs the
+ * clear text.)  The output is the same as from the two passes. */
 static int store_cipher_body(
     const ies_ctx_t *ctx,
+    scratch_t *scratch,
     const unsigned char *envelope_key,
     const unsigned char *data,
     size_t length,
     cryptogram_t *cryptogram,
+    const volatile int *interrupted,
     char *error)
 {
-    int out_len, len_sum = 0;
-    size_t expected_len = cryptogram_body_length(cryptogram);
+    int out_len;
+    size_t len_sum = 0;
+    const size_t expected_len = cryptogram_body_length(cryptogram);
     unsigned char iv[EVP_MAX_IV_LENGTH];
-    EVP_CIPHER_CTX cipher;
+    EVP_CIPHER_CTX *cipher = scratch->cipher;
+    HMAC_CTX *hmac = ctx->aead ? NULL : scratch->hmac;
+    unsigned int mac_len;
     unsigned char *body;
 
-    /* For now we use an empty initialization vector. */
+    /* The CBC suites use an empty initialization vector, which is fine as
+     * long as every message has a key of its own.  AEAD suites carry a
+     * random nonce in the cryptogram on top of that. */
     memset(iv, 0, EVP_MAX_IV_LENGTH);
+    if (ctx->iv_length && RAND_bytes(cryptogram_iv_data(cryptogram), ctx->iv_length) != 1) {
+	SET_OSSL_ERROR("Failed to generate nonce");
+	return 0;
+    }
 
-    EVP_CIPHER_CTX_init(&cipher);
     body = cryptogram_body_data(cryptogram);
 
-    if (EVP_EncryptInit_ex(&cipher, ctx->cipher, NULL, envelope_key, iv) != 1
-	|| EVP_EncryptUpdate(&cipher, body, &out_len, data, length) != 1) {
+    if (EVP_EncryptInit_ex(cipher, ctx->cipher, NULL, envelope_key,
+			   ctx->iv_length ? cryptogram_iv_data(cryptogram) : iv) != 1) {
 	SET_OSSL_ERROR("Error while trying to secure the data using the symmetric cipher");
-	EVP_CIPHER_CTX_cleanup(&cipher);
-	return 0;
+	goto err;
     }
 
-    if (expected_len < (size_t)out_len) {
-	SET_ERROR("The symmetric cipher overflowed");
-	EVP_CIPHER_CTX_cleanup(&cipher);
-	return 0;
+    if (hmac && HMAC_Init_ex(hmac, envelope_key + EVP_CIPHER_key_length(ctx->cipher), ctx->mac_length, ctx->md, NULL) != 1) {
+	SET_OSSL_ERROR("Unable to generate tag");
+	goto err;
     }
 
-    body += out_len;
-    len_sum += out_len;
-    if (EVP_EncryptFinal_ex(&cipher, body, &out_len) != 1) {
+    /* Feed the cipher in chunks so that a long payload can be interrupted */
+    while (length > 0) {
+	size_t chunk = length < IES_CHUNK_SIZE ? length : IES_CHUNK_SIZE;
+
+	if (INTERRUPTED(interrupted)) {
+	    SET_ERROR("Interrupted");
+	    goto err;
+	}
+
+	if (EVP_EncryptUpdate(cipher, body, &out_len, data, chunk) != 1) {
+	    SET_OSSL_ERROR("Error while trying to secure the data using the symmetric cipher");
+	    goto err;
+	}
+
+	if (expected_len < len_sum + out_len) {
+	    SET_ERROR("The symmetric cipher overflowed");
+	    goto err;
+	}
+
+	if (hmac && HMAC_Update(hmac, body, out_len) != 1) {
+	    SET_OSSL_ERROR("Unable to generate tag");
+	    goto err;
+	}
+
+	body += out_len;
+	len_sum += out_len;
+	data += chunk;
+	length -= chunk;
+    }
+
+    if (EVP_EncryptFinal_ex(cipher, body, &out_len) != 1) {
 	SET_OSSL_ERROR("Error while finalizing the data using the symmetric cipher");
-	EVP_CIPHER_CTX_cleanup(&cipher);
-	cryptogram_free(cryptogram);
-	return 0;
+	goto err;
     }
+    len_sum += out_len;
 
-    EVP_CIPHER_CTX_cleanup(&cipher);
+    if (expected_len != len_sum) {
+	SET_ERROR("The symmetric cipher output has an unexpected length");
+	goto err;
+    }
 
-    if (expected_len < (size_t)len_sum) {
-	SET_ERROR("The symmetric cipher overflowed");
-	return 0;
+    if (hmac) {
+	if (HMAC_Update(hmac, body, out_len) != 1
+	    || HMAC_Final(hmac, cryptogram_mac_data(cryptogram), &mac_len) != 1) {
+	    SET_OSSL_ERROR("Unable to generate tag");
+	    goto err;
+	}
+	if (mac_len != cryptogram_mac_length(cryptogram)) {
+	    SET_ERROR("MAC length expectation does not meet");
+	    goto err;
+	}
+	HMAC_CTX_reset(hmac);
+    } else if (EVP_CIPHER_CTX_ctrl(cipher, EVP_CTRL_AEAD_GET_TAG, cryptogram_mac_length(cryptogram), cryptogram_mac_data(cryptogram)) != 1) {
+	/* The tag of an AEAD cipher takes the place of the HMAC */
+	SET_OSSL_ERROR("Unable to generate tag");
+	goto err;
     }
 
+    EVP_CIPHER_CTX_reset(cipher);
+
     return 1;
+
+  err:
+    EVP_CIPHER_CTX_reset(cipher);
+    if (hmac)
+	HMAC_CTX_reset(hmac);
+    return 0;
 }
 
-static int store_mac_tag(const ies_ctx_t *ctx, const unsigned char *envelope_key, cryptogram_t *cryptogram, char *error) {
-    const size_t key_offset = EVP_CIPHER_key_length(ctx->cipher);
-    const size_t key_length = EVP_MD_size(ctx->md);
-    const size_t mac_length = cryptogram_mac_length(cryptogram);
-    unsigned int out_len;
-    HMAC_CTX hmac;
+/* Length of the cipher text for length bytes of plain text.  PKCS#7
+ * padding always adds at least one byte, i.e. a whole block when the length
+ * is already aligned.  Stream modes such as GCM are not padded. */
+size_t ecies_body_length(const ies_ctx_t *ctx, size_t length)
+{
+    if (ctx->block_length == 1)
+	return length;
+    return length + (ctx->block_length - (length % ctx->block_length));
+}
 
-    HMAC_CTX_init(&hmac);
+static int check_encrypt_args(const ies_ctx_t *ctx, const unsigned char *data, size_t length, const cryptogram_t *cryptogram, char *error)
+{
+    const size_t block_length = ctx->block_length;
 
-    /* Generate hash tag using encrypted data */
-    if (HMAC_Init_ex(&hmac, envelope_key + key_offset, key_length, ctx->md, NULL) != 1
-	|| HMAC_Update(&hmac, cryptogram_body_data(cryptogram), cryptogram_body_length(cryptogram)) != 1
-	|| HMAC_Final(&hmac, cryptogram_mac_data(cryptogram), &out_len) != 1) {
-	SET_OSSL_ERROR("Unable to generate tag");
-	HMAC_CTX_cleanup(&hmac);
+    if (!data || !length || !cryptogram) {
+	SET_ERROR("Invalid arguments");
 	return 0;
     }
 
-    HMAC_CTX_cleanup(&hmac);
+    if (block_length == 0 || block_length > EVP_MAX_BLOCK_LENGTH) {
+	SET_ERROR("Derived block size is incorrect");
+	return 0;
+    }
 
-    if (out_len != mac_length) {
-	SET_ERROR("MAC length expectation does not meet");
+    if (cryptogram_key_length(cryptogram) != ctx->stored_key_length
+	|| cryptogram_iv_length(cryptogram) != ctx->iv_length
+	|| cryptogram_mac_length(cryptogram) != ctx->mac_length
+	|| cryptogram_body_length(cryptogram) != ecies_body_length(ctx, length)) {
+	SET_ERROR("Cryptogram buffer does not fit the cipher text");
 	return 0;
     }
 
     return 1;
 }
 
-cryptogram_t * ecies_encrypt(const ies_ctx_t *ctx, const unsigned char *data, size_t length, char *error) {
+/* Encrypts into cryptogram, whose lengths must be the stored key length, the
+ * MAC length and ecies_body_length() of length. */
+int ecies_encrypt(const ies_ctx_t *ctx, const unsigned char *data, size_t length, cryptogram_t *cryptogram, const volatile int *interrupted, char *error) {
 
-    const size_t block_length = EVP_CIPHER_block_size(ctx->cipher);
-    const size_t mac_length = EVP_MD_size(ctx->md);
-    cryptogram_t *cryptogram = NULL;
-    unsigned char *envelope_key = NULL;
+    unsigned char envelope_key[IES_MAX_ENVELOPE_KEY_LENGTH];
+    int ok;
 
-    if (!ctx || !data || !length) {
+    if (!ctx) {
 	SET_ERROR("Invalid arguments");
-	return NULL;
+	return 0;
     }
 
-    if (block_length == 0 || block_length > EVP_MAX_BLOCK_LENGTH) {
-	SET_ERROR("Derived block size is incorrect");
-	return NULL;
+    if (!check_encrypt_args(ctx, data, length, cryptogram, error)
+	|| !prepare_envelope_key(ctx, cryptogram, envelope_key, error)) {
+	OPENSSL_cleanse(envelope_key, sizeof(envelope_key));
+	return 0;
     }
 
-    cryptogram = cryptogram_alloc(ctx->stored_key_length,
-				  mac_length,
-				  length + (length % block_length ? (block_length - (length % block_length)) : 0));
-    if (!cryptogram) {
-	SET_ERROR("Unable to allocate a cryptogram_t buffer to hold the encrypted result.");
-	goto err;
-    }
+    ok = ecies_encrypt_with_key(ctx, envelope_key, data, length, cryptogram, interrupted, error);
+    OPENSSL_cleanse(envelope_key, ctx->envelope_key_length);
+    return ok;
+}
 
-    if ((envelope_key = prepare_envelope_key(ctx, cryptogram, error)) == NULL) {
-	goto err;
-    }
+/* ecies_encrypt for a cryptogram whose ephemeral point is already stored,
+ * envelope_key being the key derived with it, see
+ * ecies_envelope_keys_create(). */
+int ecies_encrypt_with_key(const ies_ctx_t *ctx, const unsigned char *envelope_key, const unsigned char *data, size_t length, cryptogram_t *cryptogram, const volatile int *interrupted, char *error)
+{
+    scratch_t *scratch;
+    int ok;
 
-    if (!store_cipher_body(ctx, envelope_key, data, length, cryptogram, error)) {
-	goto err;
-    }
+    if (!check_encrypt_args(ctx, data, length, cryptogram, error))
+	return 0;
 
-    if (!store_mac_tag(ctx, envelope_key, cryptogram, error)) {
-	goto err;
+    if (!(scratch = scratch_acquire(ctx))) {
+	SET_OSSL_ERROR("Failed to allocate scratch state");
+	return 0;
     }
 
-    OPENSSL_cleanse(envelope_key, envelope_key_len(ctx));
-    OPENSSL_free(envelope_key);
+    ok = store_cipher_body(ctx, scratch, envelope_key, data, length, cryptogram, interrupted, error);
 
-    return cryptogram;
+    scratch_release(scratch);
+    return ok;
+}
 
-  err:
-    if (cryptogram)
-	cryptogram_free(cryptogram);
-    if (envelope_key) {
-	OPENSSL_cleanse(envelope_key, envelope_key_len(ctx));
-	OPENSSL_free(envelope_key);
+/* ecies_encrypt_with_key for count short messages of a CBC suite at once.
+ * Their CBC streams are interleaved by multi_aes.c, and the HMAC of each
+ * body is computed afterwards, while it is still in cache.  Returns 0 if
+ * the cipher or CPU is not supported or a message is not fit, writing
+ * nothing but maybe some bodies; the caller then encrypts one by one. */
+int ecies_encrypt_multi(const ies_ctx_t *ctx, size_t count, const unsigned char *const *envelope_keys, const unsigned char *const *data, const size_t *lengths, cryptogram_t *const *cryptograms, char *error)
+{
+    unsigned char *bodies[IES_KEY_BATCH];
+    const size_t cipher_key_length = EVP_CIPHER_key_length(ctx->cipher);
+    scratch_t *scratch;
+    unsigned int mac_len;
+    size_t i;
+    int ok = 0;
+
+    if (ctx->aead || ctx->iv_length || count > IES_KEY_BATCH) {
+	SET_ERROR("Suite cannot encrypt several messages at once");
+	return 0;
+    }
+    for (i = 0; i < count; i++) {
+	if (!check_encrypt_args(ctx, data[i], lengths[i], cryptograms[i], error))
+	    return 0;
+	bodies[i] = cryptogram_body_data(cryptograms[i]);
     }
-    return NULL;
-}
 
-static EC_KEY *ecies_key_create_public_octets(EC_KEY *user, unsigned char *octets, size_t length, char *error) {
+    if (!multi_aes_cbc_encrypt(ctx->cipher, count, envelope_keys, data, bodies, lengths)) {
+	SET_ERROR("Cipher cannot encrypt several messages at once");
+	return 0;
+    }
 
-    EC_KEY *key = NULL;
-    EC_POINT *point = NULL;
-    const EC_GROUP *group = NULL;
+    if (!(scratch = scratch_acquire(ctx))) {
+	SET_OSSL_ERROR("Failed to allocate scratch state");
+	return 0;
+    }
 
-    if (!(key = EC_KEY_new())) {
-	SET_OSSL_ERROR("Cannot create instance for ephemeral key");
-	return NULL;
+    for (i = 0; i < count; i++) {
+	if (HMAC_Init_ex(scratch->hmac, envelope_keys[i] + cipher_key_length, ctx->mac_length, ctx->md, NULL) != 1
+	    || HMAC_Update(scratch->hmac, bodies[i], cryptogram_body_length(cryptograms[i])) != 1
+	    || HMAC_Final(scratch->hmac, cryptogram_mac_data(cryptograms[i]), &mac_len) != 1) {
+	    SET_OSSL_ERROR("Unable to generate tag");
+	    goto end;
+	}
+	if (mac_len != cryptogram_mac_length(cryptograms[i])) {
+	    SET_ERROR("MAC length expectation does not meet");
+	    goto end;
+	}
+	HMAC_CTX_reset(scratch->hmac);
     }
+    ok = 1;
 
-    if (!(group = EC_KEY_get0_group(user))) {
-	SET_ERROR("Cannot get group from user key");
-	EC_KEY_free(key);
-	return NULL;
+  end:
+    if (!ok)
+	HMAC_CTX_reset(scratch->hmac);
+    scratch_release(scratch);
+    return ok;
+}
+
+/* Checks that a received ephemeral point is usable for ECDH.
+ *
+ * EC_KEY_check_key would also multiply the point by the group order, which
+ * costs as much as the ECDH itself.  On a group of prime order (cofactor 1)
+ * every point on the curve other than infinity generates the whole group, so
+ * the cheap checks are enough.  With a cofactor, clearing it (h * R != O)
+ * only rules out points of small order and a mixed-order point would still
+ * leak the private key modulo h, so there the subgroup check n * R = O is
+ * kept. */
+static int validate_public_point(const ies_ctx_t *ctx, scratch_t *scratch, const EC_POINT *point, char *error)
+{
+    const EC_GROUP *group = ctx->group;
+    EC_POINT *check = scratch->points[1];
+
+    if (EC_POINT_is_at_infinity(group, point)) {
+	SET_ERROR("Ephemeral key is the point at infinity");
+	return 0;
     }
 
-    if (EC_KEY_set_group(key, group) != 1) {
-	SET_OSSL_ERROR("EC_KEY_set_group failed");
-	EC_KEY_free(key);
-	return NULL;
+    if (EC_POINT_is_on_curve(group, point, scratch->bn_ctx) != 1) {
+	SET_OSSL_ERROR("Ephemeral key is not on the curve");
+	return 0;
     }
 
-    if (!(point = EC_POINT_new(group))) {
-	SET_OSSL_ERROR("EC_POINT_new failed");
-	EC_KEY_free(key);
-	return NULL;
+    if (ctx->prime_order)
+	return 1;
+
+    if (EC_POINT_mul(group, check, NULL, point, ctx->order, scratch->bn_ctx) != 1
+	|| !EC_POINT_is_at_infinity(group, check)) {
+	SET_OSSL_ERROR("Ephemeral key is not in the subgroup");
+	return 0;
     }
 
-    if (EC_POINT_oct2point(group, point, octets, length, NULL) != 1) {
+    return 1;
+}
+
+/* Decodes and validates the ephemeral point into scratch->points[0] */
+static int ephemeral_point_from_octets(const ies_ctx_t *ctx, scratch_t *scratch, const unsigned char *octets, size_t length, char *error)
+{
+    EC_POINT *point = scratch->points[0];
+
+    if (EC_POINT_oct2point(ctx->group, point, octets, length, scratch->bn_ctx) != 1) {
 	SET_OSSL_ERROR("EC_POINT_oct2point failed");
-	EC_KEY_free(key);
-	return NULL;
+	return 0;
     }
 
-    if (EC_KEY_set_public_key(key, point) != 1) {
-	SET_OSSL_ERROR("EC_KEY_set_public_key failed");
-	EC_POINT_free(point);
-	EC_KEY_free(key);
-	return NULL;
-    }
+    return validate_public_point(ctx, scratch, point, error);
+}
 
-    EC_POINT_free(point);
+/* Shared secret of ECDH between the recipient and a received ephemeral
+ * point.  This is what ECDH_compute_key does, but it works on the immutable
+ * user key directly: no EC_KEY copy, and no lookup of ECDH method data
+ * under the global EC lock on every call. */
+static int compute_receiver_secret(const ies_ctx_t *ctx, scratch_t *scratch, const EC_POINT *ephemeral, unsigned char *out, char *error)
+{
+    EC_POINT *point = scratch->points[1];
 
-    if (EC_KEY_check_key(key) != 1) {
-	SET_OSSL_ERROR("EC_KEY_check_key failed");
-	EC_KEY_free(key);
-	return NULL;
+    if (EC_POINT_mul(ctx->group, point, NULL, ephemeral, EC_KEY_get0_private_key(ctx->user_key), scratch->bn_ctx) != 1
+	|| point_x_octets(ctx->group, point, out, ctx->ecdh_key_length, scratch->bn_ctx) != 1) {
+	SET_OSSL_ERROR("An error occurred while computing the shared secret");
+	return 0;
     }
 
-    return key;
+    return 1;
 }
 
-unsigned char *restore_envelope_key(const ies_ctx_t *ctx, const cryptogram_t *cryptogram, char *error)
+/* The receiving side of ECDH on ctx->engine: decodes the ephemeral point,
+ * which point_decode also checks to be on the curve, and multiplies it by
+ * the private key */
+static int engine_receiver_secret(const ies_ctx_t *ctx, const unsigned char *octets, size_t length, unsigned char *secret, char *error)
 {
+    unsigned char scalar[CURVE_SCALAR_LENGTH];
+    curve_point_t ephemeral;
+    int ok = 0;
 
-    const size_t key_buf_len = envelope_key_len(ctx);
-    const size_t ecdh_key_len = (EC_GROUP_get_degree(EC_KEY_get0_group(ctx->user_key)) + 7) / 8;
-    EC_KEY *ephemeral = NULL, *user_copy = NULL;
-    unsigned char *envelope_key = NULL, *ktmp = NULL;
-
-    if ((envelope_key = OPENSSL_malloc(key_buf_len)) == NULL) {
-	SET_ERROR("Failed to allocate memory for envelope_key");
-	goto err;
+    if (!ctx->engine->point_decode(&ephemeral, octets, length)) {
+	SET_ERROR("Ephemeral key is not a point on the curve");
+	return 0;
     }
 
-    if (!(user_copy = EC_KEY_new())) {
-	SET_OSSL_ERROR("Failed to create instance for user key copy");
-	goto err;
+    if (!engine_scalar_octets(EC_KEY_get0_private_key(ctx->user_key), scalar)
+	|| !ctx->engine->shared_secret(&ephemeral, scalar, secret)) {
+	SET_ERROR("An error occurred while computing the shared secret");
+	goto end;
     }
+    ok = 1;
 
-    if (!(EC_KEY_copy(user_copy, ctx->user_key))) {
-	SET_OSSL_ERROR("Failed to copy user key");
-	goto err;
-    }
+  end:
+    OPENSSL_cleanse(scalar, sizeof(scalar));
+    return ok;
+}
 
-    if (!(ephemeral = ecies_key_create_public_octets(user_copy, cryptogram_key_data(cryptogram), cryptogram_key_length(cryptogram), error))) {
-	goto err;
+/* The receiving side of ECDH on ctx->ladder: the x-coordinate of the
+ * ephemeral point goes into the ladder as is, which checks it to be on the
+ * curve instead of decompressing it */
+static int ladder_receiver_secret(const ies_ctx_t *ctx, const unsigned char *octets, size_t length, unsigned char *secret, char *error)
+{
+    if (!xladder_shared_secret(ctx->ladder, octets, length, secret)) {
+	SET_ERROR("Ephemeral key is not a point on the curve");
+	return 0;
     }
+    return 1;
+}
 
-    /* key agreement and KDF
-     * reference: openssl/crypto/ec/ec_pmeth.c */
-    ktmp = OPENSSL_malloc(ecdh_key_len);
-    if (ktmp == NULL) {
-	SET_ERROR("No memory for ECDH temporary key");
-	goto err;
+static int restore_envelope_key(const ies_ctx_t *ctx, const cryptogram_t *cryptogram, unsigned char *envelope_key, char *error)
+{
+
+    const size_t key_buf_len = ctx->envelope_key_length;
+    const size_t ecdh_key_len = ctx->ecdh_key_length;
+    unsigned char ktmp[IES_MAX_ECDH_KEY_LENGTH];
+    scratch_t *scratch;
+    int ok = 0;
+
+    if (!(scratch = scratch_acquire(ctx))) {
+	SET_OSSL_ERROR("Failed to allocate scratch state");
+	return 0;
     }
 
-    if (ECDH_compute_key(ktmp, ecdh_key_len, EC_KEY_get0_public_key(ephemeral), user_copy, NULL)
-	!= (int)ecdh_key_len) {
-	SET_OSSL_ERROR("An error occurred while ECDH_compute_key");
-	goto err;
+    if (ctx->x25519_key) {
+	if (!x25519_receiver_secret(ctx, scratch, cryptogram_key_data(cryptogram), cryptogram_key_length(cryptogram), ktmp, error))
+	    goto end;
+    } else if (ctx->engine) {
+	if (!engine_receiver_secret(ctx, cryptogram_key_data(cryptogram), cryptogram_key_length(cryptogram), ktmp, error))
+	    goto end;
+    } else if (ctx->ladder) {
+	if (!ladder_receiver_secret(ctx, cryptogram_key_data(cryptogram), cryptogram_key_length(cryptogram), ktmp, error))
+	    goto end;
+    } else {
+	if (!ephemeral_point_from_octets(ctx, scratch, cryptogram_key_data(cryptogram), cryptogram_key_length(cryptogram), error)) {
+	    goto end;
+	}
+
+	/* key agreement and KDF
+	 * reference: openssl/crypto/ec/ec_pmeth.c */
+	if (!compute_receiver_secret(ctx, scratch, scratch->points[0], ktmp, error)) {
+	    goto end;
+	}
     }
 
     /* equals to ISO 18033-2 KDF2 */
-    if (!ECDH_KDF_X9_62(envelope_key, key_buf_len, ktmp, ecdh_key_len, 0, 0, ctx->kdf_md)) {
+    if (!ecdh_kdf_x9_62(envelope_key, key_buf_len, ktmp, ecdh_key_len, 0, 0, ctx->kdf_md, scratch->md)) {
 	SET_OSSL_ERROR("Failed to stretch with KDF2");
-	goto err;
+	goto end;
     }
 
-    EC_KEY_free(user_copy);
-    EC_KEY_free(ephemeral);
-    OPENSSL_cleanse(ktmp, ecdh_key_len);
-    OPENSSL_free(ktmp);
-
-    return envelope_key;
+    ok = 1;
 
-  err:
-    if (ephemeral)
-	EC_KEY_free(ephemeral);
-    if (user_copy)
-	EC_KEY_free(user_copy);
-    if (envelope_key) {
+  end:
+    scratch_release(scratch);
+    OPENSSL_cleanse(ktmp, ecdh_key_len);
+    if (!ok)
 	OPENSSL_cleanse(envelope_key, key_buf_len);
-	OPENSSL_free(envelope_key);
-    }
-    if (ktmp) {
-	OPENSSL_cleanse(ktmp, ecdh_key_len);
-	OPENSSL_free(ktmp);
-    }
-    return NULL;
+    return ok;
 }
 
-static int verify_mac(const ies_ctx_t *ctx, const cryptogram_t *cryptogram, const unsigned char * envelope_key, char *error)
+/* Decrypts the body into output, which must hold the body length: with
+ * padding the clear text is never longer than the cipher text.
+ *
+ * Checking the HMAC over the whole body first and decrypting afterwards
+ * streams a large body from memory twice.  Instead each chunk goes to the
+ * HMAC and is then decrypted while it is still in cache.  output is not
+ * handed to anyone before this returns, and it is wiped unless the tag
+ * verifies, so nothing unauthenticated is released.  The tag is compared
+ * before the padding is looked at, so bad padding is only ever reported for
+ * authentic cipher text. */
+static int decrypt_body(const ies_ctx_t *ctx, scratch_t *scratch, const cryptogram_t *cryptogram, const unsigned char *envelope_key, unsigned char *output, size_t *length, const volatile int *interrupted, char *error)
 {
-    const size_t key_offset = EVP_CIPHER_key_length(ctx->cipher);
-    const size_t key_length = EVP_MD_size(ctx->md);
+    int out_len;
+    size_t output_sum = 0, remaining;
     const size_t mac_length = cryptogram_mac_length(cryptogram);
-    unsigned int out_len;
-    HMAC_CTX hmac;
-    unsigned char md[EVP_MAX_MD_SIZE];
+    const unsigned char *input;
+    unsigned char iv[EVP_MAX_IV_LENGTH], md[EVP_MAX_MD_SIZE], *block;
+    EVP_CIPHER_CTX *cipher = scratch->cipher;
+    HMAC_CTX *hmac = ctx->aead ? NULL : scratch->hmac;
+    unsigned int md_len;
 
-    HMAC_CTX_init(&hmac);
+    /* Empty initialization vector unless the suite carries a nonce */
+    memset(iv, 0, EVP_MAX_IV_LENGTH);
 
-    /* Generate hash tag using encrypted data */
-    if (HMAC_Init_ex(&hmac, envelope_key + key_offset, key_length, ctx->md, NULL) != 1
-	|| HMAC_Update(&hmac, cryptogram_body_data(cryptogram), cryptogram_body_length(cryptogram)) != 1
-	|| HMAC_Final(&hmac, md, &out_len) != 1) {
-	SET_OSSL_ERROR("Unable to generate tag");
-	HMAC_CTX_cleanup(&hmac);
-	return 0;
+    block = output;
+    if (EVP_DecryptInit_ex(cipher, ctx->cipher, NULL, envelope_key,
+			   cryptogram_iv_length(cryptogram) ? cryptogram_iv_data(cryptogram) : iv) != 1) {
+	SET_OSSL_ERROR("Unable to decrypt");
+	goto err;
     }
 
-    HMAC_CTX_cleanup(&hmac);
-
-    if (out_len != mac_length) {
-	SET_ERROR("MAC length expectation does not meet");
-	return 0;
+    /* An AEAD cipher checks the tag in EVP_DecryptFinal_ex */
+    if (ctx->aead && EVP_CIPHER_CTX_ctrl(cipher, EVP_CTRL_AEAD_SET_TAG, mac_length, cryptogram_mac_data(cryptogram)) != 1) {
+	SET_OSSL_ERROR("Unable to set tag");
+	goto err;
     }
 
-    if (memcmp(md, cryptogram_mac_data(cryptogram), mac_length) != 0) {
-	SET_ERROR("MAC tag verification failed");
-	return 0;
+    if (hmac && HMAC_Init_ex(hmac, envelope_key + EVP_CIPHER_key_length(ctx->cipher), ctx->mac_length, ctx->md, NULL) != 1) {
+	SET_OSSL_ERROR("Unable to generate tag");
+	goto err;
     }
 
-    return 1;
-}
+    input = cryptogram_body_data(cryptogram);
+    remaining = cryptogram_body_length(cryptogram);
+    while (remaining > 0) {
+	size_t chunk = remaining < IES_CHUNK_SIZE ? remaining : IES_CHUNK_SIZE;
 
-unsigned char *decrypt_body(const ies_ctx_t *ctx, const cryptogram_t *cryptogram, const unsigned char *envelope_key, size_t *length, char *error)
-{
-    int out_len;
-    size_t output_sum;
-    const size_t body_length = cryptogram_body_length(cryptogram);
-    unsigned char iv[EVP_MAX_IV_LENGTH], *block, *output;
-    EVP_CIPHER_CTX cipher;
+	if (INTERRUPTED(interrupted)) {
+	    SET_ERROR("Interrupted");
+	    goto err;
+	}
 
-    if (!(output = malloc(body_length + 1))) {
-	SET_ERROR("Failed to allocate memory for clear text");
-	return NULL;
-    }
+	if (hmac && HMAC_Update(hmac, input, chunk) != 1) {
+	    SET_OSSL_ERROR("Unable to generate tag");
+	    goto err;
+	}
 
-    /* For now we use an empty initialization vector */
-    memset(iv, 0, EVP_MAX_IV_LENGTH);
-    memset(output, 0, body_length + 1);
+	if (EVP_DecryptUpdate(cipher, block, &out_len, input, chunk) != 1) {
+	    SET_OSSL_ERROR("Unable to decrypt");
+	    goto err;
+	}
 
-    EVP_CIPHER_CTX_init(&cipher);
+	block += out_len;
+	output_sum += out_len;
+	input += chunk;
+	remaining -= chunk;
+    }
 
-    block = output;
-    if (EVP_DecryptInit_ex(&cipher, ctx->cipher, NULL, envelope_key, iv) != 1
-	|| EVP_DecryptUpdate(&cipher, block, &out_len, cryptogram_body_data(cryptogram), body_length) != 1) {
-	SET_OSSL_ERROR("Unable to decrypt");
-	EVP_CIPHER_CTX_cleanup(&cipher);
-	free(output);
-	return NULL;
+    if (hmac) {
+	if (HMAC_Final(hmac, md, &md_len) != 1) {
+	    SET_OSSL_ERROR("Unable to generate tag");
+	    goto err;
+	}
+	if (md_len != mac_length) {
+	    SET_ERROR("MAC length expectation does not meet");
+	    goto err;
+	}
+	if (CRYPTO_memcmp(md, cryptogram_mac_data(cryptogram), mac_length) != 0) {
+	    SET_ERROR("MAC tag verification failed");
+	    goto err;
+	}
+	HMAC_CTX_reset(hmac);
     }
-    output_sum = out_len;
 
-    block += output_sum;
-    if (EVP_DecryptFinal_ex(&cipher, block, &out_len) != 1) {
-	printf("Unable to decrypt the data using the chosen symmetric cipher. {error = %s}\n", ERR_error_string(ERR_get_error(), NULL));
-	EVP_CIPHER_CTX_cleanup(&cipher);
-	free(output);
-	return NULL;
+    if (EVP_DecryptFinal_ex(cipher, block, &out_len) != 1) {
+	if (ctx->aead)
+	    SET_ERROR("MAC tag verification failed");
+	else
+	    SET_OSSL_ERROR("Unable to decrypt the data using the chosen symmetric cipher");
+	goto err;
     }
     output_sum += out_len;
 
-    EVP_CIPHER_CTX_cleanup(&cipher);
+    EVP_CIPHER_CTX_reset(cipher);
 
     *length = output_sum;
 
-    return output;
+    return 1;
+
+  err:
+    EVP_CIPHER_CTX_reset(cipher);
+    if (hmac)
+	HMAC_CTX_reset(hmac);
+    OPENSSL_cleanse(md, sizeof(md));
+    OPENSSL_cleanse(output, output_sum);
+    return 0;
 }
 
-unsigned char * ecies_decrypt(const ies_ctx_t *ctx, const cryptogram_t *cryptogram, size_t *length, char *error)
+/* Decrypts cryptogram into output, which must hold at least the body length
+ * of the cryptogram, and stores the length of the clear text in length. */
+int ecies_decrypt(const ies_ctx_t *ctx, const cryptogram_t *cryptogram, unsigned char *output, size_t *length, const volatile int *interrupted, char *error)
 {
 
-    unsigned char *envelope_key = NULL, *output = NULL;
+    unsigned char envelope_key[IES_MAX_ENVELOPE_KEY_LENGTH];
+    scratch_t *scratch;
+    int ok = 0;
 
-    if (!ctx || !cryptogram || !length || !error) {
+    if (!ctx || !cryptogram || !output || !length || !error) {
 	SET_ERROR("Invalid argument");
-	goto err;
+	return 0;
     }
 
-    envelope_key = restore_envelope_key(ctx, cryptogram, error);
-    if (envelope_key == NULL) {
-	goto err;
+    if (!(scratch = scratch_acquire(ctx))) {
+	SET_OSSL_ERROR("Failed to allocate scratch state");
+	return 0;
     }
 
-    if (!verify_mac(ctx, cryptogram, envelope_key, error)) {
+    if (!restore_envelope_key(ctx, cryptogram, envelope_key, error)) {
 	goto err;
     }
 
-    if ((output = decrypt_body(ctx, cryptogram, envelope_key, length, error)) == NULL) {
-	goto err;
-    }
+    ok = decrypt_body(ctx, scratch, cryptogram, envelope_key, output, length, interrupted, error);
 
   err:
-    OPENSSL_cleanse(envelope_key, envelope_key_len(ctx));
-    OPENSSL_free(envelope_key);
+    scratch_release(scratch);
+    OPENSSL_cleanse(envelope_key, ctx->envelope_key_length);
 
-    return output;
+    return ok;
 }
@@ -27,6 +27,22 @@ unless have_header("openssl/conf_api.h")
   raise "OpenSSL 0.9.6 or later required."
 end
 
+# OpenSSL 1.1 made the contexts and EVP_PKEY opaque; ies.h fills these in
+# for 1.0.x.  ChaCha20-Poly1305 needs 1.1 as well.
+have_func("EVP_PKEY_get0_EC_KEY", "openssl/evp.h")
+have_func("EVP_MD_CTX_new", "openssl/evp.h")
+have_func("EVP_CIPHER_CTX_reset", "openssl/evp.h")
+have_func("HMAC_CTX_new", "openssl/hmac.h")
+have_func("EVP_chacha20_poly1305", "openssl/evp.h")
+# X25519 keys with raw encodings, for OpenSSL::PKey::IES, came with 1.1.1
+have_func("EVP_PKEY_get_raw_public_key", "openssl/evp.h")
+
+# Crypto work runs without the GVL where the interpreter supports it
+have_header("ruby/thread.h") && have_func("rb_thread_call_without_gvl2", "ruby/thread.h")
+
+# Background refilling of the KEM pool
+have_header("pthread.h")
+
 create_header
 create_makefile("openssl/pkey/ec/ies") {|conf|
   conf << "THREAD_MODEL = #{CONFIG["THREAD_MODEL"]}\n"
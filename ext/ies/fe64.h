@@ -0,0 +1,231 @@
+/**
+ * @file fe64.h
+ *
+ * @brief Field elements of 256-bit prime fields on 4 x 64-bit limbs, shared
+ * by p256.c and k256.c.
+ *
+ * Nothing here branches on or indexes memory with the values it works on.
+ * The including file defines FE64_P, the limbs of the modulus in braces,
+ * before it includes this header, and only does so if __SIZEOF_INT128__ is
+ * defined.
+ */
+
+#ifndef _FE64_H_
+#define _FE64_H_
+
+typedef unsigned __int128 u128;
+typedef uint64_t fe_t[4];	/* little-endian limbs */
+
+typedef struct {
+    fe_t x, y, z;
+} jpoint_t;			/* projective (X : Y : Z) */
+
+typedef struct {
+    fe_t x, y;
+} apoint_t;
+
+static const fe_t fe_p = FE64_P;
+
+/* All ones if a == b, else zero */
+static uint64_t eq_mask(uint64_t a, uint64_t b)
+{
+    uint64_t d = a ^ b;
+
+    return (uint64_t)0 - ((~d & (d - 1)) >> 63);
+}
+
+static void fe_copy(fe_t r, const fe_t a)
+{
+    memcpy(r, a, sizeof(fe_t));
+}
+
+/* r = a if mask is all ones, unchanged if it is zero */
+static void fe_cmov(fe_t r, const fe_t a, uint64_t mask)
+{
+    int i;
+
+    for (i = 0; i < 4; i++)
+	r[i] ^= mask & (r[i] ^ a[i]);
+}
+
+static uint64_t fe_is_zero(const fe_t a)
+{
+    return eq_mask(a[0] | a[1] | a[2] | a[3], 0);
+}
+
+static inline uint64_t add_carry(uint64_t a, uint64_t b, uint64_t *carry)
+{
+    u128 s = (u128)a + b + *carry;
+
+    *carry = (uint64_t)(s >> 64);
+    return (uint64_t)s;
+}
+
+static inline uint64_t sub_borrow(uint64_t a, uint64_t b, uint64_t *borrow)
+{
+    u128 d = (u128)a - b - *borrow;
+
+    *borrow = (uint64_t)(d >> 64) & 1;
+    return (uint64_t)d;
+}
+
+/* lo = low limb of a * b + c + d, c = its high limb */
+#define MUL_ADD(lo, a, b, c, d) do { \
+	u128 m_ = (u128)(a) * (b) + (c) + (d); \
+	(lo) = (uint64_t)m_; \
+	(c) = (uint64_t)(m_ >> 64); \
+    } while (0)
+
+/* The 512-bit product t7..t0 = a * b, a row per limb of b */
+#define FE_MUL_WIDE(t0, t1, t2, t3, t4, t5, t6, t7, a, b) do { \
+	uint64_t c_ = 0; \
+	MUL_ADD(t0, (a)[0], (b)[0], c_, 0); \
+	MUL_ADD(t1, (a)[1], (b)[0], c_, 0); \
+	MUL_ADD(t2, (a)[2], (b)[0], c_, 0); \
+	MUL_ADD(t3, (a)[3], (b)[0], c_, 0); \
+	t4 = c_; \
+	c_ = 0; \
+	MUL_ADD(t1, (a)[0], (b)[1], c_, t1); \
+	MUL_ADD(t2, (a)[1], (b)[1], c_, t2); \
+	MUL_ADD(t3, (a)[2], (b)[1], c_, t3); \
+	MUL_ADD(t4, (a)[3], (b)[1], c_, t4); \
+	t5 = c_; \
+	c_ = 0; \
+	MUL_ADD(t2, (a)[0], (b)[2], c_, t2); \
+	MUL_ADD(t3, (a)[1], (b)[2], c_, t3); \
+	MUL_ADD(t4, (a)[2], (b)[2], c_, t4); \
+	MUL_ADD(t5, (a)[3], (b)[2], c_, t5); \
+	t6 = c_; \
+	c_ = 0; \
+	MUL_ADD(t3, (a)[0], (b)[3], c_, t3); \
+	MUL_ADD(t4, (a)[1], (b)[3], c_, t4); \
+	MUL_ADD(t5, (a)[2], (b)[3], c_, t5); \
+	MUL_ADD(t6, (a)[3], (b)[3], c_, t6); \
+	t7 = c_; \
+    } while (0)
+
+/* The 512-bit square t7..t0 = a^2, with the cross products made once and
+ * doubled */
+#define FE_SQR_WIDE(t0, t1, t2, t3, t4, t5, t6, t7, a) do { \
+	uint64_t c_ = 0; \
+	u128 sq_; \
+	MUL_ADD(t1, (a)[0], (a)[1], c_, 0); \
+	MUL_ADD(t2, (a)[0], (a)[2], c_, 0); \
+	MUL_ADD(t3, (a)[0], (a)[3], c_, 0); \
+	t4 = c_; \
+	c_ = 0; \
+	MUL_ADD(t3, (a)[1], (a)[2], c_, t3); \
+	MUL_ADD(t4, (a)[1], (a)[3], c_, t4); \
+	t5 = c_; \
+	c_ = 0; \
+	MUL_ADD(t5, (a)[2], (a)[3], c_, t5); \
+	t6 = c_; \
+	t7 = t6 >> 63; \
+	t6 = (t6 << 1) | (t5 >> 63); \
+	t5 = (t5 << 1) | (t4 >> 63); \
+	t4 = (t4 << 1) | (t3 >> 63); \
+	t3 = (t3 << 1) | (t2 >> 63); \
+	t2 = (t2 << 1) | (t1 >> 63); \
+	t1 <<= 1; \
+	/* plus a[i]^2 at limb 2i */ \
+	c_ = 0; \
+	sq_ = (u128)(a)[0] * (a)[0]; \
+	t0 = (uint64_t)sq_; \
+	t1 = add_carry(t1, (uint64_t)(sq_ >> 64), &c_); \
+	sq_ = (u128)(a)[1] * (a)[1]; \
+	t2 = add_carry(t2, (uint64_t)sq_, &c_); \
+	t3 = add_carry(t3, (uint64_t)(sq_ >> 64), &c_); \
+	sq_ = (u128)(a)[2] * (a)[2]; \
+	t4 = add_carry(t4, (uint64_t)sq_, &c_); \
+	t5 = add_carry(t5, (uint64_t)(sq_ >> 64), &c_); \
+	sq_ = (u128)(a)[3] * (a)[3]; \
+	t6 = add_carry(t6, (uint64_t)sq_, &c_); \
+	t7 = add_carry(t7, (uint64_t)(sq_ >> 64), &c_); \
+    } while (0)
+
+/* r = t - p if that does not borrow, else t, where t = t4 * 2^256 + t0..t3.
+ * Spelled out limb by limb: as arrays, GCC vectorizes the selection through
+ * memory and stalls on store forwarding. */
+static inline void fe_reduce_once(fe_t r, uint64_t t0, uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4)
+{
+    uint64_t borrow = 0, s0, s1, s2, s3, mask;
+
+    s0 = sub_borrow(t0, fe_p[0], &borrow);
+    s1 = sub_borrow(t1, fe_p[1], &borrow);
+    s2 = sub_borrow(t2, fe_p[2], &borrow);
+    s3 = sub_borrow(t3, fe_p[3], &borrow);
+    sub_borrow(t4, 0, &borrow);
+    /* keep t where the subtraction borrowed */
+    mask = (uint64_t)0 - borrow;
+    r[0] = (t0 & mask) | (s0 & ~mask);
+    r[1] = (t1 & mask) | (s1 & ~mask);
+    r[2] = (t2 & mask) | (s2 & ~mask);
+    r[3] = (t3 & mask) | (s3 & ~mask);
+}
+
+static void fe_add(fe_t r, const fe_t a, const fe_t b)
+{
+    uint64_t carry = 0, t0, t1, t2, t3;
+
+    t0 = add_carry(a[0], b[0], &carry);
+    t1 = add_carry(a[1], b[1], &carry);
+    t2 = add_carry(a[2], b[2], &carry);
+    t3 = add_carry(a[3], b[3], &carry);
+    fe_reduce_once(r, t0, t1, t2, t3, carry);
+}
+
+static void fe_sub(fe_t r, const fe_t a, const fe_t b)
+{
+    uint64_t borrow = 0, carry = 0, t0, t1, t2, t3, mask;
+
+    t0 = sub_borrow(a[0], b[0], &borrow);
+    t1 = sub_borrow(a[1], b[1], &borrow);
+    t2 = sub_borrow(a[2], b[2], &borrow);
+    t3 = sub_borrow(a[3], b[3], &borrow);
+    /* add p back if it borrowed */
+    mask = (uint64_t)0 - borrow;
+    r[0] = add_carry(t0, fe_p[0] & mask, &carry);
+    r[1] = add_carry(t1, fe_p[1] & mask, &carry);
+    r[2] = add_carry(t2, fe_p[2] & mask, &carry);
+    r[3] = add_carry(t3, fe_p[3] & mask, &carry);
+}
+
+/* r = -a if mask is all ones, unchanged if it is zero */
+static void fe_cneg(fe_t r, const fe_t a, uint64_t mask)
+{
+    static const fe_t zero = { 0, 0, 0, 0 };
+    fe_t t;
+
+    fe_sub(t, zero, a);
+    fe_copy(r, a);
+    fe_cmov(r, t, mask);
+}
+
+/* Big-endian bytes to limbs.  Returns 1 if the value is less than p, in
+ * constant time. */
+static int fe_limbs_from_bytes(fe_t r, const unsigned char *in)
+{
+    uint64_t borrow = 0;
+    int i, j;
+
+    for (i = 0; i < 4; i++) {
+	r[i] = 0;
+	for (j = 0; j < 8; j++)
+	    r[i] = (r[i] << 8) | in[8 * (3 - i) + j];
+    }
+    for (i = 0; i < 4; i++)
+	sub_borrow(r[i], fe_p[i], &borrow);
+    return (int)borrow;
+}
+
+static void fe_limbs_to_bytes(unsigned char *out, const fe_t a)
+{
+    int i, j;
+
+    for (i = 0; i < 4; i++) {
+	for (j = 0; j < 8; j++)
+	    out[8 * (3 - i) + j] = (unsigned char)(a[i] >> (56 - 8 * j));
+    }
+}
+
+#endif /* _FE64_H_ */
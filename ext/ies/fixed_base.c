@@ -0,0 +1,156 @@
+/**
+ * @file fixed_base.c
+ *
+ * @brief Fixed-base scalar multiplication for a point known in advance.
+ *
+ * OpenSSL precomputes multiples of the generator only.  For ECIES the
+ * recipient public key is just as fixed, so the same trick applies to the
+ * k * Q multiplication of every encryption: the scalar is cut into windows
+ * of w bits and row i of the table holds d * 2^(w * i) * Q for every
+ * non-zero digit d.  A multiplication then costs one point addition per
+ * window and no doubling at all.
+ *
+ * The table is indexed by the digits of the ephemeral scalar, so lookups
+ * are not constant time.
+ */
+
+#include "ies.h"
+
+#define FIXED_BASE_MAX_WINDOW 8
+
+/* Rough footprint of one table entry: three BIGNUM coordinates and headers */
+static size_t point_memsize(const EC_GROUP *group)
+{
+    const size_t field_length = (EC_GROUP_get_degree(group) + 7) / 8;
+    return 3 * (field_length + 32) + 48;
+}
+
+static size_t table_length(int window, int rows)
+{
+    return (size_t)rows * ((1 << window) - 1);
+}
+
+void fixed_base_free(fixed_base_t *fb)
+{
+    size_t i, length;
+
+    if (!fb)
+	return;
+
+    if (fb->table) {
+	length = table_length(fb->window, fb->rows);
+	for (i = 0; i < length; i++) {
+	    if (fb->table[i])
+		EC_POINT_free(fb->table[i]);
+	}
+	OPENSSL_free(fb->table);
+    }
+    OPENSSL_free(fb);
+}
+
+/* Builds the table for point on group using the widest window whose table
+ * fits in budget bytes. */
+fixed_base_t *fixed_base_new(const EC_GROUP *group, const EC_POINT *point, size_t budget, char *error)
+{
+    const int bits = EC_GROUP_get_degree(group) + 1;
+    const size_t entry_size = point_memsize(group);
+    fixed_base_t *fb = NULL;
+    EC_POINT *base = NULL;
+    BN_CTX *bn_ctx = NULL;
+    size_t length;
+    int window, rows, row_length, i, d;
+
+    for (window = FIXED_BASE_MAX_WINDOW; window > 0; window--) {
+	rows = (bits + window - 1) / window;
+	if (table_length(window, rows) * entry_size <= budget)
+	    break;
+    }
+    if (window == 0) {
+	SET_ERROR("Precomputation budget is too small for this curve");
+	return NULL;
+    }
+
+    row_length = (1 << window) - 1;
+    length = table_length(window, rows);
+
+    if (!(fb = OPENSSL_malloc(sizeof(fixed_base_t)))) {
+	SET_ERROR("Failed to allocate memory for precomputation");
+	return NULL;
+    }
+    fb->window = window;
+    fb->rows = rows;
+    fb->memsize = sizeof(fixed_base_t) + length * (sizeof(EC_POINT *) + entry_size);
+    if (!(fb->table = OPENSSL_malloc(length * sizeof(EC_POINT *)))) {
+	SET_ERROR("Failed to allocate memory for precomputation");
+	goto err;
+    }
+    memset(fb->table, 0, length * sizeof(EC_POINT *));
+
+    if (!(bn_ctx = BN_CTX_new()) || !(base = EC_POINT_dup(point, group))) {
+	SET_OSSL_ERROR("Failed to prepare precomputation");
+	goto err;
+    }
+
+    for (i = 0; i < rows; i++) {
+	EC_POINT **row = fb->table + (size_t)i * row_length;
+
+	/* row[d - 1] = d * base */
+	for (d = 1; d <= row_length; d++) {
+	    if (!(row[d - 1] = EC_POINT_new(group))) {
+		SET_OSSL_ERROR("EC_POINT_new failed");
+		goto err;
+	    }
+	    if ((d == 1 ? EC_POINT_copy(row[0], base)
+		 : EC_POINT_add(group, row[d - 1], row[d - 2], base, bn_ctx)) != 1) {
+		SET_OSSL_ERROR("Failed to compute precomputation table");
+		goto err;
+	    }
+	}
+
+	/* base of the next row is 2^window * base = 2 * (2^(window - 1) * base) */
+	if (EC_POINT_dbl(group, base, row[(1 << (window - 1)) - 1], bn_ctx) != 1) {
+	    SET_OSSL_ERROR("Failed to compute precomputation table");
+	    goto err;
+	}
+    }
+
+    /* Affine entries let EC_POINT_add use the cheaper mixed addition */
+    if (EC_POINTs_make_affine(group, length, fb->table, bn_ctx) != 1) {
+	SET_OSSL_ERROR("EC_POINTs_make_affine failed");
+	goto err;
+    }
+
+    EC_POINT_clear_free(base);
+    BN_CTX_free(bn_ctx);
+    return fb;
+
+  err:
+    if (base)
+	EC_POINT_clear_free(base);
+    if (bn_ctx)
+	BN_CTX_free(bn_ctx);
+    fixed_base_free(fb);
+    return NULL;
+}
+
+/* r = k * point, for the point the table was built from */
+int fixed_base_mul(const EC_GROUP *group, const fixed_base_t *fb, EC_POINT *r, const BIGNUM *k, BN_CTX *bn_ctx)
+{
+    const int row_length = (1 << fb->window) - 1;
+    int i, b, d;
+
+    if (BN_is_negative(k) || BN_num_bits(k) > fb->rows * fb->window)
+	return 0;
+
+    if (EC_POINT_set_to_infinity(group, r) != 1)
+	return 0;
+
+    for (i = 0; i < fb->rows; i++) {
+	for (d = 0, b = fb->window - 1; b >= 0; b--)
+	    d = (d << 1) | BN_is_bit_set(k, i * fb->window + b);
+	if (d && EC_POINT_add(group, r, r, fb->table[(size_t)i * row_length + d - 1], bn_ctx) != 1)
+	    return 0;
+    }
+
+    return 1;
+}
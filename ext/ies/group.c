@@ -0,0 +1,61 @@
+/**
+ * @file group.c
+ *
+ * @brief Process-wide EC_GROUP objects, one per named curve.
+ *
+ * EC_KEY_set_group duplicates the group, including the precomputed
+ * multiples of the generator, so doing it per message is expensive.  IES
+ * contexts instead refer to one interned group per curve which is set up
+ * once, precomputation included, and never modified or freed afterwards.
+ * Sharing it between threads is therefore safe.
+ */
+
+#include "ies.h"
+
+static struct {
+    int nid;
+    EC_GROUP *group;
+} *interned;
+static size_t interned_count;
+
+/* Returns the shared group for the curve of group.  Groups given by explicit
+ * parameters cannot be interned; a private copy is returned for them and
+ * *owned is set, telling the caller to free it.
+ *
+ * Must be called with the GVL held, which serializes access to the table. */
+const EC_GROUP *group_intern(const EC_GROUP *group, int *owned)
+{
+    const int nid = EC_GROUP_get_curve_name(group);
+    EC_GROUP *shared;
+    void *grown;
+    size_t i;
+
+    *owned = 0;
+    if (nid == NID_undef) {
+	*owned = 1;
+	return EC_GROUP_dup(group);
+    }
+
+    for (i = 0; i < interned_count; i++) {
+	if (interned[i].nid == nid)
+	    return interned[i].group;
+    }
+
+    if (!(shared = EC_GROUP_new_by_curve_name(nid)))
+	return NULL;
+    if (!EC_GROUP_have_precompute_mult(shared) && !EC_GROUP_precompute_mult(shared, NULL)) {
+	EC_GROUP_free(shared);
+	return NULL;
+    }
+
+    if (!(grown = OPENSSL_realloc(interned, (interned_count + 1) * sizeof(*interned)))) {
+	EC_GROUP_free(shared);
+	return NULL;
+    }
+    interned = grown;
+    interned[interned_count].nid = nid;
+    interned[interned_count].group = shared;
+    interned_count++;
+
+    return shared;
+}
@@ -1,69 +1,846 @@
 #include "ies.h"
 
 static VALUE eIESError;
+static VALUE cSuite;
+static VALUE suite_registry;	/* frozen Hash of name => frozen IES::Suite */
 
 static EC_KEY *require_ec_key(VALUE self)
 {
-    const EVP_PKEY *pkey;
-    const EC_KEY *ec;
-    Data_Get_Struct(self, EVP_PKEY, pkey);
+    EVP_PKEY *pkey;
+    EC_KEY *ec;
+    /* The openssl extension wraps EVP_PKEY as typed data since Ruby 2.3 */
+    if (RTYPEDDATA_P(self))
+	pkey = RTYPEDDATA_DATA(self);
+    else
+	Data_Get_Struct(self, EVP_PKEY, pkey);
     if (!pkey) {
 	rb_raise(rb_eRuntimeError, "PKEY wasn't initialized!");
     }
-    if (EVP_PKEY_type(pkey->type) != EVP_PKEY_EC) {
+    if (EVP_PKEY_base_id(pkey) != EVP_PKEY_EC) {
 	rb_raise(rb_eRuntimeError, "THIS IS NOT A EC PKEY!");
     }
-    ec = pkey->pkey.ec;
+    ec = ies_pkey_get0_ec_key(pkey);
     if (ec == NULL)
 	rb_raise(eIESError, "EC_KEY is not initialized");
     return ec;
 }
 
-static ies_ctx_t *create_context(VALUE self)
+/* Suites are static, so their objects have nothing to free */
+static const rb_data_type_t ies_suite_type = {
+    "OpenSSL/ECIES/suite",
+    { 0, 0, 0, },
+};
+
+static const ies_suite_t *get_suite(VALUE obj)
 {
-    ies_ctx_t* ctx = malloc(sizeof(ies_ctx_t));
-    ctx->cipher = EVP_aes_128_cbc();
-    ctx->md = EVP_sha1();
-    ctx->kdf_md = EVP_sha1();
-    ctx->stored_key_length = 25;
-    ctx->user_key = require_ec_key(self);
+    ies_suite_t *suite;
 
-    return ctx;
+    TypedData_Get_Struct(obj, ies_suite_t, &ies_suite_type, suite);
+    return suite;
+}
+
+static VALUE suite_object(const ies_suite_t *suite)
+{
+    return rb_hash_aref(suite_registry, rb_str_new_cstr(suite->name));
+}
+
+/* Resolves the algorithm spec given to IES.new.  Specs that do not start with
+ * "ECIES-" predate the registry and keep meaning the legacy suite. */
+static const ies_suite_t *ies_suite_from_spec(VALUE spec)
+{
+    const ies_suite_t *suite;
+
+    if (rb_obj_is_kind_of(spec, cSuite))
+	return get_suite(spec);
+
+    StringValue(spec);
+    if ((suite = suite_lookup(RSTRING_PTR(spec), RSTRING_LEN(spec))))
+	return suite;
+    if (RSTRING_LEN(spec) >= 6 && memcmp(RSTRING_PTR(spec), "ECIES-", 6) == 0)
+	rb_raise(eIESError, "Unknown algorithm suite: %"PRIsVALUE, spec);
+    return suite_legacy();
+}
+
+static VALUE ies_frozen_cstr(const char *str)
+{
+    return str ? rb_obj_freeze(rb_str_new_cstr(str)) : Qnil;
+}
+
+/*
+ *  call-seq:
+ *     OpenSSL::PKey::EC::IES::Suite[name] => Suite or nil
+ */
+static VALUE ies_suite_s_aref(VALUE klass, VALUE name)
+{
+    StringValue(name);
+    return rb_hash_lookup(suite_registry, name);
+}
+
+/*
+ *  call-seq:
+ *     OpenSSL::PKey::EC::IES::Suite.all => Array
+ */
+static VALUE ies_suite_s_all(VALUE klass)
+{
+    return rb_obj_freeze(rb_funcall(suite_registry, rb_intern("values"), 0));
+}
+
+/*
+ *  call-seq:
+ *     OpenSSL::PKey::EC::IES::Suite.select(candidates) => Suite
+ *
+ *  The fastest of the candidate suites (names or Suite objects) on this
+ *  host, judged by #throughput.  Names this build does not know, such as
+ *  the ChaCha20-Poly1305 suites with OpenSSL 1.0.x, are passed over, so one
+ *  policy serves every host.
+ *
+ *     policy = %w[ECIES-P256-AES128GCM-SHA256 ECIES-P256-CHACHA20POLY1305-SHA256]
+ *     ies = OpenSSL::PKey::EC::IES.new(key, OpenSSL::PKey::EC::IES::Suite.select(policy))
+ */
+static VALUE ies_suite_s_select(VALUE klass, VALUE candidates)
+{
+    VALUE best = Qnil;
+    double best_throughput = 0.0;
+    long i;
+
+    Check_Type(candidates, T_ARRAY);
+    for (i = 0; i < RARRAY_LEN(candidates); i++) {
+	VALUE candidate = RARRAY_AREF(candidates, i);
+	double throughput;
+
+	if (!rb_obj_is_kind_of(candidate, cSuite)) {
+	    StringValue(candidate);
+	    candidate = rb_hash_lookup(suite_registry, candidate);
+	    if (NIL_P(candidate))
+		continue;
+	}
+	throughput = suite_throughput(get_suite(candidate));
+	if (throughput > best_throughput) {
+	    best = candidate;
+	    best_throughput = throughput;
+	}
+    }
+
+    if (NIL_P(best))
+	rb_raise(eIESError, "None of the candidate suites is available");
+    return best;
+}
+
+/*
+ *  call-seq:
+ *     suite.throughput => Float
+ *
+ *  Bytes per second the cipher and MAC of the suite encrypt on this host,
+ *  for 16 KiB messages.  Measured once per process, on the first call.
+ */
+static VALUE ies_suite_throughput(VALUE self)
+{
+    return rb_float_new(suite_throughput(get_suite(self)));
+}
+
+/*
+ *  call-seq:
+ *     suite.name => String
+ */
+static VALUE ies_suite_name(VALUE self)
+{
+    return ies_frozen_cstr(get_suite(self)->name);
+}
+
+/*
+ *  call-seq:
+ *     suite.curve => String or nil
+ *
+ *  Short name of the curve the suite is bound to, nil if it takes any.
+ */
+static VALUE ies_suite_curve(VALUE self)
+{
+    const ies_suite_t *suite = get_suite(self);
+
+    return suite->curve_nid == NID_undef ? Qnil : ies_frozen_cstr(OBJ_nid2sn(suite->curve_nid));
+}
+
+/*
+ *  call-seq:
+ *     suite.cipher => String
+ */
+static VALUE ies_suite_cipher(VALUE self)
+{
+    return ies_frozen_cstr(OBJ_nid2sn(EVP_CIPHER_nid(get_suite(self)->cipher())));
+}
+
+/*
+ *  call-seq:
+ *     suite.digest => String or nil
+ *
+ *  Hash of the MAC, nil when the cipher authenticates by itself (GCM,
+ *  ChaCha20-Poly1305).
+ */
+static VALUE ies_suite_digest(VALUE self)
+{
+    const ies_suite_t *suite = get_suite(self);
+
+    return suite->md ? ies_frozen_cstr(OBJ_nid2sn(EVP_MD_type(suite->md()))) : Qnil;
+}
+
+/*
+ *  call-seq:
+ *     suite.kdf_digest => String
+ */
+static VALUE ies_suite_kdf_digest(VALUE self)
+{
+    return ies_frozen_cstr(OBJ_nid2sn(EVP_MD_type(get_suite(self)->kdf_md())));
+}
+
+static void init_suite_registry(VALUE cIES)
+{
+    size_t i;
+
+    /* Document-class: OpenSSL::PKey::EC::IES::Suite
+     *
+     * A named combination of curve, cipher and hashes, given to IES.new as
+     * the algorithm spec.  Suites are frozen and shared.
+     */
+    cSuite = rb_define_class_under(cIES, "Suite", rb_cObject);
+    rb_undef_alloc_func(cSuite);
+    rb_define_singleton_method(cSuite, "[]", ies_suite_s_aref, 1);
+    rb_define_singleton_method(cSuite, "all", ies_suite_s_all, 0);
+    rb_define_singleton_method(cSuite, "select", ies_suite_s_select, 1);
+    rb_define_method(cSuite, "name", ies_suite_name, 0);
+    rb_define_method(cSuite, "to_s", ies_suite_name, 0);
+    rb_define_method(cSuite, "curve", ies_suite_curve, 0);
+    rb_define_method(cSuite, "cipher", ies_suite_cipher, 0);
+    rb_define_method(cSuite, "digest", ies_suite_digest, 0);
+    rb_define_method(cSuite, "kdf_digest", ies_suite_kdf_digest, 0);
+    rb_define_method(cSuite, "throughput", ies_suite_throughput, 0);
+
+    suite_registry = rb_hash_new();
+    rb_gc_register_mark_object(suite_registry);
+    for (i = 0; i < suite_count(); i++) {
+	const ies_suite_t *suite = suite_at(i);
+	VALUE obj = TypedData_Wrap_Struct(cSuite, &ies_suite_type, (void *)suite);
+
+	rb_hash_aset(suite_registry, rb_str_new_cstr(suite->name), rb_obj_freeze(obj));
+    }
+    rb_obj_freeze(suite_registry);
+}
+
+static void ies_ctx_free(void *ptr)
+{
+    ies_ctx_t *ctx = ptr;
+
+    /* stops the producer thread before anything it uses goes away */
+    if (ctx->kem_pool)
+	kem_pool_free(ctx->kem_pool);
+    if (ctx->user_pub_table)
+	fixed_base_free(ctx->user_pub_table);
+    if (ctx->ladder)
+	xladder_free(ctx->ladder);
+    if (ctx->order)
+	BN_free(ctx->order);
+    if (ctx->user_pub)
+	EC_POINT_free(ctx->user_pub);
+    if (ctx->group_owned)
+	EC_GROUP_free((EC_GROUP *)ctx->group);
+    if (ctx->user_key)
+	EC_KEY_free(ctx->user_key);
+    if (ctx->x25519_key)
+	EVP_PKEY_free(ctx->x25519_key);
+    xfree(ctx);
+}
+
+static size_t ies_ctx_memsize(const void *ptr)
+{
+    const ies_ctx_t *ctx = ptr;
+    size_t size = sizeof(ies_ctx_t);
+
+    if (ctx->user_pub_table)
+	size += ctx->user_pub_table->memsize;
+    if (ctx->kem_pool)
+	size += kem_pool_memsize(ctx->kem_pool);
+    if (ctx->ladder)
+	size += xladder_memsize(ctx->ladder);
+    return size;
+}
+
+static const rb_data_type_t ies_ctx_type = {
+    "OpenSSL/ECIES/context",
+    { 0, ies_ctx_free, ies_ctx_memsize, },
+};
+
+static ID id_context, id_precompute, id_pool, id_low, id_high, id_threads, id_p256, id_k256, id_ladder;
+
+/* Default memory budget for the precomputation requested by precompute: true */
+#define IES_DEFAULT_PRECOMPUTE_BUDGET (1024 * 1024)
+/* Default watermarks of the KEM pool requested by pool: true */
+#define IES_DEFAULT_POOL_HIGH_WATERMARK 256
+
+static VALUE ies_option(VALUE opts, ID name)
+{
+    if (NIL_P(opts))
+	return Qnil;
+    return rb_hash_aref(opts, ID2SYM(name));
+}
+
+/* The engine that is to do ECDH on group instead of OpenSSL, given the p256
+ * and k256 options, or NULL */
+static const curve_engine_t *curve_engine_select(const EC_GROUP *group, VALUE p256, VALUE k256)
+{
+    const curve_engine_t *engine;
+
+    switch (EC_GROUP_get_curve_name(group)) {
+    case NID_X9_62_prime256v1:
+	/* OpenSSL's own code for the curve (ecp_nistz256, ecp_nistp256) is
+	 * faster than p256.c, so by default p256.c only replaces the generic
+	 * arithmetic */
+	if (p256 == Qfalse || (!RTEST(p256) && EC_GROUP_method_of(group) != EC_GFp_mont_method()))
+	    return NULL;
+	engine = &p256_engine;
+	break;
+    case NID_secp256k1:
+	/* OpenSSL has nothing but the generic arithmetic for secp256k1 */
+	if (k256 == Qfalse)
+	    return NULL;
+	engine = &k256_engine;
+	break;
+    default:
+	return NULL;
+    }
+    return engine->setup() ? engine : NULL;
+}
+
+/* Whether decryption on group is to take the ladder of xladder.c, given the
+ * ladder option.  It only takes curves of prime order on prime fields, and
+ * by default only those of up to 256 bits where OpenSSL has nothing but the
+ * generic arithmetic: on larger fields the ladder loses to the assembler
+ * Montgomery multiplication that arithmetic runs on. */
+static int ladder_select(const ies_ctx_t *ctx, VALUE ladder)
+{
+    const EC_METHOD *method = EC_GROUP_method_of(ctx->group);
+
+    if (ladder == Qfalse || ctx->engine || !ctx->prime_order
+	|| EC_METHOD_get_field_type(method) != NID_X9_62_prime_field)
+	return 0;
+    if (RTEST(ladder))
+	return 1;
+    return EC_GROUP_get_degree(ctx->group) <= 256
+	&& (method == EC_GFp_mont_method() || method == EC_GFp_nist_method());
+}
+
+/* Everything of ctx that only depends on the suite */
+static void context_set_suite(ies_ctx_t *ctx, const ies_suite_t *suite)
+{
+    ctx->suite = suite;
+    ctx->cipher = suite->cipher();
+    ctx->md = suite->md ? suite->md() : NULL;
+    ctx->kdf_md = suite->kdf_md();
+    ctx->aead = (EVP_CIPHER_flags(ctx->cipher) & EVP_CIPH_FLAG_AEAD_CIPHER) != 0;
+    if (ctx->aead) {
+	/* one pass of the cipher authenticates too, the key is for it alone */
+	ctx->envelope_key_length = EVP_CIPHER_key_length(ctx->cipher);
+	ctx->mac_length = IES_AEAD_TAG_LENGTH;
+	ctx->iv_length = EVP_CIPHER_iv_length(ctx->cipher);
+    } else {
+	ctx->envelope_key_length = EVP_CIPHER_key_length(ctx->cipher) + EVP_MD_size(ctx->md);
+	ctx->mac_length = EVP_MD_size(ctx->md);
+	ctx->iv_length = 0;
+    }
+    ctx->block_length = EVP_CIPHER_block_size(ctx->cipher);
+}
+
+/* Starts the KEM pool requested by the pool option.  Last thing in setting
+ * up a context, as the producer starts using it right away. */
+static void context_start_pool(ies_ctx_t *ctx, VALUE pool)
+{
+    char error[1024] = "Unknown error";
+    size_t high = IES_DEFAULT_POOL_HIGH_WATERMARK, low;
+    VALUE value;
+
+    if (pool != Qtrue) {
+	Check_Type(pool, T_HASH);
+	if (!NIL_P(value = rb_hash_aref(pool, ID2SYM(id_high))))
+	    high = NUM2SIZET(value);
+    }
+    low = high / 4;
+    if (pool != Qtrue && !NIL_P(value = rb_hash_aref(pool, ID2SYM(id_low))))
+	low = NUM2SIZET(value);
+
+    ctx->kem_pool = kem_pool_new(ctx, low, high, error);
+    if (!ctx->kem_pool)
+	rb_raise(eIESError, "Error in starting KEM pool: %s", error);
+}
+
+/* Everything that only depends on the key and the algorithm is resolved once
+ * here and kept on the IES object, so that encryption and decryption do no
+ * set-up work of their own. */
+static VALUE create_context(VALUE self, const ies_suite_t *suite, VALUE opts)
+{
+    EC_KEY *ec = require_ec_key(self);
+    VALUE precompute = ies_option(opts, id_precompute);
+    VALUE pool = ies_option(opts, id_pool);
+    VALUE p256 = ies_option(opts, id_p256);
+    VALUE k256 = ies_option(opts, id_k256);
+    VALUE ladder = ies_option(opts, id_ladder);
+    char error[1024] = "Unknown error";
+    ies_ctx_t *ctx;
+    BIGNUM *cofactor;
+    VALUE obj;
+
+    if (suite->curve_nid != NID_undef && suite->curve_nid != EC_GROUP_get_curve_name(EC_KEY_get0_group(ec)))
+	rb_raise(eIESError, "Suite %s needs a key on %s", suite->name, OBJ_nid2sn(suite->curve_nid));
+
+    obj = TypedData_Make_Struct(rb_cObject, ies_ctx_t, &ies_ctx_type, ctx);
+    context_set_suite(ctx, suite);
+    ctx->ecdh_key_length = (EC_GROUP_get_degree(EC_KEY_get0_group(ec)) + 7) / 8;
+    /* compressed point: one octet of y parity followed by x */
+    ctx->stored_key_length = 1 + ctx->ecdh_key_length;
+    EC_KEY_up_ref(ec);
+    ctx->user_key = ec;
+
+    if (!(ctx->group = group_intern(EC_KEY_get0_group(ec), &ctx->group_owned)))
+	rb_raise(eIESError, "Failed to set up the group");
+
+    if (EC_KEY_get0_public_key(ec)
+	&& !(ctx->user_pub = EC_POINT_dup(EC_KEY_get0_public_key(ec), ctx->group)))
+	rb_raise(eIESError, "Failed to copy the public key");
+
+    cofactor = BN_new();
+    ctx->order = BN_new();
+    if (!cofactor || !ctx->order
+	|| !EC_GROUP_get_order(ctx->group, ctx->order, NULL)
+	|| !EC_GROUP_get_cofactor(ctx->group, cofactor, NULL)) {
+	BN_free(cofactor);
+	rb_raise(eIESError, "Failed to get order and cofactor of the group");
+    }
+    ctx->prime_order = BN_is_one(cofactor);
+    BN_free(cofactor);
+
+    if ((ctx->engine = curve_engine_select(ctx->group, p256, k256))) {
+	unsigned char octets[1 + 2 * CURVE_SCALAR_LENGTH];
+
+	if (ctx->user_pub
+	    && (EC_POINT_point2oct(ctx->group, ctx->user_pub, POINT_CONVERSION_UNCOMPRESSED, octets, sizeof(octets), NULL) != sizeof(octets)
+		|| !ctx->engine->point_decode(&ctx->engine_user_pub, octets, sizeof(octets))))
+	    rb_raise(eIESError, "Failed to convert the public key");
+    }
+
+    /* NULL, and decryption through OpenSSL, if the build has no 128-bit
+     * integers */
+    if (EC_KEY_get0_private_key(ec) && ladder_select(ctx, ladder))
+	ctx->ladder = xladder_new(ctx->group, ctx->order, EC_KEY_get0_private_key(ec));
+
+    if (RTEST(precompute) && ctx->user_pub && !ctx->engine) {
+	size_t budget = precompute == Qtrue ? IES_DEFAULT_PRECOMPUTE_BUDGET : NUM2SIZET(precompute);
+
+	ctx->user_pub_table = fixed_base_new(ctx->group, ctx->user_pub, budget, error);
+	if (!ctx->user_pub_table)
+	    rb_raise(eIESError, "Error in precomputation: %s", error);
+    }
+
+    if (RTEST(pool) && ctx->user_pub)
+	context_start_pool(ctx, pool);
+
+    return obj;
+}
+
+#ifdef HAVE_EVP_PKEY_GET_RAW_PUBLIC_KEY
+/* The context of OpenSSL::PKey::IES, which takes over the X25519 key pkey */
+static VALUE create_x25519_context(EVP_PKEY *pkey, const ies_suite_t *suite, VALUE opts)
+{
+    VALUE pool = ies_option(opts, id_pool);
+    unsigned char private_key[X25519_KEY_LENGTH];
+    size_t length = sizeof(private_key);
+    ies_ctx_t *ctx;
+    VALUE obj;
+
+    obj = TypedData_Make_Struct(rb_cObject, ies_ctx_t, &ies_ctx_type, ctx);
+    ctx->x25519_key = pkey;
+    /* given no buffer, OpenSSL reports the length whether the key is there
+     * or not */
+    ctx->x25519_private = EVP_PKEY_get_raw_private_key(pkey, private_key, &length) == 1;
+    OPENSSL_cleanse(private_key, sizeof(private_key));
+    ERR_clear_error();
+
+    if (suite->curve_nid != NID_undef && suite->curve_nid != NID_X25519)
+	rb_raise(eIESError, "Suite %s needs a key on %s", suite->name, OBJ_nid2sn(suite->curve_nid));
+
+    context_set_suite(ctx, suite);
+    /* the u-coordinate of the ephemeral key as it is */
+    ctx->ecdh_key_length = X25519_KEY_LENGTH;
+    ctx->stored_key_length = X25519_KEY_LENGTH;
+
+    if (RTEST(pool))
+	context_start_pool(ctx, pool);
+
+    return obj;
+}
+#endif
+
+/* Whether ctx can encrypt, i.e. has the public key of the recipient */
+static int context_has_public_key(const ies_ctx_t *ctx)
+{
+    return ctx->x25519_key || ctx->user_pub;
 }
 
-static VALUE ies_cryptogram_to_rb_string(const ies_ctx_t *ctx,const cryptogram_t *cryptogram)
+/* Whether ctx can decrypt */
+static int context_has_private_key(const ies_ctx_t *ctx)
 {
-    return rb_str_new((char *)cryptogram_key_data(cryptogram), cryptogram_data_sum_length(cryptogram));
+    if (ctx->x25519_key)
+	return ctx->x25519_private;
+    return EC_KEY_get0_private_key(ctx->user_key) != NULL;
 }
 
-static cryptogram_t *ies_rb_string_to_cryptogram(const ies_ctx_t *ctx, const VALUE string)
+static const ies_ctx_t *get_context(VALUE self)
+{
+    VALUE obj = rb_attr_get(self, id_context);
+    ies_ctx_t *ctx;
+
+    if (NIL_P(obj))
+	rb_raise(eIESError, "IES is not initialized");
+    TypedData_Get_Struct(obj, ies_ctx_t, &ies_ctx_type, ctx);
+    return ctx;
+}
+
+/* Points cryptogram at the bytes of string, which must stay alive and
+ * unmodified while it is in use.  Returns 0 if string is too short. */
+static int ies_cryptogram_wrap(const ies_ctx_t *ctx, const VALUE string, cryptogram_t *cryptogram)
 {
     size_t data_len = RSTRING_LEN(string);
-    const char * data = RSTRING_PTR(string);
+    unsigned char *data = (unsigned char *)RSTRING_PTR(string);
 
     size_t key_length = ctx->stored_key_length;
-    size_t mac_length = EVP_MD_size(ctx->md);
-    const cryptogram_t *cryptogram = cryptogram_alloc(key_length, mac_length, data_len - key_length - mac_length);
+    size_t iv_length = ctx->iv_length;
+    size_t mac_length = ctx->mac_length;
 
-    memcpy(cryptogram_key_data(cryptogram), data, data_len);
+    if (data_len < key_length + iv_length + mac_length)
+	return 0;
 
-    return cryptogram;
+    cryptogram_wrap(cryptogram, data, key_length, iv_length, mac_length, data_len - key_length - iv_length - mac_length);
+    return 1;
+}
+
+static void ies_rb_string_to_cryptogram(const ies_ctx_t *ctx, const VALUE string, cryptogram_t *cryptogram)
+{
+    if (!ies_cryptogram_wrap(ctx, string, cryptogram))
+	rb_raise(eIESError, "Cryptogram is too short");
 }
 
 /*
  *  call-seq:
  *     OpenSSL::PKey::EC::IES.new(key, algorithm_spec)
+ *     OpenSSL::PKey::EC::IES.new(key, algorithm_spec, options)
  *
- *  Algorithm spec is currently ignored.
+ *  The algorithm spec names a Suite, or is a Suite itself.  For backward
+ *  compatibility a spec that does not start with "ECIES-" selects
+ *  ECIES-AES128CBC-SHA1, the only algorithm there used to be.
+ *
+ *  Options:
+ *
+ *  +precompute+:: Memory budget in bytes (or +true+ for 1 MiB) for a table
+ *                 of multiples of the public key.  Encryption then computes
+ *                 the shared secret with additions only, at the price of
+ *                 table lookups that are not constant time.
+ *  +p256+::       Whether ECDH on prime256v1 runs on the built-in P-256
+ *                 code (constant time, 64-bit limbs) instead of OpenSSL.
+ *                 By default it does where OpenSSL has no code of its own
+ *                 for the curve and would use generic arithmetic; +true+
+ *                 makes it do so even then, if the build supports it, and
+ *                 +false+ never.  +precompute+ is ignored when it does.
+ *  +k256+::       The same for secp256k1 and the built-in code for it,
+ *                 which splits scalars with the curve's endomorphism.
+ *                 OpenSSL only has generic arithmetic for the curve, so by
+ *                 default it is used whenever the build supports it.
+ *  +ladder+::     Whether private_decrypt computes the shared secret from
+ *                 the x-coordinate of the ephemeral key alone, with a
+ *                 constant-time Montgomery ladder, instead of decompressing
+ *                 it and multiplying through OpenSSL.  Only for curves of
+ *                 prime order on prime fields.  By default it does on those
+ *                 of up to 256 bits where OpenSSL uses generic arithmetic
+ *                 (prime192v1, secp224r1, secp256k1 without +k256+ and
+ *                 the like), where it is faster; +true+ makes it do so on
+ *                 larger ones too, up to 521 bits, and +false+ never.
+ *  +pool+::       +true+ or a Hash with +:low+ and +:high+ watermarks
+ *                 (default 64 and 256).  A background thread keeps between
+ *                 low and high ephemeral keys with their envelope keys
+ *                 ready, and public_encrypt only runs the cipher and MAC
+ *                 while the pool is not empty.  See #pool_stats.
  */
-static VALUE ies_initialize(VALUE self, VALUE key, VALUE algo)
+static VALUE ies_initialize(int argc, VALUE *argv, VALUE self)
 {
+    VALUE key, algo, opts;
     VALUE args[1];
+    const ies_suite_t *suite;
+
+    rb_scan_args(argc, argv, "21", &key, &algo, &opts);
+    if (!NIL_P(opts))
+	Check_Type(opts, T_HASH);
+    suite = ies_suite_from_spec(algo);
 
     rb_iv_set(self, "@algorithm", algo);
 
     args[0] = key;
-    return rb_call_super(1, args);
+    rb_call_super(1, args);
+
+    rb_ivar_set(self, id_context, create_context(self, suite, opts));
+    return self;
+}
+
+#ifdef HAVE_EVP_PKEY_GET_RAW_PUBLIC_KEY
+static VALUE cX25519IES;
+
+/* The X25519 key in string, private or public, PEM or DER */
+static EVP_PKEY *x25519_key_read(VALUE string)
+{
+    EVP_PKEY *pkey = NULL;
+    BIO *bio;
+    int i;
+
+    StringValue(string);
+    for (i = 0; i < 4 && !pkey; i++) {
+	if (!(bio = BIO_new_mem_buf(RSTRING_PTR(string), RSTRING_LENINT(string))))
+	    break;
+	switch (i) {
+	case 0:
+	    /* an empty passphrase rather than a prompt on the terminal */
+	    pkey = PEM_read_bio_PrivateKey(bio, NULL, NULL, (void *)"");
+	    break;
+	case 1:
+	    pkey = PEM_read_bio_PUBKEY(bio, NULL, NULL, NULL);
+	    break;
+	case 2:
+	    pkey = d2i_PrivateKey_bio(bio, NULL);
+	    break;
+	default:
+	    pkey = d2i_PUBKEY_bio(bio, NULL);
+	}
+	BIO_free(bio);
+    }
+    ERR_clear_error();
+
+    if (!pkey)
+	rb_raise(eIESError, "Could not read the key");
+    if (EVP_PKEY_base_id(pkey) != EVP_PKEY_X25519) {
+	EVP_PKEY_free(pkey);
+	rb_raise(eIESError, "Key is not an X25519 key");
+    }
+    return pkey;
+}
+
+static VALUE x25519_key_pem(EVP_PKEY *pkey, int private)
+{
+    BUF_MEM *buf;
+    BIO *bio;
+    VALUE pem;
+    int ok;
+
+    if (!(bio = BIO_new(BIO_s_mem())))
+	rb_raise(eIESError, "Failed to allocate a BIO");
+    if (private)
+	ok = PEM_write_bio_PrivateKey(bio, pkey, NULL, NULL, 0, NULL, NULL);
+    else
+	ok = PEM_write_bio_PUBKEY(bio, pkey);
+    if (!ok) {
+	BIO_free(bio);
+	rb_raise(eIESError, "Failed to write the key");
+    }
+    BIO_get_mem_ptr(bio, &buf);
+    pem = rb_str_new(buf->data, buf->length);
+    BIO_free(bio);
+    return pem;
+}
+
+/*
+ *  call-seq:
+ *     OpenSSL::PKey::IES.new(key, algorithm_spec)
+ *     OpenSSL::PKey::IES.new(key, algorithm_spec, options)
+ *
+ *  IES on an X25519 key, given as PEM or DER, with the private key to
+ *  decrypt or just the public key to encrypt.  The ephemeral public key of
+ *  the cryptograms is 32 bytes.  The algorithm spec is as for
+ *  OpenSSL::PKey::EC::IES.new, with the suites for X25519 or the legacy
+ *  one; of the options there is +pool+.
+ */
+static VALUE x25519_ies_initialize(int argc, VALUE *argv, VALUE self)
+{
+    VALUE key, algo, opts;
+    const ies_suite_t *suite;
+
+    rb_scan_args(argc, argv, "21", &key, &algo, &opts);
+    if (!NIL_P(opts))
+	Check_Type(opts, T_HASH);
+    suite = ies_suite_from_spec(algo);
+
+    rb_iv_set(self, "@algorithm", algo);
+    /* the key last, as from here on nothing raises before the context
+     * owns it */
+    rb_ivar_set(self, id_context, create_x25519_context(x25519_key_read(key), suite, opts));
+    return self;
+}
+
+/*
+ *  call-seq:
+ *     OpenSSL::PKey::IES.generate(algorithm_spec) => IES
+ *     OpenSSL::PKey::IES.generate(algorithm_spec, options) => IES
+ *
+ *  IES on a new X25519 key pair.
+ */
+static VALUE x25519_ies_s_generate(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE algo, opts, self;
+    const ies_suite_t *suite;
+    EVP_PKEY_CTX *keygen;
+    EVP_PKEY *pkey = NULL;
+
+    rb_scan_args(argc, argv, "11", &algo, &opts);
+    if (!NIL_P(opts))
+	Check_Type(opts, T_HASH);
+    suite = ies_suite_from_spec(algo);
+    self = rb_obj_alloc(klass);
+    rb_iv_set(self, "@algorithm", algo);
+
+    if (!(keygen = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, NULL))
+	|| EVP_PKEY_keygen_init(keygen) != 1
+	|| EVP_PKEY_keygen(keygen, &pkey) != 1) {
+	EVP_PKEY_CTX_free(keygen);
+	rb_raise(eIESError, "Failed to generate the key");
+    }
+    EVP_PKEY_CTX_free(keygen);
+
+    rb_ivar_set(self, id_context, create_x25519_context(pkey, suite, opts));
+    return self;
+}
+
+/*
+ *  call-seq:
+ *     ies.private_key? => true or false
+ */
+static VALUE x25519_ies_private_key_p(VALUE self)
+{
+    return get_context(self)->x25519_private ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *     ies.public_key? => true
+ */
+static VALUE x25519_ies_public_key_p(VALUE self)
+{
+    get_context(self);
+    return Qtrue;
+}
+
+/*
+ *  call-seq:
+ *     ies.to_pem => String
+ *
+ *  The private key if there is one, otherwise the public key.
+ */
+static VALUE x25519_ies_to_pem(VALUE self)
+{
+    const ies_ctx_t *ctx = get_context(self);
+
+    return x25519_key_pem(ctx->x25519_key, ctx->x25519_private);
+}
+
+/*
+ *  call-seq:
+ *     ies.public_to_pem => String
+ *
+ *  The public key, for the senders.
+ */
+static VALUE x25519_ies_public_to_pem(VALUE self)
+{
+    return x25519_key_pem(get_context(self)->x25519_key, 0);
+}
+#endif
+
+/*
+ *  call-seq:
+ *     ecies.suite => Suite
+ */
+static VALUE ies_suite(VALUE self)
+{
+    return suite_object(get_context(self)->suite);
+}
+
+/*
+ *  call-seq:
+ *     ecies.pool_stats => Hash or nil
+ *
+ *  Counters of the KEM pool started with the +pool+ option: +:depth+,
+ *  +:capacity+, +:low_watermark+, +:high_watermark+, +:produced+,
+ *  +:consumed+, +:misses+ and +:refill_rate+ (tuples per second while
+ *  refilling).  Returns nil when there is no pool.
+ */
+static VALUE ies_pool_stats(VALUE self)
+{
+    const ies_ctx_t *ctx = get_context(self);
+    kem_pool_stats_t stats;
+    VALUE hash;
+
+    if (!ctx->kem_pool)
+	return Qnil;
+
+    kem_pool_stats(ctx->kem_pool, &stats);
+    hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("depth")), SIZET2NUM(stats.depth));
+    rb_hash_aset(hash, ID2SYM(rb_intern("capacity")), SIZET2NUM(stats.capacity));
+    rb_hash_aset(hash, ID2SYM(rb_intern("low_watermark")), SIZET2NUM(stats.low_watermark));
+    rb_hash_aset(hash, ID2SYM(rb_intern("high_watermark")), SIZET2NUM(stats.high_watermark));
+    rb_hash_aset(hash, ID2SYM(rb_intern("produced")), SIZET2NUM(stats.produced));
+    rb_hash_aset(hash, ID2SYM(rb_intern("consumed")), SIZET2NUM(stats.consumed));
+    rb_hash_aset(hash, ID2SYM(rb_intern("misses")), SIZET2NUM(stats.misses));
+    rb_hash_aset(hash, ID2SYM(rb_intern("refill_rate")), rb_float_new(stats.refill_rate));
+    return hash;
+}
+
+struct ies_encrypt_args {
+    const ies_ctx_t *ctx;
+    VALUE clear_text;
+    const unsigned char *data;
+    size_t length;
+    cryptogram_t cryptogram;	/* view of cipher_text */
+    int ok;
+    volatile int interrupted;
+    int completed;
+    char *error;
+};
+
+struct ies_decrypt_args {
+    const ies_ctx_t *ctx;
+    cryptogram_t cryptogram;	/* view of the cipher text */
+    unsigned char *data;
+    size_t length;
+    int ok;
+    volatile int interrupted;
+    int completed;
+    char *error;
+};
+
+static void ies_interrupt(void *ptr)
+{
+    *(volatile int *)ptr = 1;
+}
+
+/* Runs func without the GVL.  ies_interrupt is installed as the unblocking
+ * function, so that the operation gives up at its next chunk boundary when
+ * the thread receives an interrupt. */
+static void ies_call_without_gvl(void *(*func)(void *), void *args, volatile int *interrupted)
+{
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+    rb_thread_call_without_gvl2(func, args, ies_interrupt, (void *)interrupted);
+#else
+    func(args);
+#endif
+}
+
+static void *ies_encrypt_without_gvl(void *ptr)
+{
+    struct ies_encrypt_args *args = ptr;
+
+    args->ok = ecies_encrypt(args->ctx, args->data, args->length, &args->cryptogram, &args->interrupted, args->error);
+    args->completed = 1;
+    return NULL;
 }
 
 /*
@@ -71,68 +848,572 @@ static VALUE ies_initialize(VALUE self, VALUE key, VALUE algo)
  *     ecies.public_encrypt(plaintext) => String
  *
  *  The pem_string given in init must contain public key.
+ *  Encryption runs without the GVL, so other threads keep running meanwhile.
  */
 static VALUE ies_public_encrypt(VALUE self, VALUE clear_text)
 {
-    ies_ctx_t *ctx;
+    struct ies_encrypt_args args;
     char error[1024] = "Unknown error";
+    size_t body_length;
     VALUE cipher_text;
-    cryptogram_t *cryptogram;
 
     StringValue(clear_text);
 
-    ctx = create_context(self);
-    if (!EC_KEY_get0_public_key(ctx->user_key))
-	rb_raise(eIESError, "Given EC key is not public key");
+    args.ctx = get_context(self);
+    if (!context_has_public_key(args.ctx))
+	rb_raise(eIESError, "Given key is not public key");
+
+    /* The plain text is read without the GVL.  A frozen copy shares the
+     * buffer, so later writes to clear_text cannot reach the bytes we read
+     * and, unlike rb_str_locktmp, several threads may encrypt one string. */
+    args.clear_text = rb_str_new_frozen(clear_text);
+    args.data = (unsigned char *)RSTRING_PTR(args.clear_text);
+    args.length = RSTRING_LEN(args.clear_text);
+    args.error = error;
+
+    /* The cipher text is written straight into the result, which nothing
+     * else references until it is returned. */
+    body_length = ecies_body_length(args.ctx, args.length);
+    cipher_text = rb_str_new(NULL, args.ctx->stored_key_length + args.ctx->iv_length + body_length + args.ctx->mac_length);
+    cryptogram_wrap(&args.cryptogram, (unsigned char *)RSTRING_PTR(cipher_text),
+		    args.ctx->stored_key_length, args.ctx->iv_length, args.ctx->mac_length, body_length);
 
-    cryptogram = ecies_encrypt(ctx, (unsigned char*)RSTRING_PTR(clear_text), RSTRING_LEN(clear_text), error);
-    if (cryptogram == NULL) {
-	free(ctx);
-	ctx = NULL;
-	rb_raise(eIESError, "Error in encryption: %s", error);
+    for (;;) {
+	args.ok = 0;
+	args.interrupted = 0;
+	args.completed = 0;
+	ies_call_without_gvl(ies_encrypt_without_gvl, &args, &args.interrupted);
+	if (args.ok || (args.completed && !args.interrupted))
+	    break;
+	/* Raises if the interrupt was an exception, otherwise start over */
+	rb_thread_check_ints();
     }
-    cipher_text = ies_cryptogram_to_rb_string(ctx, cryptogram);
-    cryptogram_free(cryptogram);
-    free(ctx);
+
+    RB_GC_GUARD(args.clear_text);
+    if (!args.ok)
+	rb_raise(eIESError, "Error in encryption: %s", args.error);
+
     return cipher_text;
 }
 
+static void *ies_decrypt_without_gvl(void *ptr)
+{
+    struct ies_decrypt_args *args = ptr;
+
+    args->ok = ecies_decrypt(args->ctx, &args->cryptogram, args->data, &args->length, &args->interrupted, args->error);
+    args->completed = 1;
+    return NULL;
+}
+
 /*
  *  call-seq:
  *     ecies.private_decrypt(plaintext) => String
  *
  *  The pem_string given in init must contain private key.
+ *  Decryption runs without the GVL, so other threads keep running meanwhile.
  */
 static VALUE ies_private_decrypt(VALUE self, VALUE cipher_text)
 {
-    ies_ctx_t *ctx;
+    struct ies_decrypt_args args;
     char error[1024] = "Unknown error";
     VALUE clear_text;
-    cryptogram_t *cryptogram;
-    size_t length;
-    unsigned char *data;
 
     StringValue(cipher_text);
 
-    ctx = create_context(self);
-    if (!EC_KEY_get0_private_key(ctx->user_key))
-	rb_raise(eIESError, "Given EC key is not private key");
+    args.ctx = get_context(self);
+    if (!context_has_private_key(args.ctx))
+	rb_raise(eIESError, "Given key is not private key");
 
-    cryptogram = ies_rb_string_to_cryptogram(ctx, cipher_text);
-    data = ecies_decrypt(ctx, cryptogram, &length, error);
-    cryptogram_free(cryptogram);
-    free(ctx);
+    /* Parsed in place, from a frozen copy for the same reason as in
+     * public_encrypt.  The clear text is written into the result, which is
+     * then cut down to the length the padding leaves. */
+    cipher_text = rb_str_new_frozen(cipher_text);
+    ies_rb_string_to_cryptogram(args.ctx, cipher_text, &args.cryptogram);
+    clear_text = rb_str_new(NULL, cryptogram_body_length(&args.cryptogram));
+    args.data = (unsigned char *)RSTRING_PTR(clear_text);
+    args.length = 0;
+    args.error = error;
 
-    if (data == NULL) {
-	rb_raise(eIESError, "Error in decryption: %s", error);
+    for (;;) {
+	args.ok = 0;
+	args.interrupted = 0;
+	args.completed = 0;
+	ies_call_without_gvl(ies_decrypt_without_gvl, &args, &args.interrupted);
+	if (args.ok || (args.completed && !args.interrupted))
+	    break;
+	rb_thread_check_ints();
     }
 
-    clear_text = rb_str_new((char *)data, length);
-    free(data);
+    RB_GC_GUARD(cipher_text);
+    if (!args.ok)
+	rb_raise(eIESError, "Error in decryption: %s", args.error);
 
+    rb_str_set_len(clear_text, args.length);
     return clear_text;
 }
 
+/* Worker pool set by IES.configure, see worker_pool.c.  A batch holds a
+ * reference while it runs, so that configure may replace the pool
+ * meanwhile; the last of them frees it.  Only touched with the GVL held. */
+struct ies_workers {
+    worker_pool_t *pool;
+    long refs;
+};
+
+static struct ies_workers *ies_workers_current;
+
+static struct ies_workers *ies_workers_acquire(void)
+{
+    if (ies_workers_current)
+	ies_workers_current->refs++;
+    return ies_workers_current;
+}
+
+static void ies_workers_release(struct ies_workers *workers)
+{
+    if (--workers->refs == 0 && workers != ies_workers_current) {
+	worker_pool_free(workers->pool);
+	xfree(workers);
+    }
+}
+
+/* Strings the items of a batch point into while the GVL is released.  In an
+ * Array GC.compact could move them, together with the bytes of the small
+ * ones that are embedded in the object, so they are held here and marked
+ * with rb_gc_mark, which pins them. */
+struct ies_batch_keep {
+    VALUE *strings;
+    long count;
+};
+
+static void ies_batch_keep_mark(void *ptr)
+{
+    struct ies_batch_keep *keep = ptr;
+    long i;
+
+    for (i = 0; i < keep->count; i++)
+	rb_gc_mark(keep->strings[i]);
+}
+
+static void ies_batch_keep_free(void *ptr)
+{
+    struct ies_batch_keep *keep = ptr;
+
+    xfree(keep->strings);
+    xfree(keep);
+}
+
+static const rb_data_type_t ies_batch_keep_type = {
+    "OpenSSL/ECIES/batch",
+    { ies_batch_keep_mark, ies_batch_keep_free, 0, },
+};
+
+static VALUE ies_batch_keep_new(long count, struct ies_batch_keep **keep)
+{
+    VALUE obj = TypedData_Make_Struct(rb_cObject, struct ies_batch_keep, &ies_batch_keep_type, *keep);
+    long i;
+
+    (*keep)->strings = ALLOC_N(VALUE, count);
+    for (i = 0; i < count; i++)
+	(*keep)->strings[i] = Qnil;
+    (*keep)->count = count;
+    return obj;
+}
+
+/* One message of a batch */
+struct ies_batch_item {
+    cryptogram_t cryptogram;	/* view of the output or of the input */
+    unsigned char *data;	/* clear text, input or output */
+    size_t length;
+    const unsigned char *envelope_key;	/* made in advance, or NULL */
+    int done;
+    int failed;
+    char *error;		/* malloc'ed, NULL if failed before the native loop */
+};
+
+/* The items are processed in tasks of task_size consecutive ones, on the
+ * worker pool if there is one and in the calling thread otherwise. */
+struct ies_batch_args {
+    const ies_ctx_t *ctx;
+    int decrypt;
+    VALUE inputs;
+    VALUE keep;			/* holds the strings below */
+    VALUE *strings;		/* input and output of each item, pinned */
+    struct ies_batch_item *items;
+    long count;
+    long task_size;		/* at most IES_KEY_BATCH */
+    struct ies_workers *workers;
+    volatile int interrupted;
+};
+
+/* Makes the envelope keys of the items from begin to end together, which
+ * is cheaper than one by one.  Items left without a key, because the batch
+ * failed or there is a KEM pool to take them from, make theirs in
+ * ecies_encrypt.  Decryption restores each key in ecies_decrypt: its
+ * variable-base multiplication dwarfs the inversion a batch would share. */
+static void ies_batch_make_keys(struct ies_batch_args *args, long begin, long end, unsigned char *envelope_keys, char *error)
+{
+    const ies_ctx_t *ctx = args->ctx;
+    struct ies_batch_item *batch[IES_KEY_BATCH];
+    unsigned char *key_octets[IES_KEY_BATCH];
+    size_t i, count = 0;
+    long index;
+
+    for (index = begin; index < end; index++)
+	args->items[index].envelope_key = NULL;
+    if (args->decrypt || ctx->kem_pool)
+	return;
+
+    for (index = begin; index < end; index++) {
+	struct ies_batch_item *item = &args->items[index];
+
+	if (item->done || item->length == 0)
+	    continue;
+	batch[count] = item;
+	key_octets[count] = cryptogram_key_data(&item->cryptogram);
+	count++;
+    }
+
+    if (count < 2 || !ecies_envelope_keys_create(ctx, count, key_octets, envelope_keys, error))
+	return;
+    for (i = 0; i < count; i++)
+	batch[i]->envelope_key = envelope_keys + i * ctx->envelope_key_length;
+}
+
+/* Messages up to this long are encrypted together by ecies_encrypt_multi,
+ * longer ones one by one in interruptible chunks */
+#define IES_MULTI_MAX_LENGTH IES_CHUNK_SIZE
+
+/* Encrypts the short messages from begin to end that have their keys
+ * together, for the suites ecies_encrypt_multi supports */
+static void ies_batch_encrypt_multi(struct ies_batch_args *args, long begin, long end, char *error)
+{
+    struct ies_batch_item *batch[IES_KEY_BATCH];
+    const unsigned char *keys[IES_KEY_BATCH], *data[IES_KEY_BATCH];
+    cryptogram_t *cryptograms[IES_KEY_BATCH];
+    size_t lengths[IES_KEY_BATCH];
+    size_t i, count = 0;
+    long index;
+
+    if (args->decrypt || args->ctx->aead)
+	return;
+
+    for (index = begin; index < end; index++) {
+	struct ies_batch_item *item = &args->items[index];
+
+	if (item->done || !item->envelope_key || item->length > IES_MULTI_MAX_LENGTH)
+	    continue;
+	batch[count] = item;
+	keys[count] = item->envelope_key;
+	data[count] = item->data;
+	lengths[count] = item->length;
+	cryptograms[count] = &item->cryptogram;
+	count++;
+    }
+
+    if (count < 2 || !ecies_encrypt_multi(args->ctx, count, keys, data, lengths, cryptograms, error))
+	return;
+    for (i = 0; i < count; i++)
+	batch[i]->done = 1;
+}
+
+/* Processes the items of one task that are not done yet.  An item that
+ * fails because of the interrupt is left for the next round. */
+static void ies_batch_task(void *ptr, long task)
+{
+    struct ies_batch_args *args = ptr;
+    const ies_ctx_t *ctx = args->ctx;
+    const long begin = task * args->task_size;
+    const long end = begin + args->task_size < args->count ? begin + args->task_size : args->count;
+    unsigned char envelope_keys[IES_KEY_BATCH * IES_MAX_ENVELOPE_KEY_LENGTH];
+    char error[1024] = "Unknown error";
+    long i;
+    int ok;
+
+    ies_batch_make_keys(args, begin, end, envelope_keys, error);
+    ies_batch_encrypt_multi(args, begin, end, error);
+
+    for (i = begin; i < end && !args->interrupted; i++) {
+	struct ies_batch_item *item = &args->items[i];
+
+	if (item->done)
+	    continue;
+	if (args->decrypt)
+	    ok = ecies_decrypt(ctx, &item->cryptogram, item->data, &item->length, &args->interrupted, error);
+	else if (item->envelope_key)
+	    ok = ecies_encrypt_with_key(ctx, item->envelope_key, item->data, item->length, &item->cryptogram, &args->interrupted, error);
+	else
+	    ok = ecies_encrypt(ctx, item->data, item->length, &item->cryptogram, &args->interrupted, error);
+	if (!ok && args->interrupted)
+	    break;
+	if (!ok) {
+	    item->failed = 1;
+	    item->error = strdup(error);
+	}
+	item->done = 1;
+    }
+
+    for (i = begin; i < end; i++)
+	args->items[i].envelope_key = NULL;
+    OPENSSL_cleanse(envelope_keys, sizeof(envelope_keys));
+}
+
+static void *ies_batch_without_gvl(void *ptr)
+{
+    struct ies_batch_args *args = ptr;
+    const long tasks = (args->count + args->task_size - 1) / args->task_size;
+    long task;
+
+    if (tasks > 1 && args->workers
+	&& worker_pool_run(args->workers->pool, ies_batch_task, args, tasks, &args->interrupted))
+	return NULL;
+
+    for (task = 0; task < tasks && !args->interrupted; task++)
+	ies_batch_task(args, task);
+    return NULL;
+}
+
+/* Like ies_interrupt, and also wakes the batch if it waits for the worker
+ * pool to finish the batch of another thread */
+static void ies_batch_interrupt(void *ptr)
+{
+    struct ies_batch_args *args = ptr;
+
+    args->interrupted = 1;
+    if (args->workers)
+	worker_pool_interrupt(args->workers->pool);
+}
+
+static int ies_batch_pending(const struct ies_batch_args *args)
+{
+    long i;
+
+    for (i = 0; i < args->count; i++) {
+	if (!args->items[i].done)
+	    return 1;
+    }
+    return 0;
+}
+
+/* Sets up the item for the index-th input with the GVL held, allocating its
+ * output.  Only a TypeError raises, other problems fail the item alone. */
+static void ies_batch_prepare(struct ies_batch_args *args, long index)
+{
+    const ies_ctx_t *ctx = args->ctx;
+    struct ies_batch_item *item = &args->items[index];
+    VALUE input = rb_ary_entry(args->inputs, index);
+    VALUE output;
+
+    StringValue(input);
+    input = rb_str_new_frozen(input);
+
+    if (args->decrypt) {
+	if (!ies_cryptogram_wrap(ctx, input, &item->cryptogram)) {
+	    item->done = item->failed = 1;
+	    output = Qnil;
+	} else {
+	    output = rb_str_new(NULL, cryptogram_body_length(&item->cryptogram));
+	    item->data = (unsigned char *)RSTRING_PTR(output);
+	}
+    } else {
+	size_t body_length;
+
+	item->data = (unsigned char *)RSTRING_PTR(input);
+	item->length = RSTRING_LEN(input);
+	body_length = ecies_body_length(ctx, item->length);
+	output = rb_str_new(NULL, ctx->stored_key_length + ctx->iv_length + body_length + ctx->mac_length);
+	cryptogram_wrap(&item->cryptogram, (unsigned char *)RSTRING_PTR(output),
+			ctx->stored_key_length, ctx->iv_length, ctx->mac_length, body_length);
+    }
+
+    args->strings[2 * index] = input;
+    args->strings[2 * index + 1] = output;
+}
+
+static VALUE ies_batch_run(VALUE ptr)
+{
+    struct ies_batch_args *args = (struct ies_batch_args *)ptr;
+    const char *prefix = args->decrypt ? "Error in decryption" : "Error in encryption";
+    VALUE results;
+    long i;
+
+    for (i = 0; i < args->count; i++)
+	ies_batch_prepare(args, i);
+
+    /* Tasks small enough for every worker to get a few, so that stealing
+     * can even out the load, but no larger than a batch of keys */
+    args->workers = ies_workers_acquire();
+    if (args->workers) {
+	long threads = worker_pool_threads(args->workers->pool);
+
+	args->task_size = args->count / (threads * 4);
+    }
+    if (args->task_size < 1)
+	args->task_size = 1;
+    if (!args->workers || args->task_size > IES_KEY_BATCH)
+	args->task_size = IES_KEY_BATCH;
+
+    while (ies_batch_pending(args)) {
+	args->interrupted = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+	rb_thread_call_without_gvl2(ies_batch_without_gvl, args, ies_batch_interrupt, args);
+#else
+	ies_batch_without_gvl(args);
+#endif
+	if (ies_batch_pending(args))
+	    rb_thread_check_ints();
+    }
+
+    results = rb_ary_new2(args->count);
+    for (i = 0; i < args->count; i++) {
+	struct ies_batch_item *item = &args->items[i];
+	VALUE output = args->strings[2 * i + 1];
+
+	if (item->failed) {
+	    const char *message = item->error ? item->error : "Cryptogram is too short";
+
+	    rb_ary_push(results, rb_exc_new_str(eIESError, rb_sprintf("%s: %s", prefix, message)));
+	    continue;
+	}
+	if (args->decrypt)
+	    rb_str_set_len(output, item->length);
+	rb_ary_push(results, output);
+    }
+    return results;
+}
+
+static VALUE ies_batch_ensure(VALUE ptr)
+{
+    struct ies_batch_args *args = (struct ies_batch_args *)ptr;
+    long i;
+
+    for (i = 0; i < args->count; i++) {
+	struct ies_batch_item *item = &args->items[i];
+
+	if (item->error)
+	    free(item->error);
+	/* A failed decryption may leave clear text behind */
+	if (args->decrypt && item->failed && item->data)
+	    OPENSSL_cleanse(item->data, cryptogram_body_length(&item->cryptogram));
+    }
+    if (args->workers)
+	ies_workers_release(args->workers);
+    xfree(args->items);
+    return Qnil;
+}
+
+static VALUE ies_batch(VALUE self, VALUE inputs, int decrypt)
+{
+    struct ies_batch_args args;
+    struct ies_batch_keep *keep;
+    VALUE results;
+
+    Check_Type(inputs, T_ARRAY);
+
+    args.ctx = get_context(self);
+    if (decrypt && !context_has_private_key(args.ctx))
+	rb_raise(eIESError, "Given key is not private key");
+    if (!decrypt && !context_has_public_key(args.ctx))
+	rb_raise(eIESError, "Given key is not public key");
+
+    args.decrypt = decrypt;
+    args.inputs = rb_ary_dup(inputs);
+    args.count = RARRAY_LEN(args.inputs);
+    args.task_size = 0;
+    args.workers = NULL;
+    args.keep = ies_batch_keep_new(2 * args.count, &keep);
+    args.strings = keep->strings;
+    args.items = ZALLOC_N(struct ies_batch_item, args.count);
+
+    results = rb_ensure(ies_batch_run, (VALUE)&args, ies_batch_ensure, (VALUE)&args);
+
+    RB_GC_GUARD(args.inputs);
+    RB_GC_GUARD(args.keep);
+    return results;
+}
+
+/*
+ *  call-seq:
+ *     ecies.public_encrypt_batch(plaintexts) => Array
+ *
+ *  Encrypts every String of the Array in one native call, with one release
+ *  of the GVL for the whole batch.  Returns an Array in the same order
+ *  holding the cryptogram of each plain text, or the IESError its
+ *  encryption failed with; one failure does not stop the rest of the batch.
+ */
+static VALUE ies_public_encrypt_batch(VALUE self, VALUE clear_texts)
+{
+    return ies_batch(self, clear_texts, 0);
+}
+
+/*
+ *  call-seq:
+ *     ecies.private_decrypt_batch(cryptograms) => Array
+ *
+ *  Decrypts every String of the Array in one native call, like
+ *  #public_encrypt_batch.  The result holds the plain text of each
+ *  cryptogram, or the IESError its decryption failed with.
+ */
+static VALUE ies_private_decrypt_batch(VALUE self, VALUE cipher_texts)
+{
+    return ies_batch(self, cipher_texts, 1);
+}
+
+/*
+ *  call-seq:
+ *     OpenSSL::PKey::EC::IES.configure(threads: n) => nil
+ *
+ *  Sets how many native threads #public_encrypt_batch and
+ *  #private_decrypt_batch spread their work over, so that one call can keep
+ *  every core busy.  With threads: 1, the default, a batch runs in the
+ *  calling thread.  Batches already running finish on the threads they
+ *  started with.
+ */
+static VALUE ies_s_configure(VALUE klass, VALUE opts)
+{
+    VALUE threads;
+    struct ies_workers *workers = NULL, *previous;
+    char error[1024] = "Unknown error";
+    int n;
+
+    Check_Type(opts, T_HASH);
+    threads = ies_option(opts, id_threads);
+    if (NIL_P(threads))
+	return Qnil;
+
+    n = NUM2INT(threads);
+    if (n < 1 || n > WORKER_POOL_MAX_THREADS)
+	rb_raise(rb_eArgError, "threads must be between 1 and %d", WORKER_POOL_MAX_THREADS);
+
+    if (n > 1) {
+	workers = ALLOC(struct ies_workers);
+	workers->refs = 1;
+	if (!(workers->pool = worker_pool_new(n, error))) {
+	    xfree(workers);
+	    rb_raise(eIESError, "%s", error);
+	}
+    }
+
+    previous = ies_workers_current;
+    ies_workers_current = workers;
+    if (previous)
+	ies_workers_release(previous);
+    return Qnil;
+}
+
+/*
+ *  call-seq:
+ *     OpenSSL::PKey::EC::IES.threads => Integer
+ *
+ *  Number of threads a batch runs on, see ::configure.
+ */
+static VALUE ies_s_threads(VALUE klass)
+{
+    if (!ies_workers_current)
+	return INT2FIX(1);
+    return INT2FIX(worker_pool_threads(ies_workers_current->pool));
+}
+
 /*
  * INIT
  */
@@ -151,9 +1432,54 @@ Init_ies(void)
      */
     cIES = rb_define_class_under(cEC, "IES", cEC);
 
-    rb_define_method(cIES, "initialize", ies_initialize, 2);
+    rb_define_singleton_method(cIES, "configure", ies_s_configure, 1);
+    rb_define_singleton_method(cIES, "threads", ies_s_threads, 0);
+    rb_define_method(cIES, "initialize", ies_initialize, -1);
     rb_define_method(cIES, "public_encrypt", ies_public_encrypt, 1);
     rb_define_method(cIES, "private_decrypt", ies_private_decrypt, 1);
+    rb_define_method(cIES, "public_encrypt_batch", ies_public_encrypt_batch, 1);
+    rb_define_method(cIES, "private_decrypt_batch", ies_private_decrypt_batch, 1);
+    rb_define_method(cIES, "pool_stats", ies_pool_stats, 0);
+    rb_define_method(cIES, "suite", ies_suite, 0);
 
     eIESError = rb_define_class_under(cIES, "IESError", rb_eRuntimeError);
+
+    init_suite_registry(cIES);
+
+#ifdef HAVE_EVP_PKEY_GET_RAW_PUBLIC_KEY
+    /* Document-class: OpenSSL::PKey::IES
+     *
+     * The same IES on X25519 keys, with ECDH through EVP_PKEY_derive.  It
+     * shares the suites, the IESError and the batch threads with
+     * OpenSSL::PKey::EC::IES.
+     */
+    cX25519IES = rb_define_class_under(rb_path2class("OpenSSL::PKey"), "IES", rb_cObject);
+    rb_define_const(cX25519IES, "IESError", eIESError);
+    rb_define_const(cX25519IES, "Suite", cSuite);
+
+    rb_define_singleton_method(cX25519IES, "generate", x25519_ies_s_generate, -1);
+    rb_define_singleton_method(cX25519IES, "configure", ies_s_configure, 1);
+    rb_define_singleton_method(cX25519IES, "threads", ies_s_threads, 0);
+    rb_define_method(cX25519IES, "initialize", x25519_ies_initialize, -1);
+    rb_define_method(cX25519IES, "private_key?", x25519_ies_private_key_p, 0);
+    rb_define_method(cX25519IES, "public_key?", x25519_ies_public_key_p, 0);
+    rb_define_method(cX25519IES, "to_pem", x25519_ies_to_pem, 0);
+    rb_define_method(cX25519IES, "public_to_pem", x25519_ies_public_to_pem, 0);
+    rb_define_method(cX25519IES, "public_encrypt", ies_public_encrypt, 1);
+    rb_define_method(cX25519IES, "private_decrypt", ies_private_decrypt, 1);
+    rb_define_method(cX25519IES, "public_encrypt_batch", ies_public_encrypt_batch, 1);
+    rb_define_method(cX25519IES, "private_decrypt_batch", ies_private_decrypt_batch, 1);
+    rb_define_method(cX25519IES, "pool_stats", ies_pool_stats, 0);
+    rb_define_method(cX25519IES, "suite", ies_suite, 0);
+#endif
+
+    id_context = rb_intern("context");
+    id_precompute = rb_intern("precompute");
+    id_pool = rb_intern("pool");
+    id_low = rb_intern("low");
+    id_high = rb_intern("high");
+    id_threads = rb_intern("threads");
+    id_p256 = rb_intern("p256");
+    id_k256 = rb_intern("k256");
+    id_ladder = rb_intern("ladder");
 }
@@ -5,42 +5,255 @@
 #ifndef _IES_H_
 #define _IES_H_
 
+#ifdef RUBY_EXTCONF_H
+#include RUBY_EXTCONF_H
+#endif
+
 #include <openssl/ssl.h>
 #include <openssl/crypto.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <stdint.h>
 
 #include <ruby.h>
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
+
+/* OpenSSL 1.0.x equivalents of the 1.1 API for the opaque structures */
+#ifndef HAVE_EVP_PKEY_GET0_EC_KEY
+#define EVP_PKEY_get0_EC_KEY(pkey) ((pkey)->pkey.ec)
+#endif
+/* OpenSSL 3 hands the key out const; it is only read and reference counted */
+#define ies_pkey_get0_ec_key(pkey) ((EC_KEY *)EVP_PKEY_get0_EC_KEY(pkey))
+#ifndef HAVE_EVP_MD_CTX_NEW
+#define EVP_MD_CTX_new() EVP_MD_CTX_create()
+#define EVP_MD_CTX_free(mctx) EVP_MD_CTX_destroy(mctx)
+#define EVP_MD_CTX_reset(mctx) EVP_MD_CTX_cleanup(mctx)
+#endif
+#ifndef HAVE_EVP_CIPHER_CTX_RESET
+#define EVP_CIPHER_CTX_reset(cctx) EVP_CIPHER_CTX_cleanup(cctx)
+#endif
+#ifndef HAVE_HMAC_CTX_NEW
+static inline HMAC_CTX *HMAC_CTX_new(void)
+{
+    HMAC_CTX *hctx = OPENSSL_malloc(sizeof(HMAC_CTX));
+
+    if (hctx)
+	HMAC_CTX_init(hctx);
+    return hctx;
+}
+static inline void HMAC_CTX_free(HMAC_CTX *hctx)
+{
+    if (hctx) {
+	HMAC_CTX_cleanup(hctx);
+	OPENSSL_free(hctx);
+    }
+}
+/* cleanup leaves the context zeroed, the same state as HMAC_CTX_init */
+static inline int HMAC_CTX_reset(HMAC_CTX *hctx)
+{
+    HMAC_CTX_cleanup(hctx);
+    return 1;
+}
+#endif
+#ifndef EVP_CTRL_AEAD_GET_TAG
+#define EVP_CTRL_AEAD_GET_TAG EVP_CTRL_GCM_GET_TAG
+#define EVP_CTRL_AEAD_SET_TAG EVP_CTRL_GCM_SET_TAG
+#endif
+
+/* Bulk data is processed in chunks of this size so that an operation running
+ * without the GVL notices a pending interrupt in bounded time. */
+#define IES_CHUNK_SIZE (64 * 1024)
+
+#define SET_ERROR(string) \
+    sprintf(error, "%s %s:%d", (string), __FILE__, __LINE__)
+/* ERR_error_string(e, NULL) returns a static buffer, which is not safe once
+ * the GVL has been released, so format into a local one. */
+#define SET_OSSL_ERROR(string) do { \
+    char ossl_error[256]; \
+    ERR_error_string_n(ERR_get_error(), ossl_error, sizeof(ossl_error)); \
+    sprintf(error, "%s {error = %s} %s:%d", (string), ossl_error, __FILE__, __LINE__); \
+} while (0)
+#define INTERRUPTED(flag) ((flag) && *(flag))
+
+/* Tag length of the AEAD suites */
+#define IES_AEAD_TAG_LENGTH 16
+
+/* Largest ECDH shared secret and envelope key, for buffers on the stack */
+#define IES_MAX_ECDH_KEY_LENGTH ((OPENSSL_ECC_MAX_FIELD_BITS + 7) / 8)
+#define IES_MAX_ENVELOPE_KEY_LENGTH (EVP_MAX_KEY_LENGTH + EVP_MAX_MD_SIZE)
+
+/* Most envelope keys made together by ecies_envelope_keys_create() */
+#define IES_KEY_BATCH 32
 
+/* Per-thread temporaries of encryption and decryption, see scratch.c */
+#define SCRATCH_POINTS 2
 typedef struct {
+    BN_CTX *bn_ctx;
+    EVP_MD_CTX *md;		/* of the KDF */
+    EVP_CIPHER_CTX *cipher;
+    HMAC_CTX *hmac;
+    const EC_GROUP *group;	/* the points belong to */
+    EC_POINT *points[SCRATCH_POINTS];
+    EVP_PKEY_CTX *x25519_keygen;	/* see x25519.c */
+    EVP_PKEY_CTX *x25519_derive;	/* bound to the last recipient key */
+    int cached;			/* owned by the thread, not by the caller */
+} scratch_t;
+
+/* Fixed-base comb for a point that does not change, i.e. the recipient key */
+typedef struct {
+    EC_POINT **table;		/* rows * (2^window - 1) affine points */
+    int window;
+    int rows;
+    size_t memsize;
+} fixed_base_t;
+
+/* Affine point in the form p256.c and k256.c work with */
+typedef struct {
+    uint64_t x[4];
+    uint64_t y[4];
+} curve_point_t;
+#define CURVE_SCALAR_LENGTH 32
+
+/* ECDH on one curve with code of our own instead of OpenSSL's, see p256.c
+ * and k256.c.  Scalars are CURVE_SCALAR_LENGTH big-endian bytes. */
+typedef struct {
+    int (*setup)(void);		/* with the GVL held; 0 if not built */
+    int (*point_decode)(curve_point_t *point, const unsigned char *octets, size_t length);
+    int (*public_key)(const unsigned char *k, unsigned char *compressed);
+    int (*shared_secret)(const curve_point_t *point, const unsigned char *k, unsigned char *x_out);
+} curve_engine_t;
+
+/* Receiving side of ECDH on x-coordinates alone, see xladder.c */
+typedef struct xladder_st xladder_t;
+#define XLADDER_MAX_LIMBS 9
+
+/* Pool of KEM results made in advance for one recipient, see kem_pool.c */
+typedef struct kem_pool_st kem_pool_t;
+
+typedef struct {
+    size_t depth;		/* tuples ready to use */
+    size_t capacity;
+    size_t low_watermark;	/* refilling starts at or below this depth */
+    size_t high_watermark;	/* and stops at this depth */
+    size_t produced;
+    size_t consumed;
+    size_t misses;		/* encryptions that found the pool empty */
+    double refill_rate;		/* tuples per second while refilling */
+} kem_pool_stats_t;
+
+/* Native threads that run batches, see worker_pool.c */
+typedef struct worker_pool_st worker_pool_t;
+#define WORKER_POOL_MAX_THREADS 256
+
+/* A named algorithm suite, see suite.c */
+typedef struct {
+    const char *name;
+    int curve_nid;		/* NID_undef for any curve */
+    const EVP_CIPHER *(*cipher)(void);
+    const EVP_MD *(*md)(void);	/* of the MAC, NULL for an AEAD cipher */
+    const EVP_MD *(*kdf_md)(void);
+} ies_suite_t;
+
+typedef struct {
+    const ies_suite_t *suite;
     const EVP_CIPHER *cipher;
     const EVP_MD *md; 		/* for mac tag */
     const EVP_MD *kdf_md; 	/* for KDF */
     size_t stored_key_length;
-    const EC_KEY *user_key;
+    size_t ecdh_key_length;	/* shared secret, i.e. field size in bytes */
+    size_t envelope_key_length;	/* cipher key followed by mac key */
+    size_t mac_length;		/* HMAC or AEAD tag */
+    size_t block_length;
+    size_t iv_length;		/* random nonce in the cryptogram, 0 if none */
+    int aead;			/* the cipher authenticates, no HMAC */
+    EC_KEY *user_key;
+    const EC_GROUP *group;	/* see group_intern() */
+    int group_owned;
+    EC_POINT *user_pub;		/* public key of user_key, on group */
+    BIGNUM *order;		/* of the group */
+    int prime_order;		/* cofactor is 1 */
+    fixed_base_t *user_pub_table;	/* optional, see fixed_base_new() */
+    kem_pool_t *kem_pool;		/* optional, see kem_pool_new() */
+    const curve_engine_t *engine;	/* ECDH not through OpenSSL, or NULL */
+    curve_point_t engine_user_pub;	/* user_pub, if engine */
+    xladder_t *ladder;		/* decryption on x alone, or NULL */
+    EVP_PKEY *x25519_key;	/* X25519 instead of user_key, see x25519.c */
+    int x25519_private;		/* x25519_key has its private half */
 } ies_ctx_t;
 
+/* A cryptogram is the ephemeral point, the nonce (AEAD suites only), the
+ * cipher text and the MAC tag back to back.  The head only points into
+ * memory of the caller, such as a Ruby String (cryptogram_wrap). */
 typedef struct {
     struct {
 	size_t key;
+	size_t iv;
 	size_t mac;
 	size_t body;
     } length;
+    unsigned char *data;
 } cryptogram_head_t;
 
-typedef unsigned char * cryptogram_t;
+typedef cryptogram_head_t cryptogram_t;
 
-void cryptogram_free(cryptogram_t *cryptogram);
 unsigned char * cryptogram_key_data(const cryptogram_t *cryptogram);
+unsigned char * cryptogram_iv_data(const cryptogram_t *cryptogram);
 unsigned char * cryptogram_mac_data(const cryptogram_t *cryptogram);
 unsigned char * cryptogram_body_data(const cryptogram_t *cryptogram);
 size_t cryptogram_key_length(const cryptogram_t *cryptogram);
+size_t cryptogram_iv_length(const cryptogram_t *cryptogram);
 size_t cryptogram_mac_length(const cryptogram_t *cryptogram);
 size_t cryptogram_body_length(const cryptogram_t *cryptogram);
-size_t cryptogram_data_sum_length(const cryptogram_t *cryptogram);
-size_t cryptogram_total_length(const cryptogram_t *cryptogram);
-cryptogram_t * cryptogram_alloc(size_t key, size_t mac, size_t body);
+void cryptogram_wrap(cryptogram_t *cryptogram, unsigned char *data, size_t key, size_t iv, size_t mac, size_t body);
+
+size_t suite_count(void);
+const ies_suite_t *suite_at(size_t index);
+const ies_suite_t *suite_legacy(void);
+const ies_suite_t *suite_lookup(const char *name, size_t length);
+double suite_throughput(const ies_suite_t *suite);
+
+const EC_GROUP *group_intern(const EC_GROUP *group, int *owned);
+
+scratch_t *scratch_acquire(const ies_ctx_t *ctx);
+void scratch_release(scratch_t *scratch);
+
+fixed_base_t *fixed_base_new(const EC_GROUP *group, const EC_POINT *point, size_t budget, char *error);
+void fixed_base_free(fixed_base_t *fb);
+int fixed_base_mul(const EC_GROUP *group, const fixed_base_t *fb, EC_POINT *r, const BIGNUM *k, BN_CTX *bn_ctx);
+extern const curve_engine_t p256_engine;
+extern const curve_engine_t k256_engine;
+xladder_t *xladder_new(const EC_GROUP *group, const BIGNUM *order, const BIGNUM *d);
+void xladder_free(xladder_t *ladder);
+size_t xladder_memsize(const xladder_t *ladder);
+int xladder_shared_secret(const xladder_t *ladder, const unsigned char *octets, size_t length, unsigned char *x_out);
+#define X25519_KEY_LENGTH 32
+int x25519_sender_secret(const ies_ctx_t *ctx, scratch_t *scratch, unsigned char *key_octets, unsigned char *secret, char *error);
+int x25519_receiver_secret(const ies_ctx_t *ctx, scratch_t *scratch, const unsigned char *octets, size_t length, unsigned char *secret, char *error);
+int multi_aes_cbc_encrypt(const EVP_CIPHER *cipher, size_t count, const unsigned char *const *keys, const unsigned char *const *in, unsigned char *const *out, const size_t *lengths);
+int multi_sha_kdf(const EVP_MD *md, size_t count, const unsigned char *const *secrets, size_t secret_length, unsigned char *const *out, size_t out_length);
+int point_x_octets(const EC_GROUP *group, const EC_POINT *point, unsigned char *out, size_t length, BN_CTX *bn_ctx);
+
+kem_pool_t *kem_pool_new(const ies_ctx_t *ctx, size_t low_watermark, size_t high_watermark, char *error);
+void kem_pool_free(kem_pool_t *pool);
+int kem_pool_take(kem_pool_t *pool, unsigned char *key_octets, unsigned char *envelope_key);
+void kem_pool_stats(kem_pool_t *pool, kem_pool_stats_t *stats);
+size_t kem_pool_memsize(const kem_pool_t *pool);
+
+worker_pool_t *worker_pool_new(int threads, char *error);
+void worker_pool_free(worker_pool_t *pool);
+int worker_pool_threads(const worker_pool_t *pool);
+int worker_pool_run(worker_pool_t *pool, void (*func)(void *arg, long task), void *arg, long count, const volatile int *interrupted);
+void worker_pool_interrupt(worker_pool_t *pool);
 
-cryptogram_t * ecies_encrypt(const ies_ctx_t *ctx, const unsigned char *data, size_t length, char *error);
-unsigned char * ecies_decrypt(const ies_ctx_t *ctx, const cryptogram_t *cryptogram, size_t *length, char *error);
+int ecies_envelope_key_create(const ies_ctx_t *ctx, unsigned char *key_octets, unsigned char *envelope_key, char *error);
+int ecies_envelope_keys_create(const ies_ctx_t *ctx, size_t count, unsigned char *const *key_octets, unsigned char *envelope_keys, char *error);
+size_t ecies_body_length(const ies_ctx_t *ctx, size_t length);
+int ecies_encrypt(const ies_ctx_t *ctx, const unsigned char *data, size_t length, cryptogram_t *cryptogram, const volatile int *interrupted, char *error);
+int ecies_encrypt_multi(const ies_ctx_t *ctx, size_t count, const unsigned char *const *envelope_keys, const unsigned char *const *data, const size_t *lengths, cryptogram_t *const *cryptograms, char *error);
+int ecies_encrypt_with_key(const ies_ctx_t *ctx, const unsigned char *envelope_key, const unsigned char *data, size_t length, cryptogram_t *cryptogram, const volatile int *interrupted, char *error);
+int ecies_decrypt(const ies_ctx_t *ctx, const cryptogram_t *cryptogram, unsigned char *output, size_t *length, const volatile int *interrupted, char *error);
 
 #endif /* _IES_H_ */
@@ -0,0 +1,649 @@
+/**
+ * @file k256.c
+ *
+ * @brief ECDH on secp256k1 with the GLV endomorphism.
+ *
+ * OpenSSL has no code of its own for secp256k1: every build runs it on the
+ * generic Montgomery arithmetic of EC_GFp_mont_method.  Here it is done on
+ * 4 x 64-bit limbs, see fe64.h:
+ *
+ * - p = 2^256 - 0x1000003d1, so a product is reduced by folding its upper
+ *   half back in times 0x1000003d1, with no Montgomery form;
+ * - points are projective and added with the complete formulas of Renes,
+ *   Costello and Batina (2016) for a = 0;
+ * - the curve has an endomorphism lambda * (x, y) = (beta * x, y), so a
+ *   scalar k is split into k1 + k2 * lambda with k1 and k2 of 128 bits
+ *   (Gallant, Lambert and Vanstone), and k * P becomes k1 * P + k2 *
+ *   lambda * P: half the doublings, two 4-bit windows added per step;
+ * - k * G uses the same split over 32 rows of 15 affine multiples of
+ *   16^i * G, the entries for lambda * G being made from them by one
+ *   multiplication by beta.  That halves the table p256.c needs, for as
+ *   many additions.
+ *
+ * All table entries are read with a constant-time scan, and the split is
+ * done in constant time as well: nothing here branches on or indexes
+ * memory with a secret.  Scalars are 32 big-endian bytes, points cross
+ * the interface as octets.
+ *
+ * Needs a compiler with unsigned __int128; elsewhere k256_engine.setup()
+ * returns 0 and the IES context keeps using OpenSSL.
+ */
+
+#include "ies.h"
+
+#ifdef __SIZEOF_INT128__
+#define FE64_P { \
+    0xfffffffefffffc2fULL, 0xffffffffffffffffULL, 0xffffffffffffffffULL, 0xffffffffffffffffULL, \
+}
+
+#include "fe64.h"
+
+#define K256_ROWS 32
+#define K256_ROW_LENGTH 15
+/* 2^256 mod p */
+#define K256_FOLD 0x1000003d1ULL
+
+typedef uint64_t scalar_t[4];	/* little-endian limbs, mod 2^256 */
+
+static const fe_t fe_one = { 1, 0, 0, 0 };
+static const fe_t fe_seven = { 7, 0, 0, 0 };
+/* beta, a cube root of unity mod p: lambda * (x, y) = (beta * x, y) */
+static const fe_t fe_beta = {
+    0xc1396c28719501eeULL, 0x9cf0497512f58995ULL, 0x6e64479eac3434e9ULL, 0x7ae96a2b657c0710ULL,
+};
+static const fe_t curve_gx = {
+    0x59f2815b16f81798ULL, 0x029bfcdb2dce28d9ULL, 0x55a06295ce870b07ULL, 0x79be667ef9dcbbacULL,
+};
+static const fe_t curve_gy = {
+    0x9c47d08ffb10d4b8ULL, 0xfd17b448a6855419ULL, 0x5da4fbfc0e1108a8ULL, 0x483ada7726a3c465ULL,
+};
+
+/* The reduced basis (a1, b1), (a2, b2) of the lattice of (x, y) with x + y
+ * * lambda = 0 mod n, b2 = a1, and g1 = round(2^384 * b2 / n), g2 =
+ * round(2^384 * -b1 / n), as in libsecp256k1 */
+static const scalar_t glv_a1 = { 0xe86c90e49284eb15ULL, 0x3086d221a7d46bcdULL, 0, 0 };
+static const scalar_t glv_a2 = { 0x57c1108d9d44cfd8ULL, 0x14ca50f7a8e2f3f6ULL, 1, 0 };
+static const scalar_t glv_minus_b1 = { 0x6f547fa90abfe4c3ULL, 0xe4437ed6010e8828ULL, 0, 0 };
+static const scalar_t glv_g1 = {
+    0xe893209a45dbb031ULL, 0x3daa8a1471e8ca7fULL, 0xe86c90e49284eb15ULL, 0x3086d221a7d46bcdULL,
+};
+static const scalar_t glv_g2 = {
+    0x1571b4ae8ac47f71ULL, 0x221208ac9df506c6ULL, 0x6f547fa90abfe4c4ULL, 0xe4437ed6010e8828ULL,
+};
+
+/* Set up once by k256_setup() and read-only afterwards */
+static apoint_t (*base_table)[K256_ROW_LENGTH];
+
+/* r = t + t4 * 2^256 mod p for t4 < 2^35 */
+static inline void fe_fold(fe_t r, uint64_t t0, uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4)
+{
+    uint64_t c = 0;
+
+    MUL_ADD(t0, t4, K256_FOLD, c, t0);
+    t4 = 0;
+    t1 = add_carry(t1, c, &t4);
+    t2 = add_carry(t2, 0, &t4);
+    t3 = add_carry(t3, 0, &t4);
+    /* now below 2^256 + 2^68 < 2p */
+    fe_reduce_once(r, t0, t1, t2, t3, t4);
+}
+
+/* r = t mod p for the 512-bit t = t7..t0 */
+static inline void fe_reduce_wide(fe_t r, uint64_t t0, uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4, uint64_t t5, uint64_t t6, uint64_t t7)
+{
+    uint64_t c = 0;
+
+    MUL_ADD(t0, t4, K256_FOLD, c, t0);
+    MUL_ADD(t1, t5, K256_FOLD, c, t1);
+    MUL_ADD(t2, t6, K256_FOLD, c, t2);
+    MUL_ADD(t3, t7, K256_FOLD, c, t3);
+    fe_fold(r, t0, t1, t2, t3, c);
+}
+
+static void fe_mul(fe_t r, const fe_t a, const fe_t b)
+{
+    uint64_t t0, t1, t2, t3, t4, t5, t6, t7;
+
+    FE_MUL_WIDE(t0, t1, t2, t3, t4, t5, t6, t7, a, b);
+    fe_reduce_wide(r, t0, t1, t2, t3, t4, t5, t6, t7);
+}
+
+static void fe_sqr(fe_t r, const fe_t a)
+{
+    uint64_t t0, t1, t2, t3, t4, t5, t6, t7;
+
+    FE_SQR_WIDE(t0, t1, t2, t3, t4, t5, t6, t7, a);
+    fe_reduce_wide(r, t0, t1, t2, t3, t4, t5, t6, t7);
+}
+
+/* r = 3b * a = 21 * a, the constant of the formulas below */
+static void fe_mul_b3(fe_t r, const fe_t a)
+{
+    uint64_t t0, t1, t2, t3, c = 0;
+
+    MUL_ADD(t0, a[0], 21, c, 0);
+    MUL_ADD(t1, a[1], 21, c, 0);
+    MUL_ADD(t2, a[2], 21, c, 0);
+    MUL_ADD(t3, a[3], 21, c, 0);
+    fe_fold(r, t0, t1, t2, t3, c);
+}
+
+/* r = a^(2^n) */
+static void fe_sqr_n(fe_t r, const fe_t a, int n)
+{
+    fe_sqr(r, a);
+    while (--n > 0)
+	fe_sqr(r, r);
+}
+
+/* a^(2^223 - 1) * 2^23 * a^(2^22 - 1), the head that p - 2 and (p + 1) / 4
+ * share, and a^3 */
+static void fe_pow_head(fe_t r, fe_t x2, const fe_t a)
+{
+    fe_t x3, x6, x9, x11, x22, x44, x88, x176, x220, t;
+
+    fe_sqr(t, a);
+    fe_mul(x2, t, a);
+    fe_sqr(t, x2);
+    fe_mul(x3, t, a);
+    fe_sqr_n(t, x3, 3);
+    fe_mul(x6, t, x3);
+    fe_sqr_n(t, x6, 3);
+    fe_mul(x9, t, x3);
+    fe_sqr_n(t, x9, 2);
+    fe_mul(x11, t, x2);
+    fe_sqr_n(t, x11, 11);
+    fe_mul(x22, t, x11);
+    fe_sqr_n(t, x22, 22);
+    fe_mul(x44, t, x22);
+    fe_sqr_n(t, x44, 44);
+    fe_mul(x88, t, x44);
+    fe_sqr_n(t, x88, 88);
+    fe_mul(x176, t, x88);
+    fe_sqr_n(t, x176, 44);
+    fe_mul(x220, t, x44);
+    fe_sqr_n(t, x220, 3);
+    fe_mul(t, t, x3);		/* x223 */
+    fe_sqr_n(t, t, 23);
+    fe_mul(r, t, x22);
+}
+
+/* a^(p - 2), the inverse of a non-zero a */
+static void fe_inv(fe_t r, const fe_t a)
+{
+    fe_t x2, t;
+
+    fe_pow_head(t, x2, a);
+    fe_sqr_n(t, t, 5);
+    fe_mul(t, t, a);
+    fe_sqr_n(t, t, 3);
+    fe_mul(t, t, x2);
+    fe_sqr_n(t, t, 2);
+    fe_mul(r, t, a);
+}
+
+/* a^((p + 1) / 4), a square root of a if there is one, as p = 3 mod 4 */
+static void fe_sqrt(fe_t r, const fe_t a)
+{
+    fe_t x2, t;
+
+    fe_pow_head(t, x2, a);
+    fe_sqr_n(t, t, 6);
+    fe_mul(t, t, x2);
+    fe_sqr_n(r, t, 2);
+}
+
+/* x^3 + 7 */
+static void curve_rhs(fe_t r, const fe_t x)
+{
+    fe_t t;
+
+    fe_sqr(t, x);
+    fe_mul(t, t, x);
+    fe_add(r, t, fe_seven);
+}
+
+static void point_set_infinity(jpoint_t *r)
+{
+    memset(r, 0, sizeof(*r));
+    fe_copy(r->y, fe_one);
+}
+
+/* r = a + b, Algorithm 7 of Renes-Costello-Batina: complete, so a and b may
+ * be equal or infinity.  r may alias either. */
+static void point_add(jpoint_t *r, const jpoint_t *a, const jpoint_t *b)
+{
+    fe_t t0, t1, t2, t3, t4, x3, y3, z3;
+
+    fe_mul(t0, a->x, b->x);
+    fe_mul(t1, a->y, b->y);
+    fe_mul(t2, a->z, b->z);
+    fe_add(t3, a->x, a->y);
+    fe_add(t4, b->x, b->y);
+    fe_mul(t3, t3, t4);
+    fe_add(t4, t0, t1);
+    fe_sub(t3, t3, t4);
+    fe_add(t4, a->y, a->z);
+    fe_add(x3, b->y, b->z);
+    fe_mul(t4, t4, x3);
+    fe_add(x3, t1, t2);
+    fe_sub(t4, t4, x3);
+    fe_add(x3, a->x, a->z);
+    fe_add(y3, b->x, b->z);
+    fe_mul(x3, x3, y3);
+    fe_add(y3, t0, t2);
+    fe_sub(y3, x3, y3);
+    fe_add(x3, t0, t0);
+    fe_add(t0, x3, t0);
+    fe_mul_b3(t2, t2);
+    fe_add(z3, t1, t2);
+    fe_sub(t1, t1, t2);
+    fe_mul_b3(y3, y3);
+    fe_mul(x3, t4, y3);
+    fe_mul(t2, t3, t1);
+    fe_sub(x3, t2, x3);
+    fe_mul(y3, y3, t0);
+    fe_mul(t1, t1, z3);
+    fe_add(y3, t1, y3);
+    fe_mul(t0, t0, t3);
+    fe_mul(z3, z3, t4);
+    fe_add(z3, z3, t0);
+
+    fe_copy(r->x, x3);
+    fe_copy(r->y, y3);
+    fe_copy(r->z, z3);
+}
+
+/* r = a + b for an affine b other than infinity, Algorithm 8 */
+static void point_add_affine(jpoint_t *r, const jpoint_t *a, const apoint_t *b)
+{
+    fe_t t0, t1, t2, t3, t4, x3, y3, z3;
+
+    fe_mul(t0, a->x, b->x);
+    fe_mul(t1, a->y, b->y);
+    fe_add(t3, b->x, b->y);
+    fe_add(t4, a->x, a->y);
+    fe_mul(t3, t3, t4);
+    fe_add(t4, t0, t1);
+    fe_sub(t3, t3, t4);
+    fe_mul(t4, b->y, a->z);
+    fe_add(t4, t4, a->y);
+    fe_mul(y3, b->x, a->z);
+    fe_add(y3, y3, a->x);
+    fe_add(x3, t0, t0);
+    fe_add(t0, x3, t0);
+    fe_mul_b3(t2, a->z);
+    fe_add(z3, t1, t2);
+    fe_sub(t1, t1, t2);
+    fe_mul_b3(y3, y3);
+    fe_mul(x3, t4, y3);
+    fe_mul(t2, t3, t1);
+    fe_sub(x3, t2, x3);
+    fe_mul(y3, y3, t0);
+    fe_mul(t1, t1, z3);
+    fe_add(y3, t1, y3);
+    fe_mul(t0, t0, t3);
+    fe_mul(z3, z3, t4);
+    fe_add(z3, z3, t0);
+
+    fe_copy(r->x, x3);
+    fe_copy(r->y, y3);
+    fe_copy(r->z, z3);
+}
+
+/* r = 2 * a, Algorithm 9 */
+static void point_double(jpoint_t *r, const jpoint_t *a)
+{
+    fe_t t0, t1, t2, x3, y3, z3;
+
+    fe_sqr(t0, a->y);
+    fe_add(z3, t0, t0);
+    fe_add(z3, z3, z3);
+    fe_add(z3, z3, z3);
+    fe_mul(t1, a->y, a->z);
+    fe_sqr(t2, a->z);
+    fe_mul_b3(t2, t2);
+    fe_mul(x3, t2, z3);
+    fe_add(y3, t0, t2);
+    fe_mul(z3, t1, z3);
+    fe_add(t1, t2, t2);
+    fe_add(t2, t1, t2);
+    fe_sub(t0, t0, t2);
+    fe_mul(y3, t0, y3);
+    fe_add(y3, x3, y3);
+    fe_mul(t1, a->x, a->y);
+    fe_mul(x3, t0, t1);
+    fe_add(x3, x3, x3);
+
+    fe_copy(r->x, x3);
+    fe_copy(r->y, y3);
+    fe_copy(r->z, z3);
+}
+
+/* Affine coordinates of a.  Returns 0 for the point at infinity. */
+static int point_to_affine(apoint_t *r, const jpoint_t *a)
+{
+    fe_t zinv;
+
+    if (fe_is_zero(a->z))
+	return 0;
+    fe_inv(zinv, a->z);
+    fe_mul(r->x, a->x, zinv);
+    fe_mul(r->y, a->y, zinv);
+    OPENSSL_cleanse(zinv, sizeof(zinv));
+    return 1;
+}
+
+/* r = a * b mod 2^256 */
+static void scalar_mul_low(scalar_t r, const scalar_t a, const scalar_t b)
+{
+    uint64_t t[8];
+
+    FE_MUL_WIDE(t[0], t[1], t[2], t[3], t[4], t[5], t[6], t[7], a, b);
+    memcpy(r, t, sizeof(scalar_t));
+}
+
+/* r = round(k * g / 2^384), below 2^128 for the g above */
+static void scalar_mul_shift_384(scalar_t r, const scalar_t k, const scalar_t g)
+{
+    uint64_t t[8], carry = 0;
+
+    FE_MUL_WIDE(t[0], t[1], t[2], t[3], t[4], t[5], t[6], t[7], k, g);
+    r[0] = add_carry(t[6], t[5] >> 63, &carry);
+    r[1] = t[7] + carry;
+    r[2] = r[3] = 0;
+}
+
+static void scalar_sub(scalar_t r, const scalar_t a, const scalar_t b)
+{
+    uint64_t borrow = 0;
+    int i;
+
+    for (i = 0; i < 4; i++)
+	r[i] = sub_borrow(a[i], b[i], &borrow);
+}
+
+/* |r| of r as a two's complement number, and all ones in *sign if r was
+ * negative */
+static void scalar_abs(scalar_t r, uint64_t *sign)
+{
+    uint64_t carry;
+    int i;
+
+    *sign = (uint64_t)0 - (r[3] >> 63);
+    carry = *sign & 1;
+    for (i = 0; i < 4; i++)
+	r[i] = add_carry(r[i] ^ *sign, 0, &carry);
+}
+
+/* k = k1 + k2 * lambda mod n with |k1|, |k2| < 2^128 (libsecp256k1 shows
+ * the bound holds for every k < n).  With c1 and c2 the rounded
+ * coordinates of k in the lattice basis, k1 = k - c1 * a1 - c2 * a2 and k2 =
+ * -c1 * b1 - c2 * b2 hold over the integers, so they are made mod 2^256 and
+ * read as signed. */
+static void scalar_split(const unsigned char *k, scalar_t k1, uint64_t *sign1, scalar_t k2, uint64_t *sign2)
+{
+    scalar_t s, c1, c2, t;
+    int i, j;
+
+    for (i = 0; i < 4; i++) {
+	s[i] = 0;
+	for (j = 0; j < 8; j++)
+	    s[i] = (s[i] << 8) | k[8 * (3 - i) + j];
+    }
+    scalar_mul_shift_384(c1, s, glv_g1);
+    scalar_mul_shift_384(c2, s, glv_g2);
+
+    scalar_mul_low(t, c1, glv_a1);
+    scalar_sub(k1, s, t);
+    scalar_mul_low(t, c2, glv_a2);
+    scalar_sub(k1, k1, t);
+    scalar_abs(k1, sign1);
+
+    scalar_mul_low(k2, c1, glv_minus_b1);
+    scalar_mul_low(t, c2, glv_a1);	/* b2 = a1 */
+    scalar_sub(k2, k2, t);
+    scalar_abs(k2, sign2);
+
+    OPENSSL_cleanse(s, sizeof(s));
+    OPENSSL_cleanse(c1, sizeof(c1));
+    OPENSSL_cleanse(c2, sizeof(c2));
+    OPENSSL_cleanse(t, sizeof(t));
+}
+
+/* Digit i of a 128-bit half scalar in 4-bit windows, 0 the lowest */
+static uint64_t half_digit(const scalar_t k, int i)
+{
+    return (k[i / 16] >> (4 * (i % 16))) & 0xf;
+}
+
+/* Adds entry digit of a row of the generator table to r, times lambda if
+ * endo is set, negated if sign is all ones */
+static void base_row_add(jpoint_t *r, const apoint_t *row, uint64_t digit, int endo, uint64_t sign)
+{
+    apoint_t entry;
+    jpoint_t sum;
+    uint64_t mask;
+    int j;
+
+    memset(&entry, 0, sizeof(entry));
+    for (j = 0; j < K256_ROW_LENGTH; j++) {
+	mask = eq_mask(digit, (uint64_t)j + 1);
+	fe_cmov(entry.x, row[j].x, mask);
+	fe_cmov(entry.y, row[j].y, mask);
+    }
+    if (endo)
+	fe_mul(entry.x, entry.x, fe_beta);
+    fe_cneg(entry.y, entry.y, sign);
+
+    /* a zero digit adds nothing, the sum is made and then dropped */
+    point_add_affine(&sum, r, &entry);
+    mask = ~eq_mask(digit, 0);
+    fe_cmov(r->x, sum.x, mask);
+    fe_cmov(r->y, sum.y, mask);
+    fe_cmov(r->z, sum.z, mask);
+    OPENSSL_cleanse(&entry, sizeof(entry));
+    OPENSSL_cleanse(&sum, sizeof(sum));
+}
+
+/* k * G = k1 * G + k2 * lambda * G, one entry for each from every row */
+static void base_mul(jpoint_t *r, const unsigned char *k)
+{
+    scalar_t k1, k2;
+    uint64_t sign1, sign2;
+    int i;
+
+    scalar_split(k, k1, &sign1, k2, &sign2);
+    point_set_infinity(r);
+    for (i = 0; i < K256_ROWS; i++) {
+	base_row_add(r, base_table[i], half_digit(k1, i), 0, sign1);
+	base_row_add(r, base_table[i], half_digit(k2, i), 1, sign2);
+    }
+    OPENSSL_cleanse(k1, sizeof(k1));
+    OPENSSL_cleanse(k2, sizeof(k2));
+}
+
+/* Entry digit of a table of 0..15 * P */
+static void table_select(jpoint_t *r, const jpoint_t *table, uint64_t digit)
+{
+    uint64_t mask;
+    int j;
+
+    memset(r, 0, sizeof(*r));
+    for (j = 0; j < 16; j++) {
+	mask = eq_mask(digit, (uint64_t)j);
+	fe_cmov(r->x, table[j].x, mask);
+	fe_cmov(r->y, table[j].y, mask);
+	fe_cmov(r->z, table[j].z, mask);
+    }
+}
+
+/* k * p = k1 * p + k2 * lambda * p: 32 windows of four doublings and two
+ * additions, one from 0..15 * p and one from 0..15 * lambda * p */
+static void point_mul(jpoint_t *r, const apoint_t *p, const unsigned char *k)
+{
+    jpoint_t table[16], endo_table[16], entry;
+    apoint_t base;
+    scalar_t k1, k2;
+    uint64_t sign1, sign2;
+    int i, j;
+
+    scalar_split(k, k1, &sign1, k2, &sign2);
+
+    /* the multiples of sign1 * p, and from them those of sign2 * lambda * p */
+    fe_copy(base.x, p->x);
+    fe_cneg(base.y, p->y, sign1);
+    point_set_infinity(&table[0]);
+    fe_copy(table[1].x, base.x);
+    fe_copy(table[1].y, base.y);
+    fe_copy(table[1].z, fe_one);
+    for (i = 2; i < 16; i++) {
+	if (i & 1)
+	    point_add_affine(&table[i], &table[i - 1], &base);
+	else
+	    point_double(&table[i], &table[i / 2]);
+    }
+    for (i = 0; i < 16; i++) {
+	fe_mul(endo_table[i].x, table[i].x, fe_beta);
+	fe_cneg(endo_table[i].y, table[i].y, sign1 ^ sign2);
+	fe_copy(endo_table[i].z, table[i].z);
+    }
+
+    point_set_infinity(r);
+    for (i = 128 / 4 - 1; i >= 0; i--) {
+	for (j = 0; j < 4; j++)
+	    point_double(r, r);
+	table_select(&entry, table, half_digit(k1, i));
+	point_add(r, r, &entry);
+	table_select(&entry, endo_table, half_digit(k2, i));
+	point_add(r, r, &entry);
+    }
+    OPENSSL_cleanse(table, sizeof(table));
+    OPENSSL_cleanse(endo_table, sizeof(endo_table));
+    OPENSSL_cleanse(&entry, sizeof(entry));
+    OPENSSL_cleanse(&base, sizeof(base));
+    OPENSSL_cleanse(k1, sizeof(k1));
+    OPENSSL_cleanse(k2, sizeof(k2));
+}
+
+/* Builds the table of the generator on first use.  Like group_intern(),
+ * must be called with the GVL held; the table is never freed. */
+static int k256_setup(void)
+{
+    apoint_t (*table)[K256_ROW_LENGTH];
+    jpoint_t base, multiple;
+    int i, j;
+
+    if (base_table)
+	return 1;
+
+    if (!(table = OPENSSL_malloc(K256_ROWS * sizeof(*table))))
+	return 0;
+
+    fe_copy(base.x, curve_gx);
+    fe_copy(base.y, curve_gy);
+    fe_copy(base.z, fe_one);
+
+    /* row i holds j * 16^i * G for j = 1..15 */
+    for (i = 0; i < K256_ROWS; i++) {
+	multiple = base;
+	for (j = 0; j < K256_ROW_LENGTH; j++) {
+	    if (j > 0)
+		point_add(&multiple, &multiple, &base);
+	    point_to_affine(&table[i][j], &multiple);
+	}
+	point_add(&base, &multiple, &base);
+    }
+
+    base_table = table;
+    return 1;
+}
+
+/* Decodes a compressed or uncompressed point, checking that it is on the
+ * curve.  The curve has prime order, so any such point other than infinity
+ * (which has no encoding here) generates the whole group. */
+static int k256_point_decode(curve_point_t *point, const unsigned char *octets, size_t length)
+{
+    apoint_t a;
+    fe_t rhs, y2;
+
+    if (length == 1 + 32 && (octets[0] == POINT_CONVERSION_COMPRESSED || octets[0] == (POINT_CONVERSION_COMPRESSED | 1))) {
+	if (!fe_limbs_from_bytes(a.x, octets + 1))
+	    return 0;
+	curve_rhs(rhs, a.x);
+	fe_sqrt(a.y, rhs);
+	fe_sqr(y2, a.y);
+	fe_sub(y2, y2, rhs);
+	if (!fe_is_zero(y2))
+	    return 0;
+	fe_cneg(a.y, a.y, (uint64_t)0 - ((a.y[0] ^ octets[0]) & 1));
+    } else if (length == 1 + 2 * 32 && octets[0] == POINT_CONVERSION_UNCOMPRESSED) {
+	if (!fe_limbs_from_bytes(a.x, octets + 1) || !fe_limbs_from_bytes(a.y, octets + 1 + 32))
+	    return 0;
+	curve_rhs(rhs, a.x);
+	fe_sqr(y2, a.y);
+	fe_sub(y2, y2, rhs);
+	if (!fe_is_zero(y2))
+	    return 0;
+    } else {
+	return 0;
+    }
+
+    memcpy(point->x, a.x, sizeof(a.x));
+    memcpy(point->y, a.y, sizeof(a.y));
+    return 1;
+}
+
+/* R = k * G for the scalar k, 0 < k < n, written compressed to 33 bytes */
+static int k256_public_key(const unsigned char *k, unsigned char *compressed)
+{
+    jpoint_t r;
+    apoint_t a;
+    int ok;
+
+    base_mul(&r, k);
+    if ((ok = point_to_affine(&a, &r))) {
+	compressed[0] = POINT_CONVERSION_COMPRESSED | (unsigned char)(a.y[0] & 1);
+	fe_limbs_to_bytes(compressed + 1, a.x);
+    }
+    OPENSSL_cleanse(&r, sizeof(r));
+    OPENSSL_cleanse(&a, sizeof(a));
+    return ok;
+}
+
+/* The x coordinate of k * point, 32 bytes, as ECDH_compute_key gives it */
+static int k256_shared_secret(const curve_point_t *point, const unsigned char *k, unsigned char *x_out)
+{
+    apoint_t p;
+    jpoint_t r;
+    fe_t zinv;
+    int ok = 0;
+
+    memcpy(p.x, point->x, sizeof(p.x));
+    memcpy(p.y, point->y, sizeof(p.y));
+    point_mul(&r, &p, k);
+    if (!fe_is_zero(r.z)) {
+	fe_inv(zinv, r.z);
+	fe_mul(r.x, r.x, zinv);
+	fe_limbs_to_bytes(x_out, r.x);
+	ok = 1;
+    }
+    OPENSSL_cleanse(&r, sizeof(r));
+    OPENSSL_cleanse(zinv, sizeof(zinv));
+    return ok;
+}
+
+const curve_engine_t k256_engine = {
+    k256_setup, k256_point_decode, k256_public_key, k256_shared_secret,
+};
+
+#else /* no 128-bit integers */
+
+static int k256_setup(void)
+{
+    return 0;
+}
+
+const curve_engine_t k256_engine = { k256_setup, NULL, NULL, NULL };
+
+#endif
@@ -0,0 +1,332 @@
+/**
+ * @file kem_pool.c
+ *
+ * @brief Background pool of precomputed KEM results for one recipient.
+ *
+ * For a fixed recipient the KEM half of encryption (ephemeral key, ECDH,
+ * KDF and point encoding) does not depend on the message.  A native thread
+ * computes (ephemeral point octets, envelope key) tuples in advance and puts
+ * them into a bounded ring, so that public_encrypt only has to run the
+ * symmetric cipher and the MAC.
+ *
+ * The ring is the bounded MPMC queue by Dmitry Vyukov: every slot carries a
+ * sequence number telling whether it is ready to be written or read, so
+ * encrypting threads take tuples without a lock.  The producer refills the
+ * ring up to the high watermark, sleeps, and is woken by the consumer that
+ * brings the depth down to the low watermark.
+ *
+ * A tuple is handed out once and wiped from its slot right away.  Since a
+ * forked child would share the parent's tuples, the pool only serves the
+ * process that created it.
+ */
+
+#include "ies.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ATOMIC_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define ATOMIC_INC(ptr) __atomic_add_fetch((ptr), 1, __ATOMIC_RELAXED)
+#define ATOMIC_CAS(ptr, expected, desired) \
+    __atomic_compare_exchange_n((ptr), (expected), (desired), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
+
+/* How long the producer waits before retrying after a failure, and the
+ * longest it sleeps without looking at the depth again. */
+#define KEM_POOL_NAP_MSEC 100
+
+struct kem_pool_st {
+    const ies_ctx_t *ctx;
+    size_t capacity;		/* power of two */
+    size_t low_watermark;
+    size_t high_watermark;
+    size_t slot_length;		/* point octets followed by envelope key */
+    unsigned char *slots;
+    size_t *sequence;
+
+    size_t enqueue_pos;
+    size_t dequeue_pos;
+
+    size_t produced;
+    size_t consumed;
+    size_t misses;
+    unsigned long long busy_nsec;	/* time spent producing */
+
+    pid_t pid;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    int sleeping;
+    int stop;
+};
+
+static unsigned long long monotonic_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t pool_depth(kem_pool_t *pool)
+{
+    return ATOMIC_LOAD(&pool->enqueue_pos) - ATOMIC_LOAD(&pool->dequeue_pos);
+}
+
+/* Waits on the condition for at most KEM_POOL_NAP_MSEC; lock must be held. */
+static void pool_nap(kem_pool_t *pool)
+{
+    struct timeval now;
+    struct timespec until;
+
+    gettimeofday(&now, NULL);
+    until.tv_sec = now.tv_sec;
+    until.tv_nsec = now.tv_usec * 1000L + KEM_POOL_NAP_MSEC * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+	until.tv_sec += until.tv_nsec / 1000000000L;
+	until.tv_nsec %= 1000000000L;
+    }
+    pthread_cond_timedwait(&pool->wakeup, &pool->lock, &until);
+}
+
+/* Only the producer thread enqueues, so no CAS is needed on enqueue_pos */
+static int pool_put(kem_pool_t *pool, const unsigned char *tuple)
+{
+    size_t pos = pool->enqueue_pos;
+    size_t index = pos & (pool->capacity - 1);
+
+    if (ATOMIC_LOAD(&pool->sequence[index]) != pos)
+	return 0;
+
+    memcpy(pool->slots + index * pool->slot_length, tuple, pool->slot_length);
+    ATOMIC_STORE(&pool->sequence[index], pos + 1);
+    ATOMIC_STORE(&pool->enqueue_pos, pos + 1);
+    return 1;
+}
+
+static void *pool_producer(void *ptr)
+{
+    kem_pool_t *pool = ptr;
+    const ies_ctx_t *ctx = pool->ctx;
+    unsigned char *tuple;
+    char error[1024];
+
+    if (!(tuple = OPENSSL_malloc(pool->slot_length)))
+	return NULL;
+
+    for (;;) {
+	unsigned long long started;
+	int ok;
+
+	pthread_mutex_lock(&pool->lock);
+	if (!pool->stop && pool_depth(pool) >= pool->high_watermark) {
+	    pool->sleeping = 1;
+	    while (!pool->stop && pool_depth(pool) > pool->low_watermark)
+		pool_nap(pool);
+	    pool->sleeping = 0;
+	}
+	if (pool->stop) {
+	    pthread_mutex_unlock(&pool->lock);
+	    break;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	started = monotonic_nsec();
+	ok = ecies_envelope_key_create(ctx, tuple, tuple + ctx->stored_key_length, error)
+	    && pool_put(pool, tuple);
+	OPENSSL_cleanse(tuple, pool->slot_length);
+
+	if (!ok) {
+	    /* Encryption falls back to computing the KEM itself meanwhile */
+	    pthread_mutex_lock(&pool->lock);
+	    if (!pool->stop)
+		pool_nap(pool);
+	    pthread_mutex_unlock(&pool->lock);
+	    continue;
+	}
+
+	__atomic_add_fetch(&pool->busy_nsec, monotonic_nsec() - started, __ATOMIC_RELAXED);
+	ATOMIC_INC(&pool->produced);
+    }
+
+    OPENSSL_free(tuple);
+    return NULL;
+}
+
+kem_pool_t *kem_pool_new(const ies_ctx_t *ctx, size_t low_watermark, size_t high_watermark, char *error)
+{
+    kem_pool_t *pool;
+    sigset_t all, saved;
+    size_t i;
+    int started;
+
+    if (high_watermark == 0 || low_watermark >= high_watermark) {
+	SET_ERROR("Watermarks must satisfy 0 <= low < high");
+	return NULL;
+    }
+
+    if (!(pool = OPENSSL_malloc(sizeof(kem_pool_t)))) {
+	SET_ERROR("Failed to allocate memory for KEM pool");
+	return NULL;
+    }
+    memset(pool, 0, sizeof(kem_pool_t));
+    pool->ctx = ctx;
+    pool->low_watermark = low_watermark;
+    pool->high_watermark = high_watermark;
+    pool->slot_length = ctx->stored_key_length + ctx->envelope_key_length;
+    for (pool->capacity = 1; pool->capacity < high_watermark; pool->capacity <<= 1)
+	;
+    pool->pid = getpid();
+
+    pool->slots = OPENSSL_malloc(pool->capacity * pool->slot_length);
+    pool->sequence = OPENSSL_malloc(pool->capacity * sizeof(size_t));
+    if (!pool->slots || !pool->sequence) {
+	SET_ERROR("Failed to allocate memory for KEM pool");
+	goto err;
+    }
+    for (i = 0; i < pool->capacity; i++)
+	pool->sequence[i] = i;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wakeup, NULL);
+
+    /* Signals are for the Ruby threads, keep them off the producer */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    started = pthread_create(&pool->thread, NULL, pool_producer, pool) == 0;
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    if (!started) {
+	SET_ERROR("Failed to start KEM pool thread");
+	pthread_cond_destroy(&pool->wakeup);
+	pthread_mutex_destroy(&pool->lock);
+	goto err;
+    }
+
+    return pool;
+
+  err:
+    if (pool->slots)
+	OPENSSL_free(pool->slots);
+    if (pool->sequence)
+	OPENSSL_free(pool->sequence);
+    OPENSSL_free(pool);
+    return NULL;
+}
+
+void kem_pool_free(kem_pool_t *pool)
+{
+    if (!pool)
+	return;
+
+    if (pool->pid == getpid()) {
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_signal(&pool->wakeup);
+	pthread_mutex_unlock(&pool->lock);
+	pthread_join(pool->thread, NULL);
+    }
+    pthread_cond_destroy(&pool->wakeup);
+    pthread_mutex_destroy(&pool->lock);
+
+    OPENSSL_cleanse(pool->slots, pool->capacity * pool->slot_length);
+    OPENSSL_free(pool->slots);
+    OPENSSL_free(pool->sequence);
+    OPENSSL_free(pool);
+}
+
+/* Copies one tuple out of the pool and wipes its slot.  Returns 0, and
+ * counts a miss, when the pool is empty. */
+int kem_pool_take(kem_pool_t *pool, unsigned char *key_octets, unsigned char *envelope_key)
+{
+    const size_t key_length = pool->ctx->stored_key_length;
+    size_t pos, index, seq;
+    unsigned char *slot;
+
+    if (pool->pid != getpid()) {
+	ATOMIC_INC(&pool->misses);
+	return 0;
+    }
+
+    pos = __atomic_load_n(&pool->dequeue_pos, __ATOMIC_RELAXED);
+    for (;;) {
+	index = pos & (pool->capacity - 1);
+	seq = ATOMIC_LOAD(&pool->sequence[index]);
+	if (seq == pos + 1) {
+	    if (ATOMIC_CAS(&pool->dequeue_pos, &pos, pos + 1))
+		break;
+	} else if ((ptrdiff_t)(seq - (pos + 1)) < 0) {
+	    ATOMIC_INC(&pool->misses);
+	    return 0;
+	} else {
+	    pos = __atomic_load_n(&pool->dequeue_pos, __ATOMIC_RELAXED);
+	}
+    }
+
+    slot = pool->slots + index * pool->slot_length;
+    memcpy(key_octets, slot, key_length);
+    memcpy(envelope_key, slot + key_length, pool->slot_length - key_length);
+    OPENSSL_cleanse(slot, pool->slot_length);
+    ATOMIC_STORE(&pool->sequence[index], pos + pool->capacity);
+    ATOMIC_INC(&pool->consumed);
+
+    if (ATOMIC_LOAD(&pool->sleeping) && pool_depth(pool) <= pool->low_watermark) {
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_signal(&pool->wakeup);
+	pthread_mutex_unlock(&pool->lock);
+    }
+
+    return 1;
+}
+
+void kem_pool_stats(kem_pool_t *pool, kem_pool_stats_t *stats)
+{
+    unsigned long long busy_nsec = __atomic_load_n(&pool->busy_nsec, __ATOMIC_RELAXED);
+
+    stats->depth = pool_depth(pool);
+    stats->capacity = pool->capacity;
+    stats->low_watermark = pool->low_watermark;
+    stats->high_watermark = pool->high_watermark;
+    stats->produced = ATOMIC_LOAD(&pool->produced);
+    stats->consumed = ATOMIC_LOAD(&pool->consumed);
+    stats->misses = ATOMIC_LOAD(&pool->misses);
+    stats->refill_rate = busy_nsec ? stats->produced * 1e9 / busy_nsec : 0.0;
+}
+
+size_t kem_pool_memsize(const kem_pool_t *pool)
+{
+    return sizeof(kem_pool_t) + pool->capacity * (pool->slot_length + sizeof(size_t));
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+kem_pool_t *kem_pool_new(const ies_ctx_t *ctx, size_t low_watermark, size_t high_watermark, char *error)
+{
+    SET_ERROR("KEM pool needs pthreads");
+    return NULL;
+}
+
+void kem_pool_free(kem_pool_t *pool)
+{
+}
+
+int kem_pool_take(kem_pool_t *pool, unsigned char *key_octets, unsigned char *envelope_key)
+{
+    return 0;
+}
+
+void kem_pool_stats(kem_pool_t *pool, kem_pool_stats_t *stats)
+{
+    memset(stats, 0, sizeof(kem_pool_stats_t));
+}
+
+size_t kem_pool_memsize(const kem_pool_t *pool)
+{
+    return 0;
+}
+
+#endif /* HAVE_PTHREAD_H */
@@ -0,0 +1,234 @@
+/**
+ * @file multi_aes.c
+ *
+ * @brief AES-CBC encryption of several independent messages at once.
+ *
+ * Each block of a CBC stream is chained to the previous one, so a single
+ * stream keeps only one AESENC in flight while the unit could run several:
+ * OpenSSL's aesni_cbc_encrypt gets a fraction of the throughput of its
+ * parallel CTR or CBC decryption.  Messages of a batch have keys and
+ * streams of their own, so here the rounds of up to eight of them are
+ * interleaved, the way aesni_multi_cbc_encrypt does for TLS records.
+ *
+ * The messages are encrypted with a zero IV and PKCS#7 padding, exactly as
+ * store_cipher_body() does for the CBC suites.  The AES-NI code is only
+ * run on CPUs that have it; elsewhere multi_aes_cbc_encrypt() returns 0 and
+ * the caller encrypts one message at a time with EVP.
+ */
+
+#include "ies.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <emmintrin.h>
+#include <wmmintrin.h>
+
+#define MULTI_AES_LANES 8
+#define MULTI_AES_MAX_ROUNDS 14
+
+typedef struct {
+    __m128i rk[MULTI_AES_MAX_ROUNDS + 1];
+    int rounds;
+} lane_key_t;
+
+#define AES_128_STEP(rk, i, rcon) \
+    ((rk)[i] = expand_128_step((rk)[(i) - 1], _mm_aeskeygenassist_si128((rk)[(i) - 1], (rcon))))
+
+__attribute__((target("aes")))
+static __m128i expand_128_step(__m128i key, __m128i assist)
+{
+    assist = _mm_shuffle_epi32(assist, 0xff);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+__attribute__((target("aes")))
+static void expand_128(const unsigned char *key, __m128i *rk)
+{
+    rk[0] = _mm_loadu_si128((const __m128i *)key);
+    AES_128_STEP(rk, 1, 0x01);
+    AES_128_STEP(rk, 2, 0x02);
+    AES_128_STEP(rk, 3, 0x04);
+    AES_128_STEP(rk, 4, 0x08);
+    AES_128_STEP(rk, 5, 0x10);
+    AES_128_STEP(rk, 6, 0x20);
+    AES_128_STEP(rk, 7, 0x40);
+    AES_128_STEP(rk, 8, 0x80);
+    AES_128_STEP(rk, 9, 0x1b);
+    AES_128_STEP(rk, 10, 0x36);
+}
+
+/* Even round keys of AES-256 come from the previous even one and the
+ * RotWord/SubWord of the odd one, odd keys from SubWord alone */
+#define AES_256_EVEN(rk, i, rcon) \
+    ((rk)[i] = expand_128_step((rk)[(i) - 2], _mm_aeskeygenassist_si128((rk)[(i) - 1], (rcon))))
+#define AES_256_ODD(rk, i) \
+    ((rk)[i] = expand_256_odd((rk)[(i) - 2], _mm_aeskeygenassist_si128((rk)[(i) - 1], 0)))
+#define AES_256_STEP(rk, i, rcon) (AES_256_EVEN(rk, i, rcon), AES_256_ODD(rk, (i) + 1))
+
+__attribute__((target("aes")))
+static __m128i expand_256_odd(__m128i key, __m128i assist)
+{
+    assist = _mm_shuffle_epi32(assist, 0xaa);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+__attribute__((target("aes")))
+static void expand_256(const unsigned char *key, __m128i *rk)
+{
+    rk[0] = _mm_loadu_si128((const __m128i *)key);
+    rk[1] = _mm_loadu_si128((const __m128i *)(key + 16));
+    AES_256_STEP(rk, 2, 0x01);
+    AES_256_STEP(rk, 4, 0x02);
+    AES_256_STEP(rk, 6, 0x04);
+    AES_256_STEP(rk, 8, 0x08);
+    AES_256_STEP(rk, 10, 0x10);
+    AES_256_STEP(rk, 12, 0x20);
+    AES_256_EVEN(rk, 14, 0x40);
+}
+
+/* Block j of a message of length bytes, the last one padded */
+static const unsigned char *lane_block(const unsigned char *in, size_t length, size_t j, unsigned char *pad)
+{
+    size_t full = length / 16, rest = length % 16;
+
+    if (j < full)
+	return in + 16 * j;
+    memcpy(pad, in + 16 * full, rest);
+    memset(pad + rest, (int)(16 - rest), 16 - rest);
+    return pad;
+}
+
+#define EACH_LANE(X) X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7)
+
+/* Blocks [0, blocks) of eight lanes that all have that many whole blocks.
+ * The state stays in registers, so the rounds of the lanes interleave. */
+__attribute__((target("aes")))
+static void encrypt_eight(const lane_key_t *keys, const unsigned char *const *in, unsigned char *const *out, __m128i *state, size_t blocks)
+{
+#define LOAD_STATE(l) __m128i s##l = state[l];
+#define XOR_BLOCK(l) s##l = _mm_xor_si128(_mm_xor_si128(s##l, _mm_loadu_si128((const __m128i *)(in[l] + 16 * j))), keys[l].rk[0]);
+#define ROUND(l) s##l = _mm_aesenc_si128(s##l, keys[l].rk[r]);
+#define LAST_ROUND(l) s##l = _mm_aesenclast_si128(s##l, keys[l].rk[rounds]); \
+    _mm_storeu_si128((__m128i *)(out[l] + 16 * j), s##l);
+#define STORE_STATE(l) state[l] = s##l;
+    const int rounds = keys[0].rounds;
+    size_t j;
+    int r;
+    EACH_LANE(LOAD_STATE)
+
+    for (j = 0; j < blocks; j++) {
+	EACH_LANE(XOR_BLOCK)
+	for (r = 1; r < rounds; r++) {
+	    EACH_LANE(ROUND)
+	}
+	EACH_LANE(LAST_ROUND)
+    }
+
+    EACH_LANE(STORE_STATE)
+#undef LOAD_STATE
+#undef XOR_BLOCK
+#undef ROUND
+#undef LAST_ROUND
+#undef STORE_STATE
+}
+
+__attribute__((target("aes")))
+static void encrypt_lanes(size_t count, const lane_key_t *keys, const unsigned char *const *in, unsigned char *const *out, const size_t *lengths)
+{
+    __m128i state[MULTI_AES_LANES];
+    unsigned char pad[MULTI_AES_LANES][16];
+    size_t blocks[MULTI_AES_LANES], most = 0, common = (size_t)-1, j = 0, lane;
+    int active[MULTI_AES_LANES], n, i, r;
+
+    for (lane = 0; lane < count; lane++) {
+	state[lane] = _mm_setzero_si128();	/* the IV */
+	blocks[lane] = lengths[lane] / 16 + 1;
+	if (blocks[lane] > most)
+	    most = blocks[lane];
+	if (lengths[lane] / 16 < common)
+	    common = lengths[lane] / 16;
+    }
+
+    if (count == MULTI_AES_LANES && common > 0) {
+	encrypt_eight(keys, in, out, state, common);
+	j = common;
+    }
+
+    /* The tails, and groups of fewer lanes */
+    for (; j < most; j++) {
+	for (n = 0, lane = 0; lane < count; lane++) {
+	    if (j < blocks[lane]) {
+		const __m128i block = _mm_loadu_si128((const __m128i *)lane_block(in[lane], lengths[lane], j, pad[lane]));
+
+		state[lane] = _mm_xor_si128(_mm_xor_si128(state[lane], block), keys[lane].rk[0]);
+		active[n++] = (int)lane;
+	    }
+	}
+
+	for (r = 1; r < keys[0].rounds; r++) {
+	    for (i = 0; i < n; i++)
+		state[active[i]] = _mm_aesenc_si128(state[active[i]], keys[active[i]].rk[r]);
+	}
+	for (i = 0; i < n; i++) {
+	    const int l = active[i];
+
+	    state[l] = _mm_aesenclast_si128(state[l], keys[l].rk[keys[l].rounds]);
+	    _mm_storeu_si128((__m128i *)(out[l] + 16 * j), state[l]);
+	}
+    }
+
+    OPENSSL_cleanse(pad, sizeof(pad));
+}
+
+/* The CPU model is resolved by a libgcc constructor before any thread runs,
+ * so the worker threads may all ask at once */
+static int have_aesni(void)
+{
+    return __builtin_cpu_supports("aes");
+}
+
+/* AES-CBC with a zero IV and PKCS#7 padding of count messages: in[i] of
+ * lengths[i] bytes is encrypted with keys[i] into out[i], which must hold
+ * lengths[i] rounded up to the next whole block.  Returns 0, writing
+ * nothing, unless cipher is AES-128-CBC or AES-256-CBC and the CPU has
+ * AES-NI. */
+int multi_aes_cbc_encrypt(const EVP_CIPHER *cipher, size_t count, const unsigned char *const *keys, const unsigned char *const *in, unsigned char *const *out, const size_t *lengths)
+{
+    const int nid = EVP_CIPHER_nid(cipher);
+    lane_key_t lane_keys[MULTI_AES_LANES];
+    size_t first, lane, lanes;
+
+    if ((nid != NID_aes_128_cbc && nid != NID_aes_256_cbc) || !have_aesni())
+	return 0;
+
+    for (first = 0; first < count; first += lanes) {
+	lanes = count - first < MULTI_AES_LANES ? count - first : MULTI_AES_LANES;
+	for (lane = 0; lane < lanes; lane++) {
+	    if (nid == NID_aes_128_cbc) {
+		expand_128(keys[first + lane], lane_keys[lane].rk);
+		lane_keys[lane].rounds = 10;
+	    } else {
+		expand_256(keys[first + lane], lane_keys[lane].rk);
+		lane_keys[lane].rounds = 14;
+	    }
+	}
+	encrypt_lanes(lanes, lane_keys, in + first, out + first, lengths + first);
+    }
+
+    OPENSSL_cleanse(lane_keys, sizeof(lane_keys));
+    return 1;
+}
+
+#else /* not GCC on x86-64 */
+
+int multi_aes_cbc_encrypt(const EVP_CIPHER *cipher, size_t count, const unsigned char *const *keys, const unsigned char *const *in, unsigned char *const *out, const size_t *lengths)
+{
+    return 0;
+}
+
+#endif
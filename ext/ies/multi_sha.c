@@ -0,0 +1,222 @@
+/**
+ * @file multi_sha.c
+ *
+ * @brief SHA-1 and SHA-256 over eight independent messages at once.
+ *
+ * The KDF of a batch (ecies_envelope_keys_create) hashes many short
+ * messages of the same length: a shared secret followed by a counter.  One
+ * such message takes a block or two, far too little work for a single SHA
+ * stream to keep the vector units busy.  Here lane i of every vector holds
+ * the state of message i, so eight messages go through the rounds together.
+ *
+ * The rounds are written with GCC vector extensions and compiled for AVX2,
+ * which is only used when the CPU has it.  The same code built for SSE2,
+ * two registers per vector, was slower than OpenSSL's single-stream
+ * assembly, so without AVX2, on other architectures and compilers, and for
+ * digests other than SHA-1 and SHA-256, multi_sha_kdf() returns 0 and the
+ * caller hashes one message at a time with EVP as before.
+ */
+
+#include "ies.h"
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MULTI_SHA_LANES 8
+
+typedef uint32_t lanes_t __attribute__((vector_size(4 * MULTI_SHA_LANES)));
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t sha256_init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint32_t sha1_init[5] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+};
+
+static inline __attribute__((always_inline))
+void sha256_rounds(lanes_t *state, const lanes_t *block)
+{
+    lanes_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++)
+	w[i] = block[i];
+    for (i = 16; i < 64; i++) {
+	lanes_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+	lanes_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+	w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+    for (i = 0; i < 64; i++) {
+	t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+	t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+	h = g; g = f; f = e; e = d + t1;
+	d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static inline __attribute__((always_inline))
+void sha1_rounds(lanes_t *state, const lanes_t *block)
+{
+    lanes_t w[80], a, b, c, d, e, f, t;
+    uint32_t k;
+    int i;
+
+    for (i = 0; i < 16; i++)
+	w[i] = block[i];
+    for (i = 16; i < 80; i++)
+	w[i] = ROTL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3]; e = state[4];
+    for (i = 0; i < 80; i++) {
+	if (i < 20) {
+	    f = (b & c) | (~b & d);
+	    k = 0x5a827999;
+	} else if (i < 40) {
+	    f = b ^ c ^ d;
+	    k = 0x6ed9eba1;
+	} else if (i < 60) {
+	    f = (b & c) | (b & d) | (c & d);
+	    k = 0x8f1bbcdc;
+	} else {
+	    f = b ^ c ^ d;
+	    k = 0xca62c1d6;
+	}
+	t = ROTL(a, 5) + f + e + k + w[i];
+	e = d; d = c; c = ROTL(b, 30); b = a; a = t;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
+}
+
+__attribute__((target("avx2")))
+static void sha256_avx2(lanes_t *state, const lanes_t *block)
+{
+    sha256_rounds(state, block);
+}
+
+__attribute__((target("avx2")))
+static void sha1_avx2(lanes_t *state, const lanes_t *block)
+{
+    sha1_rounds(state, block);
+}
+
+typedef void (*compress_t)(lanes_t *state, const lanes_t *block);
+
+/* The CPU model is resolved by a libgcc constructor before any thread runs,
+ * so the worker threads may all ask at once */
+static int have_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+/* Longest message: the largest shared secret and the counter, padded */
+#define MULTI_SHA_MAX_BLOCKS ((IES_MAX_ECDH_KEY_LENGTH + 4 + 9 + 63) / 64)
+
+/* X9.63 KDF without shared info of count secrets, all secret_length bytes
+ * long, the same as ecdh_kdf_x9_62 in ecies.c gives for each of them:
+ * out[i] receives out_length bytes for secrets[i].  Returns 0, writing
+ * nothing, if md is not SHA-1 or SHA-256 or the CPU lacks AVX2. */
+int multi_sha_kdf(const EVP_MD *md, size_t count, const unsigned char *const *secrets, size_t secret_length, unsigned char *const *out, size_t out_length)
+{
+    const int nid = EVP_MD_type(md);
+    const size_t message_length = secret_length + 4;
+    const size_t blocks = (message_length + 9 + 63) / 64;
+    const int state_words = nid == NID_sha256 ? 8 : 5;
+    const size_t md_length = 4 * state_words;
+    unsigned char message[MULTI_SHA_LANES][MULTI_SHA_MAX_BLOCKS * 64];
+    lanes_t block[16], state[8];
+    compress_t compress;
+    uint32_t counter;
+    size_t first, lane, offset, i, j;
+    uint64_t bits = (uint64_t)message_length * 8;
+
+    if ((nid != NID_sha256 && nid != NID_sha1) || blocks > MULTI_SHA_MAX_BLOCKS || !have_avx2())
+	return 0;
+    compress = nid == NID_sha256 ? sha256_avx2 : sha1_avx2;
+
+    for (first = 0; first < count; first += MULTI_SHA_LANES) {
+	/* Lanes past the last message repeat it, their output is dropped */
+	for (lane = 0; lane < MULTI_SHA_LANES; lane++) {
+	    size_t index = first + lane < count ? first + lane : count - 1;
+
+	    memset(message[lane], 0, blocks * 64);
+	    memcpy(message[lane], secrets[index], secret_length);
+	    message[lane][message_length] = 0x80;
+	    for (i = 0; i < 8; i++)
+		message[lane][blocks * 64 - 1 - i] = (unsigned char)(bits >> (8 * i));
+	}
+
+	for (counter = 1, offset = 0; offset < out_length; counter++, offset += md_length) {
+	    for (lane = 0; lane < MULTI_SHA_LANES; lane++) {
+		message[lane][secret_length] = (unsigned char)(counter >> 24);
+		message[lane][secret_length + 1] = (unsigned char)(counter >> 16);
+		message[lane][secret_length + 2] = (unsigned char)(counter >> 8);
+		message[lane][secret_length + 3] = (unsigned char)counter;
+	    }
+
+	    for (i = 0; i < (size_t)state_words; i++) {
+		const uint32_t word = nid == NID_sha256 ? sha256_init[i] : sha1_init[i];
+
+		for (lane = 0; lane < MULTI_SHA_LANES; lane++)
+		    state[i][lane] = word;
+	    }
+
+	    for (j = 0; j < blocks; j++) {
+		for (i = 0; i < 16; i++) {
+		    for (lane = 0; lane < MULTI_SHA_LANES; lane++) {
+			const unsigned char *p = message[lane] + 64 * j + 4 * i;
+
+			block[i][lane] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+		    }
+		}
+		compress(state, block);
+	    }
+
+	    for (lane = 0; lane < MULTI_SHA_LANES && first + lane < count; lane++) {
+		unsigned char digest[32];
+		size_t length = out_length - offset < md_length ? out_length - offset : md_length;
+
+		for (i = 0; i < (size_t)state_words; i++) {
+		    digest[4 * i] = (unsigned char)(state[i][lane] >> 24);
+		    digest[4 * i + 1] = (unsigned char)(state[i][lane] >> 16);
+		    digest[4 * i + 2] = (unsigned char)(state[i][lane] >> 8);
+		    digest[4 * i + 3] = (unsigned char)state[i][lane];
+		}
+		memcpy(out[first + lane] + offset, digest, length);
+		OPENSSL_cleanse(digest, sizeof(digest));
+	    }
+	}
+    }
+
+    OPENSSL_cleanse(message, sizeof(message));
+    OPENSSL_cleanse(state, sizeof(state));
+    OPENSSL_cleanse(block, sizeof(block));
+    return 1;
+}
+
+#else /* not GCC on x86 */
+
+int multi_sha_kdf(const EVP_MD *md, size_t count, const unsigned char *const *secrets, size_t secret_length, unsigned char *const *out, size_t out_length)
+{
+    return 0;
+}
+
+#endif
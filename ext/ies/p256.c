@@ -0,0 +1,589 @@
+/**
+ * @file p256.c
+ *
+ * @brief ECDH on prime256v1 with fixed-width field arithmetic.
+ *
+ * OpenSSL reaches P-256 through EC_POINT and BIGNUM.  Where it has no code
+ * of its own for the curve (no-asm builds, most platforms other than
+ * x86-64 before 1.1.0) that means generic Montgomery arithmetic on
+ * variable-length numbers, and even with ecp_nistz256 the conversions in
+ * and out of BIGNUM, the compressed point decoding (BN_mod_sqrt) and the
+ * affine conversion (BN_mod_inverse) stay generic.  Here everything is done
+ * on 4 x 64-bit limbs:
+ *
+ * - field elements are kept in Montgomery form, and as p = -1 mod 2^64 a
+ *   reduction step needs no multiplication for its quotient;
+ * - points are projective (X : Y : Z) and added with the complete formulas
+ *   of Renes, Costello and Batina (2016, a = -3), so there is no special
+ *   case for doubling or for the point at infinity to branch on;
+ * - k * G adds one entry from each of 64 rows of 15 affine multiples of
+ *   16^i * G, as fixed_base.c does for the recipient key, but the entries
+ *   are read with a constant-time scan of the row;
+ * - k * P for any other point uses 4-bit windows over a table of 0..15 * P,
+ *   again read with a constant-time scan, four doublings and one addition
+ *   per window;
+ * - inversion and square roots are fixed exponentiations.
+ *
+ * Scalars are 32 big-endian bytes, points cross the interface as octets.
+ * Nothing here branches on or indexes memory with a secret.
+ *
+ * Needs a compiler with unsigned __int128; elsewhere p256_engine.setup()
+ * returns 0 and the IES context keeps using OpenSSL.
+ */
+
+#include "ies.h"
+
+#ifdef __SIZEOF_INT128__
+#define FE64_P { \
+    0xffffffffffffffffULL, 0x00000000ffffffffULL, 0x0000000000000000ULL, 0xffffffff00000001ULL, \
+}
+
+#include "fe64.h"
+
+#define P256_ROWS 64
+#define P256_ROW_LENGTH 15
+
+/* 2^512 mod p, to enter Montgomery form */
+static const fe_t fe_rr = {
+    0x0000000000000003ULL, 0xfffffffbffffffffULL, 0xfffffffffffffffeULL, 0x00000004fffffffdULL,
+};
+/* 2^256 mod p, one in Montgomery form */
+static const fe_t fe_one = {
+    0x0000000000000001ULL, 0xffffffff00000000ULL, 0xffffffffffffffffULL, 0x00000000fffffffeULL,
+};
+
+static const unsigned char curve_b[32] = {
+    0x5a, 0xc6, 0x35, 0xd8, 0xaa, 0x3a, 0x93, 0xe7, 0xb3, 0xeb, 0xbd, 0x55, 0x76, 0x98, 0x86, 0xbc,
+    0x65, 0x1d, 0x06, 0xb0, 0xcc, 0x53, 0xb0, 0xf6, 0x3b, 0xce, 0x3c, 0x3e, 0x27, 0xd2, 0x60, 0x4b,
+};
+static const unsigned char curve_gx[32] = {
+    0x6b, 0x17, 0xd1, 0xf2, 0xe1, 0x2c, 0x42, 0x47, 0xf8, 0xbc, 0xe6, 0xe5, 0x63, 0xa4, 0x40, 0xf2,
+    0x77, 0x03, 0x7d, 0x81, 0x2d, 0xeb, 0x33, 0xa0, 0xf4, 0xa1, 0x39, 0x45, 0xd8, 0x98, 0xc2, 0x96,
+};
+static const unsigned char curve_gy[32] = {
+    0x4f, 0xe3, 0x42, 0xe2, 0xfe, 0x1a, 0x7f, 0x9b, 0x8e, 0xe7, 0xeb, 0x4a, 0x7c, 0x0f, 0x9e, 0x16,
+    0x2b, 0xce, 0x33, 0x57, 0x6b, 0x31, 0x5e, 0xce, 0xcb, 0xb6, 0x40, 0x68, 0x37, 0xbf, 0x51, 0xf5,
+};
+
+/* Set up once by p256_setup() and read-only afterwards */
+static fe_t fe_b;
+static apoint_t (*base_table)[P256_ROW_LENGTH];
+
+/* Adds q * p at limb ti for q = ti, which clears ti: with p = 2^256 -
+ * 2^224 + 2^192 + 2^96 - 1 that is q * 2^96 + q * p[3] * 2^192 and takes one
+ * multiplication.  The carry out of ti4 is left in top. */
+#define REDUCE_STEP(ti, ti1, ti2, ti3, ti4, top) do { \
+	const uint64_t q_ = (ti); \
+	const u128 m_ = (u128)q_ * fe_p[3]; \
+	uint64_t carry_ = 0; \
+	(ti1) = add_carry((ti1), q_ << 32, &carry_); \
+	(ti2) = add_carry((ti2), q_ >> 32, &carry_); \
+	(ti3) = add_carry((ti3), (uint64_t)m_, &carry_); \
+	(ti4) = add_carry((ti4), (uint64_t)(m_ >> 64), &carry_); \
+	(top) += carry_; \
+    } while (0)
+
+/* r = t / 2^256 mod p for the 512-bit t = t7..t0, t < p * 2^256.  As
+ * p = -1 mod 2^64, the multiple of p that clears a limb is that limb times
+ * p. */
+static inline void mont_reduce(fe_t r, uint64_t t0, uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4, uint64_t t5, uint64_t t6, uint64_t t7)
+{
+    uint64_t c = 0, c4 = 0, c5 = 0, c6 = 0, c7 = 0;
+
+    /* each step carries into the limb after the ones it adds to */
+    REDUCE_STEP(t0, t1, t2, t3, t4, c4);
+    REDUCE_STEP(t1, t2, t3, t4, t5, c5);
+    REDUCE_STEP(t2, t3, t4, t5, t6, c6);
+    REDUCE_STEP(t3, t4, t5, t6, t7, c7);
+    t5 = add_carry(t5, c4, &c);
+    t6 = add_carry(t6, c5, &c);
+    t7 = add_carry(t7, c6, &c);
+    c += c7;
+    fe_reduce_once(r, t4, t5, t6, t7, c);
+}
+
+/* Montgomery product a * b / 2^256 mod p */
+static void fe_mul(fe_t r, const fe_t a, const fe_t b)
+{
+    uint64_t t0, t1, t2, t3, t4, t5, t6, t7;
+
+    FE_MUL_WIDE(t0, t1, t2, t3, t4, t5, t6, t7, a, b);
+    mont_reduce(r, t0, t1, t2, t3, t4, t5, t6, t7);
+}
+
+static void fe_sqr(fe_t r, const fe_t a)
+{
+    uint64_t t0, t1, t2, t3, t4, t5, t6, t7;
+
+    FE_SQR_WIDE(t0, t1, t2, t3, t4, t5, t6, t7, a);
+    mont_reduce(r, t0, t1, t2, t3, t4, t5, t6, t7);
+}
+
+/* r = a^(2^n) */
+static void fe_sqr_n(fe_t r, const fe_t a, int n)
+{
+    fe_sqr(r, a);
+    while (--n > 0)
+	fe_sqr(r, r);
+}
+
+/* Big-endian bytes to Montgomery form.  Returns 0 if the value is not less
+ * than p, in constant time. */
+static int fe_from_bytes(fe_t r, const unsigned char *in)
+{
+    fe_t t;
+    int ok = fe_limbs_from_bytes(t, in);
+
+    fe_mul(r, t, fe_rr);
+    return ok;
+}
+
+static void fe_to_bytes(unsigned char *out, const fe_t a)
+{
+    static const fe_t one = { 1, 0, 0, 0 };
+    fe_t t;
+
+    fe_mul(t, a, one);
+    fe_limbs_to_bytes(out, t);
+}
+
+/* Lowest bit of the value, out of Montgomery form */
+static uint64_t fe_parity(const fe_t a)
+{
+    static const fe_t one = { 1, 0, 0, 0 };
+    fe_t t;
+
+    fe_mul(t, a, one);
+    return t[0] & 1;
+}
+
+/* a^(2^n - 1) for the n the chains below need, a^(2^32 - 1) last */
+static void fe_pow_ones(fe_t x2, fe_t x30, fe_t x32, const fe_t a)
+{
+    fe_t x3, x6, x12, x15, t;
+
+    fe_sqr(t, a);
+    fe_mul(x2, t, a);
+    fe_sqr(t, x2);
+    fe_mul(x3, t, a);
+    fe_sqr_n(t, x3, 3);
+    fe_mul(x6, t, x3);
+    fe_sqr_n(t, x6, 6);
+    fe_mul(x12, t, x6);
+    fe_sqr_n(t, x12, 3);
+    fe_mul(x15, t, x3);
+    fe_sqr_n(t, x15, 15);
+    fe_mul(x30, t, x15);
+    fe_sqr_n(t, x30, 2);
+    fe_mul(x32, t, x2);
+}
+
+/* a^(p - 2), the inverse of a non-zero a.  p - 2 is 32 ones, 31 zeros, a
+ * one, 96 zeros, 94 ones, a zero and a one. */
+static void fe_inv(fe_t r, const fe_t a)
+{
+    fe_t x2, x30, x32, t;
+
+    fe_pow_ones(x2, x30, x32, a);
+    fe_sqr_n(t, x32, 32);
+    fe_mul(t, t, a);
+    fe_sqr_n(t, t, 128);
+    fe_mul(t, t, x32);
+    fe_sqr_n(t, t, 32);
+    fe_mul(t, t, x32);
+    fe_sqr_n(t, t, 30);
+    fe_mul(t, t, x30);
+    fe_sqr_n(t, t, 2);
+    fe_mul(r, t, a);
+}
+
+/* a^((p + 1) / 4), a square root of a if there is one, as p = 3 mod 4.
+ * (p + 1) / 4 is 32 ones, 31 zeros, a one, 95 zeros, a one and 94 zeros. */
+static void fe_sqrt(fe_t r, const fe_t a)
+{
+    fe_t x2, x30, x32, t;
+
+    fe_pow_ones(x2, x30, x32, a);
+    fe_sqr_n(t, x32, 32);
+    fe_mul(t, t, a);
+    fe_sqr_n(t, t, 96);
+    fe_mul(t, t, a);
+    fe_sqr_n(r, t, 94);
+}
+
+/* x^3 - 3x + b */
+static void curve_rhs(fe_t r, const fe_t x)
+{
+    fe_t t, x3;
+
+    fe_sqr(t, x);
+    fe_mul(x3, t, x);
+    fe_add(t, x, x);
+    fe_add(t, t, x);
+    fe_sub(r, x3, t);
+    fe_add(r, r, fe_b);
+}
+
+static void point_set_infinity(jpoint_t *r)
+{
+    memset(r, 0, sizeof(*r));
+    fe_copy(r->y, fe_one);
+}
+
+/* r = a + b, Algorithm 4 of Renes-Costello-Batina: complete, so a and b may
+ * be equal or infinity.  r may alias either. */
+static void point_add(jpoint_t *r, const jpoint_t *a, const jpoint_t *b)
+{
+    fe_t t0, t1, t2, t3, t4, x3, y3, z3;
+
+    fe_mul(t0, a->x, b->x);
+    fe_mul(t1, a->y, b->y);
+    fe_mul(t2, a->z, b->z);
+    fe_add(t3, a->x, a->y);
+    fe_add(t4, b->x, b->y);
+    fe_mul(t3, t3, t4);
+    fe_add(t4, t0, t1);
+    fe_sub(t3, t3, t4);
+    fe_add(t4, a->y, a->z);
+    fe_add(x3, b->y, b->z);
+    fe_mul(t4, t4, x3);
+    fe_add(x3, t1, t2);
+    fe_sub(t4, t4, x3);
+    fe_add(x3, a->x, a->z);
+    fe_add(y3, b->x, b->z);
+    fe_mul(x3, x3, y3);
+    fe_add(y3, t0, t2);
+    fe_sub(y3, x3, y3);
+    fe_mul(z3, fe_b, t2);
+    fe_sub(x3, y3, z3);
+    fe_add(z3, x3, x3);
+    fe_add(x3, x3, z3);
+    fe_sub(z3, t1, x3);
+    fe_add(x3, t1, x3);
+    fe_mul(y3, fe_b, y3);
+    fe_add(t1, t2, t2);
+    fe_add(t2, t1, t2);
+    fe_sub(y3, y3, t2);
+    fe_sub(y3, y3, t0);
+    fe_add(t1, y3, y3);
+    fe_add(y3, t1, y3);
+    fe_add(t1, t0, t0);
+    fe_add(t0, t1, t0);
+    fe_sub(t0, t0, t2);
+    fe_mul(t1, t4, y3);
+    fe_mul(t2, t0, y3);
+    fe_mul(y3, x3, z3);
+    fe_add(y3, y3, t2);
+    fe_mul(x3, x3, t3);
+    fe_sub(x3, x3, t1);
+    fe_mul(z3, z3, t4);
+    fe_mul(t1, t3, t0);
+    fe_add(z3, z3, t1);
+
+    fe_copy(r->x, x3);
+    fe_copy(r->y, y3);
+    fe_copy(r->z, z3);
+}
+
+/* r = a + b for an affine b, Algorithm 5: complete for any a */
+static void point_add_affine(jpoint_t *r, const jpoint_t *a, const apoint_t *b)
+{
+    fe_t t0, t1, t2, t3, t4, x3, y3, z3;
+
+    fe_mul(t0, a->x, b->x);
+    fe_mul(t1, a->y, b->y);
+    fe_add(t3, b->x, b->y);
+    fe_add(t4, a->x, a->y);
+    fe_mul(t3, t3, t4);
+    fe_add(t4, t0, t1);
+    fe_sub(t3, t3, t4);
+    fe_mul(t4, b->y, a->z);
+    fe_add(t4, t4, a->y);
+    fe_mul(y3, b->x, a->z);
+    fe_add(y3, y3, a->x);
+    fe_mul(z3, fe_b, a->z);
+    fe_sub(x3, y3, z3);
+    fe_add(z3, x3, x3);
+    fe_add(x3, x3, z3);
+    fe_sub(z3, t1, x3);
+    fe_add(x3, t1, x3);
+    fe_mul(y3, fe_b, y3);
+    fe_add(t1, a->z, a->z);
+    fe_add(t2, t1, a->z);
+    fe_sub(y3, y3, t2);
+    fe_sub(y3, y3, t0);
+    fe_add(t1, y3, y3);
+    fe_add(y3, t1, y3);
+    fe_add(t1, t0, t0);
+    fe_add(t0, t1, t0);
+    fe_sub(t0, t0, t2);
+    fe_mul(t1, t4, y3);
+    fe_mul(t2, t0, y3);
+    fe_mul(y3, x3, z3);
+    fe_add(y3, y3, t2);
+    fe_mul(x3, x3, t3);
+    fe_sub(x3, x3, t1);
+    fe_mul(z3, z3, t4);
+    fe_mul(t1, t3, t0);
+    fe_add(z3, z3, t1);
+
+    fe_copy(r->x, x3);
+    fe_copy(r->y, y3);
+    fe_copy(r->z, z3);
+}
+
+/* r = 2 * a, Algorithm 6 */
+static void point_double(jpoint_t *r, const jpoint_t *a)
+{
+    fe_t t0, t1, t2, t3, x3, y3, z3;
+
+    fe_sqr(t0, a->x);
+    fe_sqr(t1, a->y);
+    fe_sqr(t2, a->z);
+    fe_mul(t3, a->x, a->y);
+    fe_add(t3, t3, t3);
+    fe_mul(z3, a->x, a->z);
+    fe_add(z3, z3, z3);
+    fe_mul(y3, fe_b, t2);
+    fe_sub(y3, y3, z3);
+    fe_add(x3, y3, y3);
+    fe_add(y3, x3, y3);
+    fe_sub(x3, t1, y3);
+    fe_add(y3, t1, y3);
+    fe_mul(y3, x3, y3);
+    fe_mul(x3, x3, t3);
+    fe_add(t3, t2, t2);
+    fe_add(t2, t2, t3);
+    fe_mul(z3, fe_b, z3);
+    fe_sub(z3, z3, t2);
+    fe_sub(z3, z3, t0);
+    fe_add(t3, z3, z3);
+    fe_add(z3, z3, t3);
+    fe_add(t3, t0, t0);
+    fe_add(t0, t3, t0);
+    fe_sub(t0, t0, t2);
+    fe_mul(t0, t0, z3);
+    fe_add(y3, y3, t0);
+    fe_mul(t0, a->y, a->z);
+    fe_add(t0, t0, t0);
+    fe_mul(z3, t0, z3);
+    fe_sub(x3, x3, z3);
+    fe_mul(z3, t0, t1);
+    fe_add(z3, z3, z3);
+    fe_add(z3, z3, z3);
+
+    fe_copy(r->x, x3);
+    fe_copy(r->y, y3);
+    fe_copy(r->z, z3);
+}
+
+/* Affine coordinates of a.  Returns 0 for the point at infinity. */
+static int point_to_affine(apoint_t *r, const jpoint_t *a)
+{
+    fe_t zinv;
+
+    if (fe_is_zero(a->z))
+	return 0;
+    fe_inv(zinv, a->z);
+    fe_mul(r->x, a->x, zinv);
+    fe_mul(r->y, a->y, zinv);
+    OPENSSL_cleanse(zinv, sizeof(zinv));
+    return 1;
+}
+
+/* Digit i of a big-endian 32-byte scalar in 4-bit windows, 0 the lowest */
+static unsigned int scalar_digit(const unsigned char *k, int i)
+{
+    return (k[31 - i / 2] >> (4 * (i & 1))) & 0xf;
+}
+
+/* k * G: the sum of entry digit(i) of every row i */
+static void base_mul(jpoint_t *r, const unsigned char *k)
+{
+    apoint_t entry;
+    jpoint_t sum;
+    uint64_t digit, mask;
+    int i, j;
+
+    point_set_infinity(r);
+    for (i = 0; i < P256_ROWS; i++) {
+	digit = scalar_digit(k, i);
+	memset(&entry, 0, sizeof(entry));
+	for (j = 0; j < P256_ROW_LENGTH; j++) {
+	    mask = eq_mask(digit, (uint64_t)j + 1);
+	    fe_cmov(entry.x, base_table[i][j].x, mask);
+	    fe_cmov(entry.y, base_table[i][j].y, mask);
+	}
+	/* a zero digit adds nothing, the sum is made and then dropped */
+	point_add_affine(&sum, r, &entry);
+	mask = ~eq_mask(digit, 0);
+	fe_cmov(r->x, sum.x, mask);
+	fe_cmov(r->y, sum.y, mask);
+	fe_cmov(r->z, sum.z, mask);
+    }
+    OPENSSL_cleanse(&entry, sizeof(entry));
+    OPENSSL_cleanse(&sum, sizeof(sum));
+}
+
+/* k * p, four doublings and one addition of 0..15 * p per window */
+static void point_mul(jpoint_t *r, const apoint_t *p, const unsigned char *k)
+{
+    jpoint_t table[16], entry;
+    uint64_t digit, mask;
+    int i, j;
+
+    point_set_infinity(&table[0]);
+    fe_copy(table[1].x, p->x);
+    fe_copy(table[1].y, p->y);
+    fe_copy(table[1].z, fe_one);
+    for (i = 2; i < 16; i++) {
+	if (i & 1)
+	    point_add_affine(&table[i], &table[i - 1], p);
+	else
+	    point_double(&table[i], &table[i / 2]);
+    }
+
+    point_set_infinity(r);
+    for (i = 2 * 32 - 1; i >= 0; i--) {
+	for (j = 0; j < 4; j++)
+	    point_double(r, r);
+
+	digit = scalar_digit(k, i);
+	memset(&entry, 0, sizeof(entry));
+	for (j = 0; j < 16; j++) {
+	    mask = eq_mask(digit, (uint64_t)j);
+	    fe_cmov(entry.x, table[j].x, mask);
+	    fe_cmov(entry.y, table[j].y, mask);
+	    fe_cmov(entry.z, table[j].z, mask);
+	}
+	point_add(r, r, &entry);
+    }
+    OPENSSL_cleanse(table, sizeof(table));
+    OPENSSL_cleanse(&entry, sizeof(entry));
+}
+
+/* Builds the table of the generator on first use.  Like group_intern(),
+ * must be called with the GVL held; the table is never freed. */
+static int p256_setup(void)
+{
+    apoint_t (*table)[P256_ROW_LENGTH];
+    jpoint_t base, multiple;
+    apoint_t g;
+    int i, j;
+
+    if (base_table)
+	return 1;
+
+    if (!(table = OPENSSL_malloc(P256_ROWS * sizeof(*table))))
+	return 0;
+
+    fe_from_bytes(fe_b, curve_b);
+    fe_from_bytes(g.x, curve_gx);
+    fe_from_bytes(g.y, curve_gy);
+    fe_copy(base.x, g.x);
+    fe_copy(base.y, g.y);
+    fe_copy(base.z, fe_one);
+
+    /* row i holds j * 16^i * G for j = 1..15 */
+    for (i = 0; i < P256_ROWS; i++) {
+	multiple = base;
+	for (j = 0; j < P256_ROW_LENGTH; j++) {
+	    if (j > 0)
+		point_add(&multiple, &multiple, &base);
+	    point_to_affine(&table[i][j], &multiple);
+	}
+	point_add(&base, &multiple, &base);
+    }
+
+    base_table = table;
+    return 1;
+}
+
+/* Decodes a compressed or uncompressed point, checking that it is on the
+ * curve.  The curve has prime order, so any such point other than infinity
+ * (which has no encoding here) generates the whole group. */
+static int p256_point_decode(curve_point_t *point, const unsigned char *octets, size_t length)
+{
+    apoint_t a;
+    fe_t rhs, y2;
+
+    if (length == 1 + 32 && (octets[0] == POINT_CONVERSION_COMPRESSED || octets[0] == (POINT_CONVERSION_COMPRESSED | 1))) {
+	if (!fe_from_bytes(a.x, octets + 1))
+	    return 0;
+	curve_rhs(rhs, a.x);
+	fe_sqrt(a.y, rhs);
+	fe_sqr(y2, a.y);
+	fe_sub(y2, y2, rhs);
+	if (!fe_is_zero(y2))
+	    return 0;
+	fe_cneg(a.y, a.y, (uint64_t)0 - (fe_parity(a.y) ^ (octets[0] & 1)));
+    } else if (length == 1 + 2 * 32 && octets[0] == POINT_CONVERSION_UNCOMPRESSED) {
+	if (!fe_from_bytes(a.x, octets + 1) || !fe_from_bytes(a.y, octets + 1 + 32))
+	    return 0;
+	curve_rhs(rhs, a.x);
+	fe_sqr(y2, a.y);
+	fe_sub(y2, y2, rhs);
+	if (!fe_is_zero(y2))
+	    return 0;
+    } else {
+	return 0;
+    }
+
+    memcpy(point->x, a.x, sizeof(a.x));
+    memcpy(point->y, a.y, sizeof(a.y));
+    return 1;
+}
+
+/* R = k * G for the scalar k, 0 < k < n, written compressed to 33 bytes */
+static int p256_public_key(const unsigned char *k, unsigned char *compressed)
+{
+    jpoint_t r;
+    apoint_t a;
+    int ok;
+
+    base_mul(&r, k);
+    if ((ok = point_to_affine(&a, &r))) {
+	compressed[0] = POINT_CONVERSION_COMPRESSED | (unsigned char)fe_parity(a.y);
+	fe_to_bytes(compressed + 1, a.x);
+    }
+    OPENSSL_cleanse(&r, sizeof(r));
+    OPENSSL_cleanse(&a, sizeof(a));
+    return ok;
+}
+
+/* The x coordinate of k * point, 32 bytes, as ECDH_compute_key gives it */
+static int p256_shared_secret(const curve_point_t *point, const unsigned char *k, unsigned char *x_out)
+{
+    apoint_t p;
+    jpoint_t r;
+    fe_t zinv;
+    int ok = 0;
+
+    memcpy(p.x, point->x, sizeof(p.x));
+    memcpy(p.y, point->y, sizeof(p.y));
+    point_mul(&r, &p, k);
+    if (!fe_is_zero(r.z)) {
+	fe_inv(zinv, r.z);
+	fe_mul(r.x, r.x, zinv);
+	fe_to_bytes(x_out, r.x);
+	ok = 1;
+    }
+    OPENSSL_cleanse(&r, sizeof(r));
+    OPENSSL_cleanse(zinv, sizeof(zinv));
+    return ok;
+}
+
+const curve_engine_t p256_engine = {
+    p256_setup, p256_point_decode, p256_public_key, p256_shared_secret,
+};
+
+#else /* no 128-bit integers */
+
+static int p256_setup(void)
+{
+    return 0;
+}
+
+const curve_engine_t p256_engine = { p256_setup, NULL, NULL, NULL };
+
+#endif
@@ -0,0 +1,135 @@
+/**
+ * @file scratch.c
+ *
+ * @brief Per-thread scratch state for encryption/decryption.
+ *
+ * Given NULL for the BN_CTX, OpenSSL creates and destroys a BN_CTX with its
+ * pool of bignums inside every EC call, several times per message.  Each
+ * thread that encrypts or decrypts instead keeps one BN_CTX and the two
+ * EC_POINTs a message needs, and frees them when it exits.  The digest,
+ * cipher and HMAC contexts, which OpenSSL 1.1 only hands out from the heap,
+ * are kept the same way and reset after every use.  This works the
+ * same for Ruby threads running without the GVL and for native threads.
+ *
+ * Points are only cached for interned groups, which outlive every thread.
+ * Like the bignums in a BN_CTX pool, the cached points keep the last shared
+ * point until they are reused or the thread exits.
+ */
+
+#include "ies.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+static int scratch_key_ready;
+#endif
+
+static void scratch_free(void *ptr)
+{
+    scratch_t *scratch = ptr;
+    int i;
+
+    for (i = 0; i < SCRATCH_POINTS; i++) {
+	if (scratch->points[i])
+	    EC_POINT_clear_free(scratch->points[i]);
+    }
+    if (scratch->bn_ctx)
+	BN_CTX_free(scratch->bn_ctx);
+    if (scratch->md)
+	EVP_MD_CTX_free(scratch->md);
+    if (scratch->cipher)
+	EVP_CIPHER_CTX_free(scratch->cipher);
+    if (scratch->hmac)
+	HMAC_CTX_free(scratch->hmac);
+    if (scratch->x25519_keygen)
+	EVP_PKEY_CTX_free(scratch->x25519_keygen);
+    if (scratch->x25519_derive)
+	EVP_PKEY_CTX_free(scratch->x25519_derive);
+    OPENSSL_free(scratch);
+}
+
+static scratch_t *scratch_new(void)
+{
+    scratch_t *scratch;
+
+    if (!(scratch = OPENSSL_malloc(sizeof(scratch_t))))
+	return NULL;
+    memset(scratch, 0, sizeof(scratch_t));
+
+    if (!(scratch->bn_ctx = BN_CTX_new())
+	|| !(scratch->md = EVP_MD_CTX_new())
+	|| !(scratch->cipher = EVP_CIPHER_CTX_new())
+	|| !(scratch->hmac = HMAC_CTX_new())) {
+	scratch_free(scratch);
+	return NULL;
+    }
+
+    return scratch;
+}
+
+#ifdef HAVE_PTHREAD_H
+static void scratch_key_create(void)
+{
+    scratch_key_ready = pthread_key_create(&scratch_key, scratch_free) == 0;
+}
+
+static scratch_t *thread_scratch(void)
+{
+    scratch_t *scratch;
+
+    pthread_once(&scratch_once, scratch_key_create);
+    if (!scratch_key_ready)
+	return NULL;
+
+    if ((scratch = pthread_getspecific(scratch_key)))
+	return scratch;
+
+    if (!(scratch = scratch_new()))
+	return NULL;
+    if (pthread_setspecific(scratch_key, scratch) != 0) {
+	scratch_free(scratch);
+	return NULL;
+    }
+    scratch->cached = 1;
+
+    return scratch;
+}
+#endif
+
+/* Scratch state of the calling thread, with points on the group of ctx, if
+ * it has one.  Pair with scratch_release(). */
+scratch_t *scratch_acquire(const ies_ctx_t *ctx)
+{
+    scratch_t *scratch = NULL;
+    int i;
+
+#ifdef HAVE_PTHREAD_H
+    if (!ctx->group_owned)
+	scratch = thread_scratch();
+#endif
+    if (!scratch && !(scratch = scratch_new()))
+	return NULL;
+
+    if (ctx->group && scratch->group != ctx->group) {
+	for (i = 0; i < SCRATCH_POINTS; i++) {
+	    if (scratch->points[i])
+		EC_POINT_clear_free(scratch->points[i]);
+	    if (!(scratch->points[i] = EC_POINT_new(ctx->group))) {
+		scratch->group = NULL;
+		scratch_release(scratch);
+		return NULL;
+	    }
+	}
+	scratch->group = ctx->group;
+    }
+
+    return scratch;
+}
+
+void scratch_release(scratch_t *scratch)
+{
+    if (!scratch->cached)
+	scratch_free(scratch);
+}
@@ -0,0 +1,156 @@
+/**
+ * @file suite.c
+ *
+ * @brief Registry of the named algorithm suites.
+ *
+ * A suite fixes everything about a cryptogram but the key: the curve, the
+ * symmetric cipher, the MAC hash and the KDF hash.  Names read
+ * ECIES-<curve>-<cipher>-<hash>, where the hash is used both for the KDF and
+ * the MAC.  AEAD ciphers such as GCM authenticate in the same pass as they
+ * encrypt, there the hash is for the KDF only.  The table is static and
+ * never changes, so entries are shared by every context and thread without
+ * locking.
+ *
+ * Which cipher is fastest depends on the host: AES-GCM wins by far with
+ * AES-NI and PCLMULQDQ, ChaCha20-Poly1305 without them.  suite_throughput()
+ * measures the symmetric part of a suite once per process, so that the
+ * caller can pick among the suites its policy allows.
+ */
+
+#include "ies.h"
+#include <time.h>
+
+static const ies_suite_t suites[] = {
+    /* What the algorithm spec stood for before there were suites.  It is
+     * used with any curve and for any spec outside the ECIES- namespace. */
+    { "ECIES-AES128CBC-SHA1", NID_undef, EVP_aes_128_cbc, EVP_sha1, EVP_sha1 },
+    { "ECIES-P256-AES128CBC-SHA256", NID_X9_62_prime256v1, EVP_aes_128_cbc, EVP_sha256, EVP_sha256 },
+    { "ECIES-P384-AES256CBC-SHA384", NID_secp384r1, EVP_aes_256_cbc, EVP_sha384, EVP_sha384 },
+    { "ECIES-P521-AES256CBC-SHA512", NID_secp521r1, EVP_aes_256_cbc, EVP_sha512, EVP_sha512 },
+    { "ECIES-P256-AES128GCM-SHA256", NID_X9_62_prime256v1, EVP_aes_128_gcm, NULL, EVP_sha256 },
+    { "ECIES-P384-AES256GCM-SHA384", NID_secp384r1, EVP_aes_256_gcm, NULL, EVP_sha384 },
+    { "ECIES-P521-AES256GCM-SHA512", NID_secp521r1, EVP_aes_256_gcm, NULL, EVP_sha512 },
+#ifdef HAVE_EVP_CHACHA20_POLY1305
+    { "ECIES-P256-CHACHA20POLY1305-SHA256", NID_X9_62_prime256v1, EVP_chacha20_poly1305, NULL, EVP_sha256 },
+    { "ECIES-P384-CHACHA20POLY1305-SHA384", NID_secp384r1, EVP_chacha20_poly1305, NULL, EVP_sha384 },
+#endif
+#ifdef HAVE_EVP_PKEY_GET_RAW_PUBLIC_KEY
+    /* For OpenSSL::PKey::IES, see x25519.c */
+    { "ECIES-X25519-AES128GCM-SHA256", NID_X25519, EVP_aes_128_gcm, NULL, EVP_sha256 },
+    { "ECIES-X25519-CHACHA20POLY1305-SHA256", NID_X25519, EVP_chacha20_poly1305, NULL, EVP_sha256 },
+#endif
+};
+
+#define SUITE_COUNT (sizeof(suites) / sizeof(suites[0]))
+
+size_t suite_count(void)
+{
+    return SUITE_COUNT;
+}
+
+const ies_suite_t *suite_at(size_t index)
+{
+    return index < SUITE_COUNT ? &suites[index] : NULL;
+}
+
+const ies_suite_t *suite_legacy(void)
+{
+    return &suites[0];
+}
+
+/* Returns the suite called name, NULL if there is none */
+const ies_suite_t *suite_lookup(const char *name, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < SUITE_COUNT; i++) {
+	if (strlen(suites[i].name) == length && memcmp(suites[i].name, name, length) == 0)
+	    return &suites[i];
+    }
+    return NULL;
+}
+
+/* Size of the message and minimum duration of a throughput measurement */
+#define SUITE_PROBE_LENGTH (16 * 1024)
+#define SUITE_PROBE_NSEC (20 * 1000000ULL)
+
+static double throughputs[SUITE_COUNT];
+
+static unsigned long long probe_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Encrypts and authenticates buffer in place, the way ecies_encrypt does */
+static int probe_once(const ies_suite_t *suite, EVP_CIPHER_CTX *cctx, HMAC_CTX *hctx, unsigned char *buffer)
+{
+    const EVP_CIPHER *cipher = suite->cipher();
+    unsigned char key[EVP_MAX_KEY_LENGTH + EVP_MAX_MD_SIZE], iv[EVP_MAX_IV_LENGTH], tag[EVP_MAX_MD_SIZE];
+    unsigned int tag_length;
+    int length, final_length, ok;
+
+    memset(key, 0x5a, sizeof(key));
+    memset(iv, 0, sizeof(iv));
+
+    ok = EVP_EncryptInit_ex(cctx, cipher, NULL, key, iv) == 1
+	&& EVP_EncryptUpdate(cctx, buffer, &length, buffer, SUITE_PROBE_LENGTH) == 1
+	&& EVP_EncryptFinal_ex(cctx, buffer + length, &final_length) == 1;
+    if (ok && !suite->md)
+	ok = EVP_CIPHER_CTX_ctrl(cctx, EVP_CTRL_AEAD_GET_TAG, IES_AEAD_TAG_LENGTH, tag) == 1;
+    EVP_CIPHER_CTX_reset(cctx);
+
+    if (ok && suite->md) {
+	ok = HMAC_Init_ex(hctx, key + EVP_CIPHER_key_length(cipher), EVP_MD_size(suite->md()), suite->md(), NULL) == 1
+	    && HMAC_Update(hctx, buffer, length + final_length) == 1
+	    && HMAC_Final(hctx, tag, &tag_length) == 1;
+	HMAC_CTX_reset(hctx);
+    }
+
+    return ok;
+}
+
+/* Bytes per second the cipher and MAC of suite get through on this host,
+ * for messages of SUITE_PROBE_LENGTH; 0 if the suite does not work here.
+ * Measured on the first call.  Callers must hold the GVL. */
+double suite_throughput(const ies_suite_t *suite)
+{
+    const size_t index = suite - suites;
+    unsigned char *buffer;
+    EVP_CIPHER_CTX *cctx;
+    HMAC_CTX *hctx;
+    unsigned long long started, elapsed;
+    size_t bytes = 0;
+
+    if (index >= SUITE_COUNT)
+	return 0.0;
+    if (throughputs[index] > 0.0)
+	return throughputs[index];
+
+    buffer = OPENSSL_malloc(SUITE_PROBE_LENGTH + EVP_MAX_BLOCK_LENGTH);
+    cctx = EVP_CIPHER_CTX_new();
+    hctx = HMAC_CTX_new();
+    if (buffer && cctx && hctx) {
+	memset(buffer, 0, SUITE_PROBE_LENGTH + EVP_MAX_BLOCK_LENGTH);
+	started = probe_clock();
+	do {
+	    if (!probe_once(suite, cctx, hctx, buffer)) {
+		bytes = 0;
+		break;
+	    }
+	    bytes += SUITE_PROBE_LENGTH;
+	} while ((elapsed = probe_clock() - started) < SUITE_PROBE_NSEC);
+	if (bytes)
+	    throughputs[index] = bytes * 1e9 / elapsed;
+    }
+
+    if (buffer)
+	OPENSSL_free(buffer);
+    if (cctx)
+	EVP_CIPHER_CTX_free(cctx);
+    if (hctx)
+	HMAC_CTX_free(hctx);
+    return throughputs[index];
+}
@@ -0,0 +1,411 @@
+/**
+ * @file worker_pool.c
+ *
+ * @brief Fixed-size pool of native threads that run the tasks of a batch.
+ *
+ * A job is a range of task numbers [0, count).  They are dealt out in
+ * contiguous blocks, one block per worker, into per-worker deques by
+ * Chase and Lev: the owner pops tasks from the bottom of its deque while
+ * the others steal from the top once their own deque runs dry.  Tasks of
+ * very different cost, such as batches holding both tiny and huge
+ * messages, are balanced that way without any lock on the task path.
+ *
+ * No task spawns others, so the deques are filled before the workers are
+ * woken, and a worker that finds every deque empty is done with the job.
+ * The thread that submitted the job sleeps until all workers are.
+ *
+ * Workers keep their scratch state (scratch.c) for as long as they live.
+ * Like the KEM pool, the workers only exist in the process that created
+ * them; in a forked child worker_pool_run() returns 0 and the caller runs
+ * the tasks itself.
+ */
+
+#include "ies.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define ATOMIC_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define ATOMIC_RELAXED_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define ATOMIC_RELAXED_STORE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELAXED)
+#define ATOMIC_CAS(ptr, expected, desired) \
+    __atomic_compare_exchange_n((ptr), (expected), (desired), 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)
+#define FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* steal() result when it lost a race and the deque may not be empty */
+#define DEQUE_EMPTY (-1)
+#define DEQUE_ABORT (-2)
+
+typedef struct {
+    long top;			/* thieves take from here */
+    long bottom;		/* the owner pushes and pops here */
+    long *tasks;
+    size_t capacity;		/* power of two */
+} deque_t;
+
+typedef struct {
+    worker_pool_t *pool;
+    int index;
+    pthread_t thread;
+} worker_t;
+
+struct worker_pool_st {
+    int threads;
+    worker_t *workers;
+    deque_t *deques;
+
+    /* the current job */
+    void (*func)(void *arg, long task);
+    void *arg;
+    const volatile int *interrupted;
+
+    pid_t pid;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;	/* workers wait for a new generation */
+    pthread_cond_t finished;	/* the submitter waits for idle == threads */
+    unsigned long generation;
+    int idle;
+    int busy;			/* a job is queued or running */
+    pthread_cond_t available;	/* submitters wait for busy to clear */
+    int started;
+    int stop;
+};
+
+/* Owner only, and only before the workers are woken */
+static void deque_push(deque_t *deque, long task)
+{
+    long bottom = ATOMIC_RELAXED_LOAD(&deque->bottom);
+
+    ATOMIC_RELAXED_STORE(&deque->tasks[bottom & (deque->capacity - 1)], task);
+    ATOMIC_STORE(&deque->bottom, bottom + 1);
+}
+
+/* Owner only: the most recently pushed task, DEQUE_EMPTY if none */
+static long deque_pop(deque_t *deque)
+{
+    long bottom = ATOMIC_RELAXED_LOAD(&deque->bottom) - 1;
+    long top, task;
+
+    ATOMIC_RELAXED_STORE(&deque->bottom, bottom);
+    FENCE();
+    top = ATOMIC_RELAXED_LOAD(&deque->top);
+
+    if (top > bottom) {
+	ATOMIC_RELAXED_STORE(&deque->bottom, bottom + 1);
+	return DEQUE_EMPTY;
+    }
+
+    task = ATOMIC_RELAXED_LOAD(&deque->tasks[bottom & (deque->capacity - 1)]);
+    if (top == bottom) {
+	/* The last task, race the thieves for it */
+	if (!ATOMIC_CAS(&deque->top, &top, top + 1))
+	    task = DEQUE_EMPTY;
+	ATOMIC_RELAXED_STORE(&deque->bottom, bottom + 1);
+    }
+    return task;
+}
+
+/* Any thread: the oldest task, DEQUE_EMPTY or DEQUE_ABORT */
+static long deque_steal(deque_t *deque)
+{
+    long top = ATOMIC_LOAD(&deque->top);
+    long bottom, task;
+
+    FENCE();
+    bottom = ATOMIC_LOAD(&deque->bottom);
+    if (top >= bottom)
+	return DEQUE_EMPTY;
+
+    task = ATOMIC_RELAXED_LOAD(&deque->tasks[top & (deque->capacity - 1)]);
+    if (!ATOMIC_CAS(&deque->top, &top, top + 1))
+	return DEQUE_ABORT;
+    return task;
+}
+
+/* Next task for worker index, from its own deque or stolen from the others
+ * starting after it.  DEQUE_EMPTY once there is no task left anywhere. */
+static long next_task(worker_pool_t *pool, int index)
+{
+    long task;
+    int i, contended;
+
+    if ((task = deque_pop(&pool->deques[index])) != DEQUE_EMPTY)
+	return task;
+
+    do {
+	contended = 0;
+	for (i = 1; i < pool->threads; i++) {
+	    task = deque_steal(&pool->deques[(index + i) % pool->threads]);
+	    if (task >= 0)
+		return task;
+	    if (task == DEQUE_ABORT)
+		contended = 1;
+	}
+    } while (contended);
+
+    return DEQUE_EMPTY;
+}
+
+static void *worker_main(void *ptr)
+{
+    worker_t *worker = ptr;
+    worker_pool_t *pool = worker->pool;
+    unsigned long seen = 0;
+    long task;
+
+    for (;;) {
+	pthread_mutex_lock(&pool->lock);
+	if (++pool->idle == pool->threads)
+	    pthread_cond_signal(&pool->finished);
+	while (!pool->stop && pool->generation == seen)
+	    pthread_cond_wait(&pool->wakeup, &pool->lock);
+	if (pool->stop) {
+	    pthread_mutex_unlock(&pool->lock);
+	    break;
+	}
+	seen = pool->generation;
+	pthread_mutex_unlock(&pool->lock);
+
+	/* An interrupt leaves the remaining tasks in the deques */
+	while (!INTERRUPTED(pool->interrupted) && (task = next_task(pool, worker->index)) != DEQUE_EMPTY)
+	    pool->func(pool->arg, task);
+    }
+
+    return NULL;
+}
+
+static void worker_pool_stop(worker_pool_t *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->started; i++)
+	pthread_join(pool->workers[i].thread, NULL);
+}
+
+worker_pool_t *worker_pool_new(int threads, char *error)
+{
+    worker_pool_t *pool;
+    sigset_t all, saved;
+    int i;
+
+    if (threads < 1 || threads > WORKER_POOL_MAX_THREADS) {
+	SET_ERROR("Number of threads is out of range");
+	return NULL;
+    }
+
+    if (!(pool = OPENSSL_malloc(sizeof(worker_pool_t)))) {
+	SET_ERROR("Failed to allocate memory for worker pool");
+	return NULL;
+    }
+    memset(pool, 0, sizeof(worker_pool_t));
+    pool->threads = threads;
+    pool->pid = getpid();
+
+    pool->workers = OPENSSL_malloc(threads * sizeof(worker_t));
+    pool->deques = OPENSSL_malloc(threads * sizeof(deque_t));
+    if (!pool->workers || !pool->deques) {
+	SET_ERROR("Failed to allocate memory for worker pool");
+	goto err;
+    }
+    memset(pool->deques, 0, threads * sizeof(deque_t));
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wakeup, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+    pthread_cond_init(&pool->available, NULL);
+
+    /* Signals are for the Ruby threads, keep them off the workers */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    for (i = 0; i < threads; i++) {
+	pool->workers[i].pool = pool;
+	pool->workers[i].index = i;
+	if (pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]) != 0)
+	    break;
+	pool->started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    if (pool->started != threads) {
+	SET_ERROR("Failed to start worker threads");
+	worker_pool_stop(pool);
+	pthread_cond_destroy(&pool->available);
+	pthread_cond_destroy(&pool->finished);
+	pthread_cond_destroy(&pool->wakeup);
+	pthread_mutex_destroy(&pool->lock);
+	goto err;
+    }
+
+    return pool;
+
+  err:
+    if (pool->workers)
+	OPENSSL_free(pool->workers);
+    if (pool->deques)
+	OPENSSL_free(pool->deques);
+    OPENSSL_free(pool);
+    return NULL;
+}
+
+/* Must not be called while a job runs */
+void worker_pool_free(worker_pool_t *pool)
+{
+    int i;
+
+    if (!pool)
+	return;
+
+    if (pool->pid == getpid())
+	worker_pool_stop(pool);
+    pthread_cond_destroy(&pool->available);
+    pthread_cond_destroy(&pool->finished);
+    pthread_cond_destroy(&pool->wakeup);
+    pthread_mutex_destroy(&pool->lock);
+
+    for (i = 0; i < pool->threads; i++) {
+	if (pool->deques[i].tasks)
+	    OPENSSL_free(pool->deques[i].tasks);
+    }
+    OPENSSL_free(pool->deques);
+    OPENSSL_free(pool->workers);
+    OPENSSL_free(pool);
+}
+
+int worker_pool_threads(const worker_pool_t *pool)
+{
+    return pool->threads;
+}
+
+/* Gives every deque room for at least length tasks */
+static int reserve_deques(worker_pool_t *pool, long length)
+{
+    size_t capacity;
+    int i;
+
+    for (capacity = 1; capacity < (size_t)length; capacity <<= 1)
+	;
+
+    for (i = 0; i < pool->threads; i++) {
+	deque_t *deque = &pool->deques[i];
+
+	deque->top = deque->bottom = 0;
+	if (deque->capacity >= capacity)
+	    continue;
+	if (deque->tasks)
+	    OPENSSL_free(deque->tasks);
+	if (!(deque->tasks = OPENSSL_malloc(capacity * sizeof(long)))) {
+	    deque->capacity = 0;
+	    return 0;
+	}
+	deque->capacity = capacity;
+    }
+    return 1;
+}
+
+/* Runs func(arg, task) for every task in [0, count) on the workers and
+ * returns once they are idle again, which without an interrupt means all
+ * tasks are done; with one, some tasks may not have run.  Jobs submitted
+ * from several threads run one after the other.  Returns 0, running
+ * nothing, if the pool cannot be used in this process or runs out of
+ * memory, or if the caller is interrupted while it waits for the job
+ * before its own; see worker_pool_interrupt(). */
+int worker_pool_run(worker_pool_t *pool, void (*func)(void *arg, long task), void *arg, long count, const volatile int *interrupted)
+{
+    long per_worker, task;
+    int i, ok = 1;
+
+    if (pool->pid != getpid())
+	return 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy && !INTERRUPTED(interrupted))
+	pthread_cond_wait(&pool->available, &pool->lock);
+    if (pool->busy) {
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+    }
+    pool->busy = 1;
+    /* The workers are idle now, so the deques are ours to fill */
+    while (pool->idle < pool->threads)
+	pthread_cond_wait(&pool->finished, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    per_worker = (count + pool->threads - 1) / pool->threads;
+    if (!reserve_deques(pool, per_worker)) {
+	ok = 0;
+	goto end;
+    }
+    /* Contiguous blocks, pushed backwards so that each worker pops its
+     * block from the front and thieves take from its far end */
+    for (i = 0; i < pool->threads; i++) {
+	long begin = i * per_worker, end = begin + per_worker;
+
+	if (end > count)
+	    end = count;
+	for (task = end - 1; task >= begin; task--)
+	    deque_push(&pool->deques[i], task);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->func = func;
+    pool->arg = arg;
+    pool->interrupted = interrupted;
+    pool->idle = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wakeup);
+    while (pool->idle < pool->threads)
+	pthread_cond_wait(&pool->finished, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+  end:
+    pthread_mutex_lock(&pool->lock);
+    pool->busy = 0;
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+    return ok;
+}
+
+/* Wakes the callers of worker_pool_run() that wait for the pool, so that
+ * those whose interrupted flag was set beforehand give up waiting.  The
+ * others go back to sleep. */
+void worker_pool_interrupt(worker_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+worker_pool_t *worker_pool_new(int threads, char *error)
+{
+    SET_ERROR("Worker pool needs pthreads");
+    return NULL;
+}
+
+void worker_pool_free(worker_pool_t *pool)
+{
+}
+
+int worker_pool_threads(const worker_pool_t *pool)
+{
+    return 0;
+}
+
+int worker_pool_run(worker_pool_t *pool, void (*func)(void *arg, long task), void *arg, long count, const volatile int *interrupted)
+{
+    return 0;
+}
+
+void worker_pool_interrupt(worker_pool_t *pool)
+{
+}
+
+#endif /* HAVE_PTHREAD_H */
@@ -0,0 +1,124 @@
+/**
+ * @file x25519.c
+ *
+ * @brief The KEM of OpenSSL::PKey::IES: ECDH on X25519 through EVP_PKEY.
+ *
+ * X25519 keys and points are 32 fixed bytes, so the ephemeral public key is
+ * stored as is, with nothing to compress, decompress or validate: every
+ * string of 32 bytes is a usable u-coordinate, and OpenSSL fails the derive
+ * when a small-order point makes the shared secret all zero.  The secret
+ * then goes through the same KDF and DEM as the ECIES suites.
+ *
+ * The contexts that can be reused live in the scratch state of the thread:
+ * one for key generation, and on the receiving side one for deriving with
+ * the private key of the last recipient, which is made again when another
+ * recipient comes along.  Like the cached points of scratch.c, it keeps a
+ * reference to that key until then or until the thread exits.  A derive
+ * context is bound to its own key, so the sender makes one per ephemeral
+ * key.
+ *
+ * Raw X25519 keys came with OpenSSL 1.1.1; with older versions both
+ * functions fail.
+ */
+
+#include "ies.h"
+
+#ifdef HAVE_EVP_PKEY_GET_RAW_PUBLIC_KEY
+
+/* The sending side: a new ephemeral key, its public key into key_octets and
+ * the shared secret with the recipient into secret */
+int x25519_sender_secret(const ies_ctx_t *ctx, scratch_t *scratch, unsigned char *key_octets, unsigned char *secret, char *error)
+{
+    EVP_PKEY *ephemeral = NULL;
+    EVP_PKEY_CTX *derive = NULL;
+    size_t length;
+    int ok = 0;
+
+    if (!scratch->x25519_keygen) {
+	if (!(scratch->x25519_keygen = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, NULL))
+	    || EVP_PKEY_keygen_init(scratch->x25519_keygen) != 1) {
+	    SET_OSSL_ERROR("Failed to set up key generation");
+	    EVP_PKEY_CTX_free(scratch->x25519_keygen);
+	    scratch->x25519_keygen = NULL;
+	    return 0;
+	}
+    }
+
+    if (EVP_PKEY_keygen(scratch->x25519_keygen, &ephemeral) != 1) {
+	SET_OSSL_ERROR("Failed to generate ephemeral key");
+	goto end;
+    }
+    length = X25519_KEY_LENGTH;
+    if (EVP_PKEY_get_raw_public_key(ephemeral, key_octets, &length) != 1 || length != X25519_KEY_LENGTH) {
+	SET_OSSL_ERROR("Error while recording the public portion of the envelope key");
+	goto end;
+    }
+
+    length = X25519_KEY_LENGTH;
+    if (!(derive = EVP_PKEY_CTX_new(ephemeral, NULL))
+	|| EVP_PKEY_derive_init(derive) != 1
+	|| EVP_PKEY_derive_set_peer(derive, ctx->x25519_key) != 1
+	|| EVP_PKEY_derive(derive, secret, &length) != 1
+	|| length != X25519_KEY_LENGTH) {
+	SET_OSSL_ERROR("An error occurred while computing the shared secret");
+	goto end;
+    }
+    ok = 1;
+
+  end:
+    EVP_PKEY_CTX_free(derive);
+    EVP_PKEY_free(ephemeral);
+    return ok;
+}
+
+/* The receiving side: the shared secret of the private key with the
+ * ephemeral public key in octets */
+int x25519_receiver_secret(const ies_ctx_t *ctx, scratch_t *scratch, const unsigned char *octets, size_t length, unsigned char *secret, char *error)
+{
+    EVP_PKEY *ephemeral;
+    size_t secret_length = X25519_KEY_LENGTH;
+    int ok = 0;
+
+    if (!scratch->x25519_derive || EVP_PKEY_CTX_get0_pkey(scratch->x25519_derive) != ctx->x25519_key) {
+	EVP_PKEY_CTX_free(scratch->x25519_derive);
+	if (!(scratch->x25519_derive = EVP_PKEY_CTX_new(ctx->x25519_key, NULL))
+	    || EVP_PKEY_derive_init(scratch->x25519_derive) != 1) {
+	    SET_OSSL_ERROR("Failed to set up key agreement");
+	    EVP_PKEY_CTX_free(scratch->x25519_derive);
+	    scratch->x25519_derive = NULL;
+	    return 0;
+	}
+    }
+
+    if (!(ephemeral = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, octets, length))) {
+	SET_OSSL_ERROR("Failed to read the ephemeral key");
+	return 0;
+    }
+    if (EVP_PKEY_derive_set_peer(scratch->x25519_derive, ephemeral) != 1
+	|| EVP_PKEY_derive(scratch->x25519_derive, secret, &secret_length) != 1
+	|| secret_length != X25519_KEY_LENGTH) {
+	SET_OSSL_ERROR("An error occurred while computing the shared secret");
+	goto end;
+    }
+    ok = 1;
+
+  end:
+    EVP_PKEY_free(ephemeral);
+    return ok;
+}
+
+#else /* OpenSSL before 1.1.1 */
+
+int x25519_sender_secret(const ies_ctx_t *ctx, scratch_t *scratch, unsigned char *key_octets, unsigned char *secret, char *error)
+{
+    SET_ERROR("X25519 needs OpenSSL 1.1.1");
+    return 0;
+}
+
+int x25519_receiver_secret(const ies_ctx_t *ctx, scratch_t *scratch, const unsigned char *octets, size_t length, unsigned char *secret, char *error)
+{
+    SET_ERROR("X25519 needs OpenSSL 1.1.1");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,549 @@
+/**
+ * @file xladder.c
+ *
+ * @brief The receiving side of ECDH on x-coordinates alone, for prime
+ * curves whose arithmetic OpenSSL only has in generic form.
+ *
+ * The shared secret is the x-coordinate of d * R, which does not depend on
+ * the sign of the y-coordinate of the ephemeral point R.  So instead of
+ * decompressing R, which costs a modular square root, and multiplying it
+ * through EC_POINT_mul, the x-coordinate from the cryptogram goes straight
+ * into a Montgomery ladder on projective (X : Z) coordinates with the
+ * differential addition and doubling formulas of Brier and Joye for
+ * y^2 = x^3 + ax + b (PKC 2002).  That R is on the curve is checked without
+ * y too, by x^3 + ax + b being a square (Euler's criterion).  Only curves of
+ * prime order are taken, where every point of the curve other than
+ * infinity generates the whole group, so this is all the validation R
+ * needs; an x from the twist is rejected by the criterion.
+ *
+ * The field arithmetic is Montgomery multiplication on up to
+ * XLADDER_MAX_LIMBS 64-bit limbs, enough for P-521, with no branch on or
+ * memory access indexed by a secret: the ladder runs for the same number
+ * of steps for every scalar (d plus n or 2n, which has its top bit fixed,
+ * as in OpenSSL's own ladder), swaps with masks, and inverts Z by Fermat's
+ * little theorem.  It needs __SIZEOF_INT128__; without, xladder_new()
+ * returns NULL and decryption stays with OpenSSL.
+ */
+
+#include "ies.h"
+
+#ifdef __SIZEOF_INT128__
+
+typedef unsigned __int128 u128;
+typedef uint64_t fe_t[XLADDER_MAX_LIMBS];	/* little-endian limbs */
+
+/* The field arithmetic takes the number of limbs as an argument, which is
+ * a constant once inlined into a ladder step; the extension builds with
+ * -O2, which does not unroll loops by itself, so the loops over limbs ask
+ * for it */
+#define FE_INLINE static inline __attribute__((always_inline))
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 8
+#define FE_UNROLL _Pragma("GCC unroll 9")
+#elif defined(__clang__)
+#define FE_UNROLL _Pragma("clang loop unroll(full)")
+#else
+#define FE_UNROLL
+#endif
+
+struct xladder_st {
+    int limbs;
+    size_t field_bytes;
+    uint64_t n0;		/* -p^-1 mod 2^64 */
+    fe_t p;
+    fe_t rr;			/* 2^(128 * limbs) mod p */
+    fe_t one;			/* Montgomery forms from here on */
+    fe_t a;
+    fe_t b;
+    fe_t b4;
+    fe_t b8;
+    fe_t p_minus_2;		/* exponents, plain */
+    fe_t p_half;		/* (p - 1) / 2 */
+    uint64_t k[XLADDER_MAX_LIMBS + 1];	/* d + n or d + 2n */
+    int k_bits;
+};
+
+FE_INLINE void fe_copy(const xladder_t *f, const int n, fe_t r, const fe_t a)
+{
+    memcpy(r, a, n * sizeof(uint64_t));
+}
+
+FE_INLINE void fe_cswap(const xladder_t *f, const int n, fe_t a, fe_t b, uint64_t mask)
+{
+    uint64_t t;
+    int i;
+
+    FE_UNROLL
+    for (i = 0; i < n; i++) {
+	t = mask & (a[i] ^ b[i]);
+	a[i] ^= t;
+	b[i] ^= t;
+    }
+}
+
+FE_INLINE uint64_t fe_is_zero(const xladder_t *f, const int n, const fe_t a)
+{
+    uint64_t bits = 0;
+    int i;
+
+    FE_UNROLL
+    for (i = 0; i < n; i++)
+	bits |= a[i];
+    return (uint64_t)0 - (((bits | ((uint64_t)0 - bits)) >> 63) ^ 1);
+}
+
+/* r = t - p if that does not borrow, else t, where t = top * 2^(64 *
+ * limbs) + t[0..limbs) */
+FE_INLINE void fe_reduce_once(const xladder_t *f, const int n, fe_t r, const uint64_t *t, uint64_t top)
+{
+    uint64_t s[XLADDER_MAX_LIMBS], borrow = 0, mask;
+    int i;
+
+    FE_UNROLL
+    for (i = 0; i < n; i++) {
+	u128 d = (u128)t[i] - f->p[i] - borrow;
+
+	s[i] = (uint64_t)d;
+	borrow = (uint64_t)(d >> 64) & 1;
+    }
+    borrow = (top < borrow);
+    mask = (uint64_t)0 - borrow;
+    FE_UNROLL
+    for (i = 0; i < n; i++)
+	r[i] = (t[i] & mask) | (s[i] & ~mask);
+}
+
+FE_INLINE void fe_add(const xladder_t *f, const int n, fe_t r, const fe_t a, const fe_t b)
+{
+    uint64_t t[XLADDER_MAX_LIMBS], carry = 0;
+    int i;
+
+    FE_UNROLL
+    for (i = 0; i < n; i++) {
+	u128 s = (u128)a[i] + b[i] + carry;
+
+	t[i] = (uint64_t)s;
+	carry = (uint64_t)(s >> 64);
+    }
+    fe_reduce_once(f, n, r, t, carry);
+}
+
+FE_INLINE void fe_sub(const xladder_t *f, const int n, fe_t r, const fe_t a, const fe_t b)
+{
+    uint64_t borrow = 0, carry = 0, mask;
+    int i;
+
+    FE_UNROLL
+    for (i = 0; i < n; i++) {
+	u128 d = (u128)a[i] - b[i] - borrow;
+
+	r[i] = (uint64_t)d;
+	borrow = (uint64_t)(d >> 64) & 1;
+    }
+    /* add p back if it borrowed */
+    mask = (uint64_t)0 - borrow;
+    FE_UNROLL
+    for (i = 0; i < n; i++) {
+	u128 s = (u128)r[i] + (f->p[i] & mask) + carry;
+
+	r[i] = (uint64_t)s;
+	carry = (uint64_t)(s >> 64);
+    }
+}
+
+/* r = a * b / 2^(64 * limbs) mod p, word by word (CIOS) */
+FE_INLINE void fe_mul(const xladder_t *f, const int n, fe_t r, const fe_t a, const fe_t b)
+{
+    uint64_t t[XLADDER_MAX_LIMBS + 2];
+    int i, j;
+
+    memset(t, 0, sizeof(t));
+    FE_UNROLL
+    for (i = 0; i < n; i++) {
+	uint64_t carry = 0, m;
+	u128 c;
+
+	FE_UNROLL
+	for (j = 0; j < n; j++) {
+	    c = (u128)a[j] * b[i] + t[j] + carry;
+	    t[j] = (uint64_t)c;
+	    carry = (uint64_t)(c >> 64);
+	}
+	c = (u128)t[n] + carry;
+	t[n] = (uint64_t)c;
+	t[n + 1] = (uint64_t)(c >> 64);
+
+	m = t[0] * f->n0;
+	c = (u128)m * f->p[0] + t[0];
+	carry = (uint64_t)(c >> 64);
+	FE_UNROLL
+	for (j = 1; j < n; j++) {
+	    c = (u128)m * f->p[j] + t[j] + carry;
+	    t[j - 1] = (uint64_t)c;
+	    carry = (uint64_t)(c >> 64);
+	}
+	c = (u128)t[n] + carry;
+	t[n - 1] = (uint64_t)c;
+	t[n] = t[n + 1] + (uint64_t)(c >> 64);
+    }
+    fe_reduce_once(f, n, r, t, t[n]);
+}
+
+FE_INLINE void fe_sqr(const xladder_t *f, const int n, fe_t r, const fe_t a)
+{
+    fe_mul(f, n, r, a, a);
+}
+
+/* r = a^e for a public exponent e, four bits at a time */
+FE_INLINE void fe_pow(const xladder_t *f, const int n, fe_t r, const fe_t a, const fe_t e)
+{
+    fe_t table[16], acc;
+    int i, j, started = 0;
+
+    fe_copy(f, n, table[0], f->one);
+    fe_copy(f, n, table[1], a);
+    for (i = 2; i < 16; i++)
+	fe_mul(f, n, table[i], table[i - 1], a);
+
+    fe_copy(f, n, acc, f->one);
+    for (i = 16 * n - 1; i >= 0; i--) {
+	unsigned int nibble = (unsigned int)(e[i / 16] >> (4 * (i % 16))) & 15;
+
+	if (started) {
+	    for (j = 0; j < 4; j++)
+		fe_sqr(f, n, acc, acc);
+	}
+	if (nibble) {
+	    fe_mul(f, n, acc, acc, table[nibble]);
+	    started = 1;
+	}
+    }
+    fe_copy(f, n, r, acc);
+    OPENSSL_cleanse(table, sizeof(table));
+}
+
+/* Big-endian bytes, as many as the field has, to limbs.  Returns 1 if the
+ * value is less than p. */
+static int fe_from_bytes(const xladder_t *f, fe_t r, const unsigned char *in)
+{
+    uint64_t borrow = 0;
+    size_t i;
+
+    memset(r, 0, sizeof(fe_t));
+    for (i = 0; i < f->field_bytes; i++) {
+	size_t bit = 8 * (f->field_bytes - 1 - i);
+
+	r[bit / 64] |= (uint64_t)in[i] << (bit % 64);
+    }
+    for (i = 0; i < (size_t)f->limbs; i++) {
+	u128 d = (u128)r[i] - f->p[i] - borrow;
+
+	borrow = (uint64_t)(d >> 64) & 1;
+    }
+    return (int)borrow;
+}
+
+static void fe_to_bytes(const xladder_t *f, unsigned char *out, const fe_t a)
+{
+    size_t i;
+
+    for (i = 0; i < f->field_bytes; i++) {
+	size_t bit = 8 * (f->field_bytes - 1 - i);
+
+	out[i] = (unsigned char)(a[bit / 64] >> (bit % 64));
+    }
+}
+
+/* Non-negative bn below 2^(64 * limbs) to limbs */
+static int bn_to_limbs(const BIGNUM *bn, uint64_t *r, int limbs)
+{
+    unsigned char bytes[8 * (XLADDER_MAX_LIMBS + 1)];
+    const int length = BN_num_bytes(bn);
+    int i, j;
+
+    if (BN_is_negative(bn) || length > 8 * limbs)
+	return 0;
+    memset(bytes, 0, 8 * limbs - length);
+    BN_bn2bin(bn, bytes + 8 * limbs - length);
+    for (i = 0; i < limbs; i++) {
+	r[i] = 0;
+	for (j = 0; j < 8; j++)
+	    r[i] = (r[i] << 8) | bytes[8 * (limbs - 1 - i) + j];
+    }
+    OPENSSL_cleanse(bytes, sizeof(bytes));
+    return 1;
+}
+
+/* Montgomery form of bn * 2^shift, a field element, in BIGNUM arithmetic,
+ * as the field arithmetic here is only unrolled for a constant limb
+ * count */
+static int bn_to_fe(const xladder_t *f, const BIGNUM *bn, int shift, const BIGNUM *p, BIGNUM *t, BN_CTX *bn_ctx, fe_t r)
+{
+    return BN_lshift(t, bn, 64 * f->limbs + shift)
+	&& BN_mod(t, t, p, bn_ctx)
+	&& bn_to_limbs(t, r, f->limbs);
+}
+
+/* (X2 : Z2) = 2 * (X : Z) */
+FE_INLINE void xdbl(const xladder_t *f, const int n, fe_t x2, fe_t z2, const fe_t x, const fe_t z)
+{
+    fe_t s1, s2, as2, t, u, v;
+
+    fe_sqr(f, n, s1, x);
+    fe_sqr(f, n, s2, z);
+    fe_mul(f, n, as2, f->a, s2);
+    fe_mul(f, n, t, x, z);
+    /* Z2 = 4 * (X * Z * (X^2 + a * Z^2) + b * Z^4) */
+    fe_add(f, n, u, s1, as2);
+    fe_mul(f, n, u, t, u);
+    fe_sqr(f, n, v, s2);
+    fe_mul(f, n, v, f->b, v);
+    fe_add(f, n, u, u, v);
+    fe_add(f, n, u, u, u);
+    /* X2 = (X^2 - a * Z^2)^2 - 8 * b * X * Z^3 */
+    fe_mul(f, n, t, t, s2);
+    fe_mul(f, n, t, f->b8, t);
+    fe_sub(f, n, s1, s1, as2);
+    fe_sqr(f, n, s1, s1);
+    fe_sub(f, n, x2, s1, t);
+    fe_add(f, n, z2, u, u);
+}
+
+/* (X3 : Z3) = (X1 : Z1) + (X2 : Z2), whose difference has the affine
+ * x-coordinate xd */
+FE_INLINE void xadd(const xladder_t *f, const int n, fe_t x3, fe_t z3, const fe_t x1, const fe_t z1, const fe_t x2, const fe_t z2, const fe_t xd)
+{
+    fe_t t1, t2, t3, t4, u;
+
+    fe_mul(f, n, t1, x1, x2);
+    fe_mul(f, n, t2, z1, z2);
+    fe_mul(f, n, t3, x1, z2);
+    fe_mul(f, n, t4, x2, z1);
+    /* X3 = (X1 X2 - a Z1 Z2)^2 - 4 b Z1 Z2 (X1 Z2 + X2 Z1) */
+    fe_mul(f, n, u, f->a, t2);
+    fe_sub(f, n, t1, t1, u);
+    fe_sqr(f, n, t1, t1);
+    fe_mul(f, n, t2, f->b4, t2);
+    fe_add(f, n, u, t3, t4);
+    fe_mul(f, n, t2, t2, u);
+    /* Z3 = xd (X1 Z2 - X2 Z1)^2 */
+    fe_sub(f, n, t3, t3, t4);
+    fe_sqr(f, n, t3, t3);
+    fe_mul(f, n, z3, xd, t3);
+    fe_sub(f, n, x3, t1, t2);
+}
+
+/* Frees what xladder_new() made, wiping the scalar */
+void xladder_free(xladder_t *ladder)
+{
+    OPENSSL_cleanse(ladder, sizeof(xladder_t));
+    OPENSSL_free(ladder);
+}
+
+size_t xladder_memsize(const xladder_t *ladder)
+{
+    return sizeof(xladder_t);
+}
+
+/* The ladder for the private key d on group, a curve of prime order on a
+ * prime field.  Returns NULL if the field is too large or on failure. */
+xladder_t *xladder_new(const EC_GROUP *group, const BIGNUM *order, const BIGNUM *d)
+{
+    xladder_t *f = NULL;
+    BN_CTX *bn_ctx;
+    BIGNUM *p, *a, *b, *k, *rr;
+    uint64_t inverse;
+    int ok = 0, i;
+
+    if (!(bn_ctx = BN_CTX_new()))
+	return NULL;
+    BN_CTX_start(bn_ctx);
+    p = BN_CTX_get(bn_ctx);
+    a = BN_CTX_get(bn_ctx);
+    b = BN_CTX_get(bn_ctx);
+    k = BN_CTX_get(bn_ctx);
+    if (!(rr = BN_CTX_get(bn_ctx))
+	|| !EC_GROUP_get_curve_GFp(group, p, a, b, bn_ctx)
+	|| BN_num_bits(p) <= 64
+	|| BN_num_bits(p) > 64 * XLADDER_MAX_LIMBS
+	|| !BN_is_odd(p)
+	|| !(f = OPENSSL_malloc(sizeof(xladder_t))))
+	goto end;
+    memset(f, 0, sizeof(xladder_t));
+
+    f->limbs = (BN_num_bits(p) + 63) / 64;
+    f->field_bytes = BN_num_bytes(p);
+    if (!bn_to_limbs(p, f->p, f->limbs))
+	goto end;
+    /* -p^-1 mod 2^64 by Newton's iteration, each step doubling the bits */
+    inverse = f->p[0];
+    for (i = 0; i < 6; i++)
+	inverse *= 2 - f->p[0] * inverse;
+    f->n0 = (uint64_t)0 - inverse;
+
+    BN_zero(rr);
+    if (!BN_set_bit(rr, 128 * f->limbs)
+	|| !BN_mod(rr, rr, p, bn_ctx)
+	|| !bn_to_limbs(rr, f->rr, f->limbs)
+	|| !BN_one(k)
+	|| !bn_to_fe(f, k, 0, p, rr, bn_ctx, f->one)
+	|| !bn_to_fe(f, a, 0, p, rr, bn_ctx, f->a)
+	|| !bn_to_fe(f, b, 0, p, rr, bn_ctx, f->b)
+	|| !bn_to_fe(f, b, 2, p, rr, bn_ctx, f->b4)
+	|| !bn_to_fe(f, b, 3, p, rr, bn_ctx, f->b8))
+	goto end;
+
+    if (!BN_rshift1(k, p)
+	|| !bn_to_limbs(k, f->p_half, f->limbs)
+	|| !BN_copy(k, p)
+	|| !BN_sub_word(k, 2)
+	|| !bn_to_limbs(k, f->p_minus_2, f->limbs))
+	goto end;
+
+    /* d + n, or d + 2n if that is a bit short, so that the top bit of the
+     * scalar is always at the same place */
+    if (!BN_add(k, d, order)
+	|| (BN_num_bits(k) <= BN_num_bits(order) && !BN_add(k, k, order))
+	|| !bn_to_limbs(k, f->k, XLADDER_MAX_LIMBS + 1))
+	goto end;
+    f->k_bits = BN_num_bits(k);
+    ok = 1;
+
+  end:
+    BN_clear(k);
+    BN_CTX_end(bn_ctx);
+    BN_CTX_free(bn_ctx);
+    if (!ok && f) {
+	xladder_free(f);
+	f = NULL;
+    }
+    return f;
+}
+
+/* xladder_shared_secret() on n limbs.  Instantiated once per limb count
+ * below, with a ladder step of its own that is called rather than inlined:
+ * inlined into one large function, the field arithmetic is no longer
+ * unrolled. */
+typedef void ladder_step_t(const xladder_t *f, fe_t x0, fe_t z0, fe_t x1, fe_t z1, const fe_t x);
+
+FE_INLINE int shared_secret(const xladder_t *f, const int n, ladder_step_t *step, const unsigned char *octets, unsigned char *x_out)
+{
+    fe_t x, rhs, x0, z0, x1, z1;
+    uint64_t swap = 0, bit;
+    int i, ok = 0;
+
+    if (!fe_from_bytes(f, x, octets + 1))
+	return 0;
+    fe_mul(f, n, x, x, f->rr);
+
+    /* on the curve if x^3 + ax + b is a non-zero square; R is public, and
+     * so is whether this fails */
+    fe_sqr(f, n, rhs, x);
+    fe_add(f, n, rhs, rhs, f->a);
+    fe_mul(f, n, rhs, rhs, x);
+    fe_add(f, n, rhs, rhs, f->b);
+    fe_pow(f, n, rhs, rhs, f->p_half);
+    for (i = 0; i < n; i++) {
+	if (rhs[i] != f->one[i])
+	    return 0;
+    }
+
+    fe_copy(f, n, x0, x);
+    fe_copy(f, n, z0, f->one);
+    xdbl(f, n, x1, z1, x0, z0);
+    for (i = f->k_bits - 2; i >= 0; i--) {
+	bit = (uint64_t)0 - ((f->k[i / 64] >> (i % 64)) & 1);
+	fe_cswap(f, n, x0, x1, swap ^ bit);
+	fe_cswap(f, n, z0, z1, swap ^ bit);
+	swap = bit;
+	step(f, x0, z0, x1, z1, x);
+    }
+    fe_cswap(f, n, x0, x1, swap);
+    fe_cswap(f, n, z0, z1, swap);
+
+    /* infinity, which d * R of a point of prime order never is */
+    if (!fe_is_zero(f, n, z0)) {
+	fe_pow(f, n, z0, z0, f->p_minus_2);
+	fe_mul(f, n, x0, x0, z0);
+	/* out of Montgomery form */
+	memset(z0, 0, sizeof(z0));
+	z0[0] = 1;
+	fe_mul(f, n, x0, x0, z0);
+	fe_to_bytes(f, x_out, x0);
+	ok = 1;
+    }
+
+    OPENSSL_cleanse(x0, sizeof(x0));
+    OPENSSL_cleanse(z0, sizeof(z0));
+    OPENSSL_cleanse(x1, sizeof(x1));
+    OPENSSL_cleanse(z1, sizeof(z1));
+    return ok;
+}
+
+#define SHARED_SECRET_ON(limbs) \
+    static void ladder_step_##limbs(const xladder_t *f, fe_t x0, fe_t z0, fe_t x1, fe_t z1, const fe_t x) \
+    { \
+	xadd(f, limbs, x1, z1, x0, z0, x1, z1, x); \
+	xdbl(f, limbs, x0, z0, x0, z0); \
+    } \
+    static int shared_secret_##limbs(const xladder_t *f, const unsigned char *octets, unsigned char *x_out) \
+    { \
+	return shared_secret(f, limbs, ladder_step_##limbs, octets, x_out); \
+    }
+SHARED_SECRET_ON(2)
+SHARED_SECRET_ON(3)
+SHARED_SECRET_ON(4)
+SHARED_SECRET_ON(5)
+SHARED_SECRET_ON(6)
+SHARED_SECRET_ON(7)
+SHARED_SECRET_ON(8)
+SHARED_SECRET_ON(9)
+
+/* The x-coordinate of d * R into x_out, field_bytes long, for the compressed
+ * point R in octets.  Returns 0 if R is not a point on the curve. */
+int xladder_shared_secret(const xladder_t *f, const unsigned char *octets, size_t length, unsigned char *x_out)
+{
+    if (length != 1 + f->field_bytes || (octets[0] != 2 && octets[0] != 3))
+	return 0;
+
+    switch (f->limbs) {
+    case 2:
+	return shared_secret_2(f, octets, x_out);
+    case 3:
+	return shared_secret_3(f, octets, x_out);
+    case 4:
+	return shared_secret_4(f, octets, x_out);
+    case 5:
+	return shared_secret_5(f, octets, x_out);
+    case 6:
+	return shared_secret_6(f, octets, x_out);
+    case 7:
+	return shared_secret_7(f, octets, x_out);
+    case 8:
+	return shared_secret_8(f, octets, x_out);
+    default:
+	return shared_secret_9(f, octets, x_out);
+    }
+}
+
+#else /* no 128-bit integers */
+
+xladder_t *xladder_new(const EC_GROUP *group, const BIGNUM *order, const BIGNUM *d)
+{
+    return NULL;
+}
+
+void xladder_free(xladder_t *ladder)
+{
+}
+
+size_t xladder_memsize(const xladder_t *ladder)
+{
+    return 0;
+}
+
+int xladder_shared_secret(const xladder_t *ladder, const unsigned char *octets, size_t length, unsigned char *x_out)
+{
+    return 0;
+}
+
+#endif
@@ -10,6 +10,11 @@ class TestIES < Minitest::Test
     @ec = OpenSSL::PKey::EC::IES.new(test_key, "placeholder")
   end
 
+  # EC.new(curve).generate_key fails on OpenSSL 3, where pkeys are immutable
+  def generate_pem(curve)
+    OpenSSL::PKey::EC.generate(curve).to_pem
+  end
+
   def test_ec_has_private_and_public_keys
     assert @ec.private_key?
     assert @ec.public_key?
@@ -21,4 +26,372 @@ class TestIES < Minitest::Test
     result = @ec.private_decrypt(cryptogram)
     assert_equal source, result.force_encoding('UTF-8')
   end
+
+  # Made with test_key.pem by an earlier version; guards the wire format
+  LEGACY_CRYPTOGRAM = %w[
+    028387ed746bf4848ba784657597ee0ca566c6eb520d55cc0b0959435acec590
+    3f5efc2c61cb60c4525413ff71bbd2ca2d6c7ee0f08ad765882909eaf3013bcd
+    4a3942fd62613d420e07b4dddd50ba2592c32214ce66b4c7c750f12d9a65d8b3
+    82f27666fb87898943ac97f9dfb9a71bd444c3ccccc1aaeddd8f419a80
+  ].join
+
+  def test_decrypt_legacy_cryptogram
+    assert_equal 'Cryptogram in the legacy wire format, made before the single-pass encryption.',
+                 @ec.private_decrypt([LEGACY_CRYPTOGRAM].pack('H*'))
+  end
+
+  def test_precomputed_public_key_interoperates
+    test_key = File.read(File.expand_path(File.join(__FILE__, '..', 'test_key.pem')))
+    precomputed = OpenSSL::PKey::EC::IES.new(test_key, "placeholder", precompute: 64 * 1024)
+    source = 'precomputed'
+    assert_equal source, @ec.private_decrypt(precomputed.public_encrypt(source))
+  end
+
+  def test_pool_hands_out_each_tuple_once
+    test_key = File.read(File.expand_path(File.join(__FILE__, '..', 'test_key.pem')))
+    pooled = OpenSSL::PKey::EC::IES.new(test_key, "placeholder", pool: { low: 2, high: 8 })
+    sleep 0.01 until pooled.pool_stats[:depth] >= 8
+    cryptograms = 20.times.map { pooled.public_encrypt('pooled') }
+    assert_equal 20, cryptograms.map { |c| c[0, 25] }.uniq.size
+    assert_equal ['pooled'] * 20, cryptograms.map { |c| @ec.private_decrypt(c) }
+    stats = pooled.pool_stats
+    assert_equal 20, stats[:consumed] + stats[:misses]
+    assert_operator stats[:consumed], :>=, 8
+    assert_nil @ec.pool_stats
+  end
+
+  def test_encrypt_then_decrypt_on_other_curves
+    %w[prime256v1 secp384r1 secp521r1].each do |curve|
+      pem = generate_pem(curve)
+      ies = OpenSSL::PKey::EC::IES.new(pem, "placeholder")
+      assert_equal curve, ies.private_decrypt(ies.public_encrypt(curve))
+    end
+  end
+
+  def test_decrypt_rejects_tampered_ephemeral_key
+    cryptogram = @ec.public_encrypt('tampered')
+    cryptogram.setbyte(0, 0)
+    assert_raises(OpenSSL::PKey::EC::IES::IESError) { @ec.private_decrypt(cryptogram) }
+  end
+
+  def test_decrypt_rejects_tampered_body
+    cryptogram = @ec.public_encrypt('t' * (200 * 1024))
+    cryptogram.setbyte(150 * 1024, cryptogram.getbyte(150 * 1024) ^ 1)
+    error = assert_raises(OpenSSL::PKey::EC::IES::IESError) { @ec.private_decrypt(cryptogram) }
+    assert_match(/MAC tag verification failed/, error.message)
+  end
+
+  def test_encrypt_then_decrypt_on_curve_with_cofactor
+    ies = OpenSSL::PKey::EC::IES.new(generate_pem('sect163k1'), "placeholder")
+    assert_equal 'cofactor', ies.private_decrypt(ies.public_encrypt('cofactor'))
+  end
+
+  def test_decrypt_rejects_truncated_cryptogram
+    assert_raises(OpenSSL::PKey::EC::IES::IESError) { @ec.private_decrypt('short') }
+  end
+
+  def test_encrypt_then_decrypt_block_aligned_text
+    source = 'a' * 64
+    assert_equal source, @ec.private_decrypt(@ec.public_encrypt(source))
+  end
+
+  def test_cipher_text_length
+    # P-192 compressed point, AES-128-CBC with padding, HMAC-SHA1
+    { 1 => 16, 15 => 16, 16 => 32, 17 => 32 }.each do |length, body|
+      assert_equal 25 + body + 20, @ec.public_encrypt('c' * length).bytesize
+    end
+  end
+
+  def test_decrypt_frozen_cryptogram_leaves_it_intact
+    cryptogram = @ec.public_encrypt('d' * 33).freeze
+    copy = cryptogram.dup
+    result = @ec.private_decrypt(cryptogram)
+    assert_equal 33, result.bytesize
+    assert_equal 'd' * 33, result
+    assert_equal copy, cryptogram
+  end
+
+  def test_suite_registry
+    suite = OpenSSL::PKey::EC::IES::Suite['ECIES-P256-AES128CBC-SHA256']
+    assert suite.frozen?
+    assert_same suite, OpenSSL::PKey::EC::IES::Suite.all.find { |s| s.name == suite.name }
+    assert_equal %w[prime256v1 AES-128-CBC SHA256 SHA256], [suite.curve, suite.cipher, suite.digest, suite.kdf_digest]
+    assert_nil OpenSSL::PKey::EC::IES::Suite['ECIES-NOPE']
+    assert_equal 'ECIES-AES128CBC-SHA1', @ec.suite.name
+  end
+
+  def test_encrypt_then_decrypt_with_suite
+    pem = generate_pem('prime256v1')
+    ies = OpenSSL::PKey::EC::IES.new(pem, 'ECIES-P256-AES128CBC-SHA256')
+    cryptogram = ies.public_encrypt('suite')
+    assert_equal 33 + 16 + 32, cryptogram.bytesize
+    assert_equal 'suite', ies.private_decrypt(cryptogram)
+    assert_same ies.suite, OpenSSL::PKey::EC::IES.new(pem, ies.suite).suite
+  end
+
+  def test_encrypt_then_decrypt_with_gcm_suite
+    pem = generate_pem('prime256v1')
+    ies = OpenSSL::PKey::EC::IES.new(pem, 'ECIES-P256-AES128GCM-SHA256')
+    assert_nil ies.suite.digest
+    source = 'g' * (128 * 1024 + 5)
+    cryptogram = ies.public_encrypt(source)
+    # compressed point, 96-bit nonce, unpadded body, 128-bit tag
+    assert_equal 33 + 12 + source.bytesize + 16, cryptogram.bytesize
+    assert_equal source, ies.private_decrypt(cryptogram)
+    cryptogram.setbyte(50, cryptogram.getbyte(50) ^ 1)
+    assert_raises(OpenSSL::PKey::EC::IES::IESError) { ies.private_decrypt(cryptogram) }
+  end
+
+  def test_encrypt_then_decrypt_with_chacha20_poly1305_suite
+    suite = OpenSSL::PKey::EC::IES::Suite['ECIES-P256-CHACHA20POLY1305-SHA256']
+    skip 'ChaCha20-Poly1305 needs OpenSSL 1.1' unless suite
+    ies = OpenSSL::PKey::EC::IES.new(generate_pem('prime256v1'), suite)
+    source = 'h' * (64 * 1024 + 7)
+    cryptogram = ies.public_encrypt(source)
+    assert_equal 33 + 12 + source.bytesize + 16, cryptogram.bytesize
+    assert_equal source, ies.private_decrypt(cryptogram)
+    cryptogram.setbyte(-1, cryptogram.getbyte(-1) ^ 1)
+    assert_raises(OpenSSL::PKey::EC::IES::IESError) { ies.private_decrypt(cryptogram) }
+  end
+
+  def test_suite_select_picks_an_available_candidate
+    policy = %w[ECIES-P256-AES128CBC-SHA256 ECIES-P256-AES128GCM-SHA256 ECIES-P256-CHACHA20POLY1305-SHA256 ECIES-P256-NOPE]
+    suite = OpenSSL::PKey::EC::IES::Suite.select(policy)
+    assert_includes policy, suite.name
+    assert_operator suite.throughput, :>, 0
+    assert_raises(OpenSSL::PKey::EC::IES::IESError) { OpenSSL::PKey::EC::IES::Suite.select(%w[ECIES-P256-NOPE]) }
+  end
+
+  def test_suite_must_exist_and_match_the_curve
+    pem = generate_pem('prime256v1')
+    assert_raises(OpenSSL::PKey::EC::IES::IESError) { OpenSSL::PKey::EC::IES.new(pem, 'ECIES-P256-NOPE') }
+    assert_raises(OpenSSL::PKey::EC::IES::IESError) { OpenSSL::PKey::EC::IES.new(pem, 'ECIES-P384-AES256CBC-SHA384') }
+  end
+
+  def test_encrypt_then_decrypt_from_many_threads
+    source = 'b' * (256 * 1024 + 3)
+    results = 4.times.map {
+      Thread.new { 3.times.map { @ec.private_decrypt(@ec.public_encrypt(source)) } }
+    }.map(&:value).flatten
+    assert_equal [source] * 12, results
+  end
+
+  def test_batch_encrypt_then_decrypt
+    sources = ['', 'a', 'b' * 16, 'c' * 1000]
+    cryptograms = @ec.public_encrypt_batch(sources)
+    assert_kind_of OpenSSL::PKey::EC::IES::IESError, cryptograms[0]
+    assert_equal sources.drop(1), cryptograms.drop(1).map { |c| @ec.private_decrypt(c) }
+    assert_equal sources.drop(1), @ec.private_decrypt_batch(cryptograms.drop(1))
+  end
+
+  def test_batch_decrypt_reports_failures_per_item
+    good = @ec.public_encrypt('good')
+    tampered = good.dup
+    tampered[-1] = (tampered[-1].ord ^ 1).chr
+    results = @ec.private_decrypt_batch([good, 'short', tampered, good])
+    assert_equal 'good', results[0]
+    assert_match(/too short/, results[1].message)
+    assert_match(/MAC tag verification failed/, results[2].message)
+    assert_equal 'good', results[3]
+    assert_raises(TypeError) { @ec.private_decrypt_batch([good, 1]) }
+  end
+
+  def test_batch_encrypt_makes_keys_that_decrypt_one_by_one
+    sources = 40.times.map { |i| "record #{i}" }
+    %w[prime256v1 secp384r1 secp521r1 sect163k1].each do |curve|
+      ies = OpenSSL::PKey::EC::IES.new(generate_pem(curve), "placeholder")
+      cryptograms = ies.public_encrypt_batch(sources)
+      assert_equal sources, cryptograms.map { |c| ies.private_decrypt(c) }, curve
+    end
+  end
+
+  def test_batch_encrypt_interleaves_cbc_streams_compatibly
+    sources = 24.times.map { |i| 'p' * (i * 37 % 100) + 'q' * 16 * (i % 3) } + ['x' * (64 * 1024 + 1)]
+    sources[5] = 'a' * 48
+    pem = generate_pem('secp384r1')
+    ies = OpenSSL::PKey::EC::IES.new(pem, 'ECIES-P384-AES256CBC-SHA384')
+    cryptograms = ies.public_encrypt_batch(sources)
+    assert_kind_of OpenSSL::PKey::EC::IES::IESError, cryptograms[0]
+    assert_equal sources.drop(1), cryptograms.drop(1).map { |c| ies.private_decrypt(c) }
+  end
+
+  def test_batch_kdf_matches_one_by_one_for_sha256_suites
+    sources = 20.times.map { |i| "record #{i}" }
+    pem = generate_pem('prime256v1')
+    %w[ECIES-P256-AES128CBC-SHA256 ECIES-P256-AES128GCM-SHA256].each do |suite|
+      ies = OpenSSL::PKey::EC::IES.new(pem, suite)
+      assert_equal sources, ies.public_encrypt_batch(sources).map { |c| ies.private_decrypt(c) }, suite
+      assert_equal sources, ies.private_decrypt_batch(sources.map { |s| ies.public_encrypt(s) }), suite
+    end
+  end
+
+  def test_batch_decrypt_restores_keys_around_bad_points
+    sources = 40.times.map { |i| "row #{i}" }
+    %w[prime256v1 secp384r1 sect163k1].each do |curve|
+      ies = OpenSSL::PKey::EC::IES.new(generate_pem(curve), "placeholder")
+      cryptograms = sources.map { |source| ies.public_encrypt(source) }
+      cryptograms[3].setbyte(0, 0)
+      cryptograms[17].setbyte(1, cryptograms[17].getbyte(1) ^ 1)
+      results = ies.private_decrypt_batch(cryptograms)
+      assert_kind_of OpenSSL::PKey::EC::IES::IESError, results[3], curve
+      assert_kind_of OpenSSL::PKey::EC::IES::IESError, results[17], curve
+      assert_equal sources.values_at(0..2, 4..16, 18..39), results.values_at(0..2, 4..16, 18..39), curve
+    end
+  end
+
+  def test_batch_on_worker_threads
+    OpenSSL::PKey::EC::IES.configure(threads: 3)
+    assert_equal 3, OpenSSL::PKey::EC::IES.threads
+    sources = 300.times.map { |i| i % 50 == 0 ? 'x' * (300 * 1024) : "message #{i}" }
+    sources[7] = ''
+    cryptograms = @ec.public_encrypt_batch(sources)
+    assert_kind_of OpenSSL::PKey::EC::IES::IESError, cryptograms[7]
+    cryptograms[7] = 'short'
+    results = @ec.private_decrypt_batch(cryptograms)
+    assert_kind_of OpenSSL::PKey::EC::IES::IESError, results[7]
+    results[7] = ''
+    assert_equal sources, results
+    assert_raises(ArgumentError) { OpenSSL::PKey::EC::IES.configure(threads: 0) }
+  ensure
+    OpenSSL::PKey::EC::IES.configure(threads: 1)
+  end
+
+  def test_batch_waiting_for_busy_workers_can_be_interrupted
+    require 'timeout'
+    OpenSSL::PKey::EC::IES.configure(threads: 2)
+    ies = OpenSSL::PKey::EC::IES.new(generate_pem('secp521r1'), "placeholder")
+    # Scale the busy batch to this host, so that it holds the pool for about
+    # two seconds, far longer than the interrupted batch may take to give up
+    sample = 200.times.map { |i| "record #{i}" }
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    ies.public_encrypt_batch(sample)
+    per_record = (Process.clock_gettime(Process::CLOCK_MONOTONIC) - started) / sample.size
+    sources = (2.0 / per_record).ceil.times.map { |i| "record #{i}" }
+
+    busy = Thread.new { ies.public_encrypt_batch(sources) }
+    sleep 0.1
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    assert_raises(Timeout::Error) { Timeout.timeout(0.1) { ies.public_encrypt_batch(sample) } }
+    waited = Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+    assert_operator waited, :<, 1.0, 'the waiting batch was only interrupted once the other one was done'
+    cryptograms = busy.value
+    assert_equal sources.size, cryptograms.size
+    assert_equal sources.first(10), cryptograms.first(10).map { |c| ies.private_decrypt(c) }
+  ensure
+    busy&.join
+    OpenSSL::PKey::EC::IES.configure(threads: 1)
+  end
+
+  def test_batch_survives_compaction_from_another_thread
+    skip 'GC.compact is not supported' unless GC.respond_to?(:compact)
+    ies = OpenSSL::PKey::EC::IES.new(generate_pem('secp521r1'), "placeholder")
+    sources = 300.times.map { |i| "record #{i}" }
+    running = true
+    compactor = Thread.new { GC.compact while running }
+    [1, 3].each do |threads|
+      OpenSSL::PKey::EC::IES.configure(threads: threads)
+      2.times do
+        assert_equal sources, ies.private_decrypt_batch(ies.public_encrypt_batch(sources)), threads
+      end
+    end
+  ensure
+    running = false
+    compactor&.join
+    OpenSSL::PKey::EC::IES.configure(threads: 1)
+  end
+
+  # Option that turns the built-in code for each curve on or off
+  ENGINES = { 'prime256v1' => :p256, 'secp256k1' => :k256 }
+
+  def test_curve_engines_interoperate_with_openssl
+    ENGINES.each do |curve, option|
+      pem = generate_pem(curve)
+      engine = OpenSSL::PKey::EC::IES.new(pem, "placeholder", option => true)
+      openssl = OpenSSL::PKey::EC::IES.new(pem, "placeholder", option => false)
+      sources = 40.times.map { |i| "record #{i}" }
+      [[engine, openssl], [openssl, engine]].each do |sender, recipient|
+        assert_equal sources, sources.map { |source| recipient.private_decrypt(sender.public_encrypt(source)) }, curve
+        assert_equal sources, recipient.private_decrypt_batch(sender.public_encrypt_batch(sources)), curve
+      end
+    end
+  end
+
+  def test_curve_engines_reject_bad_points
+    ENGINES.each do |curve, option|
+      ies = OpenSSL::PKey::EC::IES.new(generate_pem(curve), "placeholder", option => true)
+      uncompressed = ies.public_encrypt('prefix')
+      uncompressed.setbyte(0, 4)
+      beyond_p = ies.public_encrypt('x >= p')
+      beyond_p[1, 32] = "\xff".b * 32
+      [uncompressed, beyond_p].each do |cryptogram|
+        error = assert_raises(OpenSSL::PKey::EC::IES::IESError) { ies.private_decrypt(cryptogram) }
+        assert_match(/not a point on the curve/, error.message)
+      end
+    end
+  end
+
+  def test_ladder_interoperates_with_openssl
+    %w[prime192v1 secp224r1 secp384r1].each do |curve|
+      pem = generate_pem(curve)
+      ladder = OpenSSL::PKey::EC::IES.new(pem, "placeholder", ladder: true)
+      openssl = OpenSSL::PKey::EC::IES.new(pem, "placeholder", ladder: false)
+      sources = 40.times.map { |i| "record #{i}" }
+      cryptograms = openssl.public_encrypt_batch(sources)
+      assert_equal sources, cryptograms.map { |cryptogram| ladder.private_decrypt(cryptogram) }, curve
+      assert_equal sources, ladder.private_decrypt_batch(cryptograms), curve
+    end
+  end
+
+  def test_ladder_rejects_what_openssl_rejects
+    pem = generate_pem('prime192v1')
+    ladder = OpenSSL::PKey::EC::IES.new(pem, "placeholder", ladder: true)
+    openssl = OpenSSL::PKey::EC::IES.new(pem, "placeholder", ladder: false)
+    original = ladder.public_encrypt('twist')
+    # about half of these x are not on the curve, the others fail the MAC
+    (1..16).each do |mask|
+      cryptogram = original.dup
+      cryptogram.setbyte(24, cryptogram.getbyte(24) ^ mask)
+      ladder_error = assert_raises(OpenSSL::PKey::EC::IES::IESError) { ladder.private_decrypt(cryptogram) }
+      openssl_error = assert_raises(OpenSSL::PKey::EC::IES::IESError) { openssl.private_decrypt(cryptogram) }
+      assert_equal openssl_error.message.include?('MAC'), ladder_error.message.include?('MAC'), openssl_error.message
+    end
+    beyond_p = original.dup
+    beyond_p[1, 24] = "\xff".b * 24
+    error = assert_raises(OpenSSL::PKey::EC::IES::IESError) { ladder.private_decrypt(beyond_p) }
+    assert_match(/not a point on the curve/, error.message)
+  end
+
+  def test_x25519_encrypt_then_decrypt
+    skip 'X25519 needs OpenSSL 1.1.1' unless defined?(OpenSSL::PKey::IES)
+    # 32 bytes of ephemeral key, then nonce, body and tag or body and HMAC
+    { 'ECIES-X25519-AES128GCM-SHA256' => 32 + 12 + 6 + 16, 'placeholder' => 32 + 16 + 20 }.each do |spec, length|
+      recipient = OpenSSL::PKey::IES.generate(spec)
+      sender = OpenSSL::PKey::IES.new(recipient.public_to_pem, spec)
+      assert recipient.private_key?
+      refute sender.private_key?
+      cryptogram = sender.public_encrypt('x25519')
+      assert_equal 'x25519', recipient.private_decrypt(cryptogram)
+      assert_equal length, cryptogram.bytesize
+      sources = 40.times.map { |i| "record #{i}" }
+      assert_equal sources, recipient.private_decrypt_batch(sender.public_encrypt_batch(sources))
+      assert_raises(OpenSSL::PKey::IES::IESError) { sender.private_decrypt(cryptogram) }
+    end
+  end
+
+  def test_x25519_rejects_other_keys_and_low_order_points
+    skip 'X25519 needs OpenSSL 1.1.1' unless defined?(OpenSSL::PKey::IES)
+    assert_raises(OpenSSL::PKey::IES::IESError) { OpenSSL::PKey::IES.generate('ECIES-P256-AES128GCM-SHA256') }
+    assert_raises(OpenSSL::PKey::EC::IES::IESError) do
+      OpenSSL::PKey::EC::IES.new(generate_pem('prime256v1'), 'ECIES-X25519-AES128GCM-SHA256')
+    end
+    error = assert_raises(OpenSSL::PKey::IES::IESError) do
+      OpenSSL::PKey::IES.new(generate_pem('prime256v1'), 'placeholder')
+    end
+    assert_match(/not an X25519 key/, error.message)
+
+    ies = OpenSSL::PKey::IES.generate('ECIES-X25519-AES128GCM-SHA256')
+    cryptogram = ies.public_encrypt('low order')
+    cryptogram[0, 32] = "\0".b * 32
+    assert_raises(OpenSSL::PKey::IES::IESError) { ies.private_decrypt(cryptogram) }
+  end
 end